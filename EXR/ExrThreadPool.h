@@ -0,0 +1,68 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX exr thread pool.
+ * The size of the OpenEXR global thread pool, shared by the EXR readers and writers.
+ */
+
+#ifndef __Io__exrThreadPool__
+#define __Io__exrThreadPool__
+
+#include <cstdlib>
+
+#include <ImfThreading.h>
+
+#include "ofxsMultiThread.h"
+
+#ifndef OPENEXR_IMF_NAMESPACE
+#define OPENEXR_IMF_NAMESPACE Imf
+#endif
+
+// The number of threads used by OpenEXR to compress and decompress the blocks of lines or tiles of the images
+// (default: the number of CPUs). The pool is shared by all the EXR readers and writers of the process.
+#define kExrThreadsEnvVar "OFX_IO_EXR_THREADS"
+
+namespace Exr {
+
+    // Grow the OpenEXR global thread pool to the configured size if it is smaller, and return its size.
+    // The pool is never shrunk: resizing it waits for the tasks of all the open files, and the host may
+    // have made it larger.
+    inline int ensureGlobalThreadCount()
+    {
+        int nThreads = 0;
+        const char* env = std::getenv(kExrThreadsEnvVar);
+        if (env) {
+            nThreads = std::atoi(env);
+        }
+        if (nThreads <= 0) {
+            nThreads = (int)OFX::MultiThread::getNumCPUs();
+        }
+        const int current = OPENEXR_IMF_NAMESPACE::globalThreadCount();
+        if (current >= nThreads) {
+            return current;
+        }
+        // concurrent calls set the same size: the second one does nothing
+        OPENEXR_IMF_NAMESPACE::setGlobalThreadCount(nThreads);
+
+        return nThreads;
+    }
+
+}
+
+#endif /* defined(__Io__exrThreadPool__) */
@@ -22,11 +22,21 @@
  */
 
 #include "ReadEXR.h"
+#include "ExrThreadPool.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 #ifdef DEBUG
 #include <iostream>
 #endif
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <string>
@@ -37,16 +47,22 @@
 #endif
 #endif
 
+#include <Iex.h>
+#include <ImfIO.h>
 #include <ImfPixelType.h>
 #include <ImfChannelList.h>
 #include <ImfInputFile.h>
+#include <ImfTiledInputFile.h>
+#include <ImfTestFile.h>
+#include <ImfThreading.h>
 
-#ifdef OFX_IO_MT_EXR
 #include <ofxsMultiThread.h>
-#endif
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
+#include "IOMappedFile.h"
+#include "IOThread.h"
+#include "IOUtility.h"
 
 
 #define kPluginName "ReadEXR"
@@ -61,11 +77,28 @@
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
 namespace Imf_ = OPENEXR_IMF_NAMESPACE;
+#ifndef IEX_NAMESPACE
+#define IEX_NAMESPACE Iex
+#endif
+
+// Files are read through buffered streams, unless this environment variable is set to 1, in which
+// case the files that are not on a network filesystem are memory-mapped. Mapping is faster, but
+// a file truncated by another process while it is read (e.g. a render still writing the sequence)
+// then crashes the host instead of failing to read.
+#define kMmapEnvVar "OFX_IO_EXR_MMAP"
 
 #define kSupportsRGBA true
-#define kSupportsRGB false
-#define kSupportsAlpha false
-#define kSupportsTiles false
+#define kSupportsRGB true
+#define kSupportsAlpha true
+#define kSupportsTiles true
+#define kSupportsPrefetch true
+
+// minimum number of lines decoded by each call to OpenEXR: it must hold several blocks of lines
+// (up to 256 lines for DWAB) so that they are decompressed in parallel
+#define kDecodeBandMinLines 256
+// maximum size of the intermediate buffer holding a band of lines, which wins over kDecodeBandMinLines
+// for very wide images
+#define kDecodeBandMaxBytes (8 * 1024 * 1024)
 
 class ReadEXRPlugin : public GenericReaderPlugin
 {
@@ -77,6 +110,9 @@ public:
 
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /** @brief Overriden to close the EXR files that are not being read */
+    virtual void purgeCaches(void) OVERRIDE FINAL;
+
 private:
 
     virtual bool isVideoStream(const std::string& /*filename*/) OVERRIDE FINAL { return false; }
@@ -84,6 +120,12 @@ private:
     virtual void decode(const std::string& filename, OfxTime time, int /*view*/, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
 
     virtual bool getFrameBounds(const std::string& /*filename*/,OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
+
+    virtual bool getFrameBoundsForPrefetch(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par) OVERRIDE FINAL;
+
+    virtual bool decodeForPrefetch(const std::string& filename, OfxTime time, int view, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes) OVERRIDE FINAL;
+
+    virtual OFX::BitDepthEnum getFrameBitDepth(const std::string& filename, OfxTime time) OVERRIDE FINAL;
     
     virtual void onInputFileChanged(const std::string& newFile, bool setColorSpace, OFX::PreMultiplicationEnum *premult, OFX::PixelComponentEnum *components, int *componentCount) OVERRIDE FINAL;
 };
@@ -268,167 +310,488 @@ namespace Exr {
         }
     };
     
-    struct File {
-        
-        File(const std::string& filename);
-        
-        
-        ~File();
-        
-        Imf::InputFile* inputfile;
-        
-        typedef std::map<Channel, std::string> ChannelsMap;
-        ChannelsMap channel_map;
-        int dataOffset;
-        std::vector<std::string> views;
-        OfxRectI displayWindow;
-        OfxRectI dataWindow;
-        float pixelAspectRatio;
-#if defined(_WIN32) && !defined(__MINGW32__)
-        std::ifstream* inputStr;
-        Imf::StdIFStream* inputStdStream;
-#endif
-#ifdef OFX_IO_MT_EXR
-        OFX::MultiThread::Mutex lock;
-#endif
 #ifdef _WIN32
-        inline std::wstring s2ws(const std::string& s)
+    inline std::wstring s2ws(const std::string& s)
+    {
+        int len;
+        int slength = (int)s.length() + 1;
+        len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
+        wchar_t* buf = new wchar_t[len];
+        MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
+        std::wstring r(buf);
+        delete[] buf;
+        return r;
+    }
+#endif
+
+    // An input stream reading from a memory-mapped file. OpenEXR reads the uncompressed
+    // pixel data directly from the mapping, and everything else with a single memcpy.
+    // The mapping is shared by all the streams of a file, and must outlive them.
+    class MappedIStream : public Imf_::IStream
+    {
+    public:
+        MappedIStream(const std::string& filename, const IO::MappedFile& file)
+        : Imf_::IStream(filename.c_str())
+        , _file(file)
+        , _size((Imf_::Int64)file.size())
+        , _pos(0)
         {
-            int len;
-            int slength = (int)s.length() + 1;
-            len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
-            wchar_t* buf = new wchar_t[len];
-            MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
-            std::wstring r(buf);
-            delete[] buf;
-            return r;
         }
+
+        // map a file, or return NULL if the file cannot be mapped, or should not be mapped
+        static IO::MappedFile* map(const std::string& filename);
+
+        virtual bool isMemoryMapped() const OVERRIDE FINAL { return true; }
+
+        virtual bool read(char c[/*n*/], int n) OVERRIDE FINAL;
+
+        virtual char* readMemoryMapped(int n) OVERRIDE FINAL;
+
+        virtual Imf_::Int64 tellg() OVERRIDE FINAL { return _pos; }
+
+        virtual void seekg(Imf_::Int64 pos) OVERRIDE FINAL { _pos = pos; }
+
+    private:
+        const IO::MappedFile& _file;
+        Imf_::Int64 _size;
+        Imf_::Int64 _pos;
+    };
+
+    IO::MappedFile* MappedIStream::map(const std::string& filename)
+    {
+        const char* env = std::getenv(kMmapEnvVar);
+        if (!env || std::atoi(env) == 0) {
+            return 0;
+        }
+        return IO::MappedFile::open(filename);
+    }
+
+    bool MappedIStream::read(char c[/*n*/], int n)
+    {
+        if (n < 0 || _pos > _size || (Imf_::Int64)n > _size - _pos) {
+            throw IEX_NAMESPACE::InputExc("Unexpected end of file.");
+        }
+        std::memcpy(c, _file.data() + _pos, n);
+        _pos += n;
+
+        return _pos < _size;
+    }
+
+    char* MappedIStream::readMemoryMapped(int n)
+    {
+        if (n < 0 || _pos > _size || (Imf_::Int64)n > _size - _pos) {
+            throw IEX_NAMESPACE::InputExc("Unexpected end of file.");
+        }
+        // OpenEXR does not write through the returned pointer
+        char* data = const_cast<char*>(_file.data()) + _pos;
+        _pos += n;
+
+        return data;
+    }
+
+    // An opened OpenEXR file. Each handle has its own stream and frame buffer, so that
+    // several threads can read the same file concurrently, each with its own handle.
+    struct Handle {
+
+        // mapping is the mapping of the file shared by its handles, or NULL if it is not mapped
+        Handle(const std::string& filename, const IO::MappedFile* mapping);
+
+        ~Handle();
+
+        // exactly one of these is opened, depending on whether the file is tiled or not
+        Imf::InputFile* inputfile;
+        Imf::TiledInputFile* tiledfile;
+        Imf::IStream* stream; ///< the stream the file is read from, or NULL if OpenEXR opened it by name
+#if defined(_WIN32) && !defined(__MINGW32__)
+        std::ifstream* inputStr;
 #endif
+
+        const Imf::Header& header() const { return tiledfile ? tiledfile->header() : inputfile->header(); }
+
+    private:
+        Handle(const Handle&);
+        Handle& operator=(const Handle&);
     };
-    
-    File::File(const std::string& filename)
+
+    Handle::Handle(const std::string& filename, const IO::MappedFile* mapping)
     : inputfile(0)
-    , channel_map()
-    , dataOffset(0)
-    , views()
-    , displayWindow()
-    , dataWindow()
-    , pixelAspectRatio(1.)
+    , tiledfile(0)
+    , stream(0)
 #if defined(_WIN32) && !defined(__MINGW32__)
     , inputStr(0)
-    , inputStdStream(0)
-#endif
-#ifdef OFX_IO_MT_EXR
-    , lock()
 #endif
     {
-        
-        try{
+        try {
+            if (mapping) {
+                stream = new MappedIStream(filename, *mapping);
+            }
 #if defined(_WIN32) && !defined(__MINGW32__)
-            inputStr = new std::ifstream(s2ws(filename),std::ios_base::binary);
-            inputStdStream = new Imf_::StdIFStream(*inputStr,filename.c_str());
-            inputfile = new Imf_::InputFile(*inputStdStream);
-#else
-            
-            inputfile = new Imf_::InputFile(filename.c_str());
+            if (!stream) {
+                inputStr = new std::ifstream(s2ws(filename),std::ios_base::binary);
+                stream = new Imf_::StdIFStream(*inputStr,filename.c_str());
+            }
 #endif
-        
-            
-            // convert exr channels to our channels
-            const Imf_::ChannelList& imfchannels = inputfile->header().channels();
-            
-            for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
-                
-                std::string chanName(chan.name());
-                
-                ///empty channel, discard it
-                if(chanName.empty()){
-                    continue;
+            bool isTiled = false;
+            if (stream) {
+                Imf_::isOpenExrFile(*stream, isTiled);
+                if (isTiled) {
+                    tiledfile = new Imf_::TiledInputFile(*stream);
+                } else {
+                    inputfile = new Imf_::InputFile(*stream);
                 }
-                
-                ///convert the channel to ours
-                ChannelExtractor exrExctractor(chan.name(),views);
-                
-                ///if we successfully extracted the channels
-                if (exrExctractor.isValid()) {
-                    ///register the extracted channel
-                    channel_map.insert(std::make_pair(exrExctractor._mappedChannel,exrExctractor._chan));
+            } else {
+                Imf_::isOpenExrFile(filename.c_str(), isTiled);
+                if (isTiled) {
+                    // read only the tiles that intersect the render window
+                    tiledfile = new Imf_::TiledInputFile(filename.c_str());
                 } else {
-#                 ifdef DEBUG
-                    std::cout << "Cannot decode channel " << chan.name() << std::endl;
-#                 endif
+                    inputfile = new Imf_::InputFile(filename.c_str());
                 }
-                
             }
+        } catch (...) {
+            delete inputfile;
+            delete tiledfile;
+            delete stream;
+#if defined(_WIN32) && !defined(__MINGW32__)
+            delete inputStr;
+#endif
+            throw;
+        }
+    }
+
+    Handle::~Handle()
+    {
+        delete inputfile;
+        delete tiledfile;
+        delete stream;
+#if defined(_WIN32) && !defined(__MINGW32__)
+        delete inputStr;
+#endif
+    }
+
+    // The metadata of an EXR file, which stays cached after the file is closed
+    struct FileInfo {
+
+        FileInfo()
+        : channel_map()
+        , dataOffset(0)
+        , displayWindow()
+        , dataWindow()
+        , pixelAspectRatio(1.)
+        , exrDisplayWindow()
+        , exrDataWindow()
+        , isHalf(false)
+        {
+        }
+
+        typedef std::map<Channel, std::string> ChannelsMap;
+        ChannelsMap channel_map;
+        int dataOffset;
+        OfxRectI displayWindow;
+        OfxRectI dataWindow;
+        float pixelAspectRatio;
+        Imath::Box2i exrDisplayWindow;
+        Imath::Box2i exrDataWindow;
+        bool isHalf; ///< all the channels in channel_map are HALF
+    };
+
+    // Identifies the contents of a file: a file rewritten in place or replaced by another one
+    // changes its size, modification time or inode.
+    struct FileStamp {
+
+        FileStamp()
+        : mtime(0)
+        , size(-1)
+        , inode(0)
+        {
+        }
+
+        bool operator==(const FileStamp& other) const { return mtime == other.mtime && size == other.size && inode == other.inode; }
+
+        bool operator!=(const FileStamp& other) const { return !(*this == other); }
+
+        std::time_t mtime;
+        long long size;
+        unsigned long long inode; ///< always 0 on Windows
+    };
+
+    // returns a default stamp, which matches no file, if the file cannot be read
+    static FileStamp getFileStamp(const std::string& filename)
+    {
+        FileStamp stamp;
+#ifdef _WIN32
+        struct __stat64 st;
+        if (_stat64(filename.c_str(), &st) != 0) {
+            return stamp;
+        }
+#else
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) {
+            return stamp;
+        }
+        stamp.inode = (unsigned long long)st.st_ino;
+#endif
+        stamp.mtime = st.st_mtime;
+        stamp.size = (long long)st.st_size;
+        return stamp;
+    }
+
+    struct File {
+        
+        // stamp is the stamp of the file, taken before opening it, so that a concurrent modification reopens it.
+        // maxHandles is the maximum number of handles opened on the file
+        File(const std::string& filename, const FileStamp& stamp, int maxHandles);
+        
+        
+        ~File();
+
+        // get a handle that no other thread uses, opening a new one if all are in use and there
+        // are less than maxHandles. Throws if the file cannot be opened.
+        Handle* acquireHandle();
+
+        void releaseHandle(Handle* handle);
+
+        // the number of opened handles, free or in use
+        int getHandleCount() const;
+
+        const FileInfo& info() const { return _info; }
+
+        // the stamp of the file when it was opened
+        const FileStamp& stamp() const { return _stamp; }
+
+    private:
+        friend class FileManager;
+
+        const std::string _filename;
+        const FileStamp _stamp;
+        std::auto_ptr<IO::MappedFile> _mapping; ///< shared by the handles, which are deleted first
+        FileInfo _info;
+        mutable IO::Mutex _handlesLock;
+        IO::Condition _handleReleased;
+        std::list<Handle*> _freeHandles;
+        int _nHandles; ///< the number of opened handles, free or in use
+        const int _maxHandles;
+        int _refs; ///< the number of users of this file, protected by the FileManager lock
+        int _countedHandles; ///< the handles counted in the FileManager total, protected by the FileManager lock
+        bool _outdated; ///< the file changed on disk: it was removed from the FileManager, and is deleted by its last user
+    };
+    
+    File::File(const std::string& filename, const FileStamp& stamp, int maxHandles)
+    : _filename(filename)
+    , _stamp(stamp)
+    , _mapping(MappedIStream::map(filename))
+    , _info()
+    , _handlesLock()
+    , _handleReleased()
+    , _freeHandles()
+    , _nHandles(0)
+    , _maxHandles(std::max(1, maxHandles))
+    , _refs(0)
+    , _countedHandles(0)
+    , _outdated(false)
+    {
+        Handle* handle = new Handle(filename, _mapping.get());
+        _freeHandles.push_back(handle);
+        _nHandles = 1;
+
+        const Imf::Header& header = handle->header();
+        std::vector<std::string> views;
+
+        // convert exr channels to our channels
+        const Imf_::ChannelList& imfchannels = header.channels();
+        
+        for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
             
-            const Imath::Box2i& datawin = inputfile->header().dataWindow();
-            const Imath::Box2i& dispwin = inputfile->header().displayWindow();
-            Imath::Box2i formatwin(dispwin);
-            formatwin.min.x = 0;
-            formatwin.min.y = 0;
-            dataOffset = 0;
+            std::string chanName(chan.name());
             
-            if (dispwin.min.x != 0) {
-                // Shift both to get dispwindow over to 0,0.
-                dataOffset = -dispwin.min.x;
-                formatwin.max.x = dispwin.max.x + dataOffset;
+            ///empty channel, discard it
+            if(chanName.empty()){
+                continue;
             }
-            formatwin.max.y = dispwin.max.y - dispwin.min.y;
             
-            displayWindow.x1 = 0;
-            displayWindow.y1 = 0;
-            displayWindow.x2 = formatwin.max.x + 1;
-            displayWindow.y2 = formatwin.max.y;
+            ///convert the channel to ours
+            ChannelExtractor exrExctractor(chan.name(),views);
             
-            int left = datawin.min.x + dataOffset;
-            int bottom = dispwin.max.y - datawin.max.y;
-            int right = datawin.max.x + dataOffset;
-            int top = dispwin.max.y - datawin.min.y;
-            if (datawin.min.x != dispwin.min.x || datawin.max.x != dispwin.max.x ||
-                datawin.min.y != dispwin.min.y || datawin.max.y != dispwin.max.y) {
-                --left;
-                --bottom;
-                ++right;
-                ++top;
+            ///if we successfully extracted the channels
+            if (exrExctractor.isValid()) {
+                ///register the extracted channel
+                _info.channel_map.insert(std::make_pair(exrExctractor._mappedChannel,exrExctractor._chan));
+            } else {
+#                 ifdef DEBUG
+                std::cout << "Cannot decode channel " << chan.name() << std::endl;
+#                 endif
             }
-            dataWindow.x1 = left;
-            dataWindow.x2 = right + 1;
-            dataWindow.y1 = bottom;
-            dataWindow.y2 = top + 1;
+            
+        }
+        
+        const Imath::Box2i& datawin = header.dataWindow();
+        const Imath::Box2i& dispwin = header.displayWindow();
+        Imath::Box2i formatwin(dispwin);
+        formatwin.min.x = 0;
+        formatwin.min.y = 0;
+        int dataOffset = 0;
+        
+        if (dispwin.min.x != 0) {
+            // Shift both to get dispwindow over to 0,0.
+            dataOffset = -dispwin.min.x;
+            formatwin.max.x = dispwin.max.x + dataOffset;
+        }
+        formatwin.max.y = dispwin.max.y - dispwin.min.y;
+        
+        _info.displayWindow.x1 = 0;
+        _info.displayWindow.y1 = 0;
+        _info.displayWindow.x2 = formatwin.max.x + 1;
+        _info.displayWindow.y2 = formatwin.max.y;
+        
+        int left = datawin.min.x + dataOffset;
+        int bottom = dispwin.max.y - datawin.max.y;
+        int right = datawin.max.x + dataOffset;
+        int top = dispwin.max.y - datawin.min.y;
+        if (datawin.min.x != dispwin.min.x || datawin.max.x != dispwin.max.x ||
+            datawin.min.y != dispwin.min.y || datawin.max.y != dispwin.max.y) {
+            --left;
+            --bottom;
+            ++right;
+            ++top;
+        }
+        _info.dataWindow.x1 = left;
+        _info.dataWindow.x2 = right + 1;
+        _info.dataWindow.y1 = bottom;
+        _info.dataWindow.y2 = top + 1;
 
-            pixelAspectRatio = inputfile->header().pixelAspectRatio();
-        }catch(const std::exception& e) {
-#if defined(_WIN32) && !defined(__MINGW32__)
-            delete inputStr;
-            delete inputStdStream;
-#endif
-            delete inputfile;
-            inputfile = 0;
-            throw e;
+        _info.dataOffset = dataOffset;
+        _info.exrDisplayWindow = dispwin;
+        _info.exrDataWindow = datawin;
+        _info.pixelAspectRatio = header.pixelAspectRatio();
+
+        // half if all the channels that are read are half (UINT channels do not fit in a half)
+        _info.isHalf = !_info.channel_map.empty();
+        for (FileInfo::ChannelsMap::const_iterator it = _info.channel_map.begin(); it != _info.channel_map.end(); ++it) {
+            const Imf_::Channel* c = imfchannels.findChannel(it->second.c_str());
+            if (!c || c->type != Imf_::HALF) {
+                _info.isHalf = false;
+            }
         }
     }
     
     File::~File(){
-#if defined(_WIN32) && !defined(__MINGW32__)
-        delete inputStr;
-        delete inputStdStream;
-#endif
-        delete inputfile;
+        // all the handles should have been released
+        assert((int)_freeHandles.size() == _nHandles);
+        for (std::list<Handle*>::iterator it = _freeHandles.begin(); it != _freeHandles.end(); ++it) {
+            delete *it;
+        }
     }
+
+    Handle* File::acquireHandle()
+    {
+        {
+            IO::AutoMutex l(_handlesLock);
+            while (_freeHandles.empty() && _nHandles >= _maxHandles) {
+                _handleReleased.wait(_handlesLock);
+            }
+            if (!_freeHandles.empty()) {
+                Handle* handle = _freeHandles.front();
+                _freeHandles.pop_front();
+                return handle;
+            }
+            ++_nHandles;
+        }
+        // open the new handle outside of the lock, so that the other threads are not blocked
+        try {
+            return new Handle(_filename, _mapping.get());
+        } catch (...) {
+            IO::AutoMutex l(_handlesLock);
+            --_nHandles;
+            _handleReleased.wakeOne();
+            throw;
+        }
+    }
+
+    void File::releaseHandle(Handle* handle)
+    {
+        IO::AutoMutex l(_handlesLock);
+        _freeHandles.push_front(handle);
+        _handleReleased.wakeOne();
+    }
+
+    int File::getHandleCount() const
+    {
+        IO::AutoMutex l(_handlesLock);
+        return _nHandles;
+    }
+
+    // holds a handle of a file for the duration of a scope
+    class HandleLocker
+    {
+    public:
+        explicit HandleLocker(File& file)
+        : _file(file)
+        , _handle(file.acquireHandle())
+        {
+        }
+
+        ~HandleLocker()
+        {
+            _file.releaseHandle(_handle);
+        }
+
+        Handle* operator->() const { return _handle; }
+
+    private:
+        HandleLocker(const HandleLocker&);
+        HandleLocker& operator=(const HandleLocker&);
+
+        File& _file;
+        Handle* _handle;
+    };
+
+// The maximum number of file handles kept open by all the ReadEXR instances can be set using
+// this environment variable.
+#define kMaxOpenHandlesEnvVar "OFX_IO_EXR_MAX_OPEN_FILES"
+#define kMaxOpenHandlesDefault 64
+// the number of files whose metadata is kept after they are closed
+#define kMaxCachedInfos 4096
     
-    // Keeps track of all Exr::File mapped against file name.
+    // Keeps the Exr::File opened for reading, mapped against file name.
+    // The files that are not in use are closed, least recently used first, when more than
+    // maxOpenHandles handles are open. Their metadata stays in a separate cache, so that
+    // getting the bounds of a closed file does not reopen it.
+    // The files and the metadata are checked against the file on disk each time they are used:
+    // a file that was rewritten is reopened, and its old mapping is never read again (reading
+    // a mapping of a truncated file would crash).
+    // The files are checked and opened outside of the lock, so that a slow filesystem only blocks
+    // the threads that read the same file.
     class FileManager
     {
-        typedef std::map<std::string, File*> FilesMap;
+        struct OpenFile {
+            File* file; ///< NULL while it is opened by another thread
+            std::list<std::string>::iterator lru;
+        };
+        typedef std::map<std::string, OpenFile> FilesMap;
+
+        struct CachedInfo {
+            FileInfo info;
+            FileStamp stamp;
+            std::list<std::string>::iterator lru;
+        };
+        typedef std::map<std::string, CachedInfo> InfosMap;
 
         FilesMap _files;
+        std::list<std::string> _filesLru; ///< most recently used first
+        InfosMap _infos;
+        std::list<std::string> _infosLru; ///< most recently used first
         bool _isLoaded;///< register all "global" flags to ffmpeg outside of the constructor to allow
         /// all OpenFX related stuff (which depend on another singleton) to be allocated.
 
-#ifdef OFX_IO_MT_EXR
-        // internal lock
-        OFX::MultiThread::Mutex *_lock;
-#endif
+        // internal lock. The files are also opened by the read-ahead threads, which may not use the host suites.
+        mutable IO::Mutex _lock;
+        IO::Condition _opened; ///< signaled when a file has been opened, or failed to open
+        int _nHandles; ///< the handles counted by the files of _files (see File::_countedHandles)
+        int _maxOpenHandles;
+        int _maxHandlesPerFile; ///< as many handles as render threads, set on a host thread by initialize()
+        unsigned long _hits;
+        unsigned long _misses;
+        unsigned long _evictions;
         
     public:
         
@@ -442,8 +805,50 @@ namespace Exr {
         
         void initialize();
         
-        // get a specific reader
-        File* get(const std::string& filename);
+        // get a specific reader, which is not closed until it is released. Throws if the file cannot be opened.
+        File* acquire(const std::string& filename);
+
+        void release(File* file);
+
+        // get the metadata of a file, opening it if it is not cached. Throws if the file cannot be opened.
+        FileInfo getInfo(const std::string& filename);
+
+        // close all the files that are not in use, and forget their metadata
+        void purge();
+
+        void getStats(unsigned long* hits, unsigned long* misses, unsigned long* evictions) const;
+
+    private:
+        // stamp is the current stamp of the file, taken without holding _lock
+        File* acquire(const std::string& filename, const FileStamp& stamp);
+
+        // remove a file from _files, deleting it if it is not in use. _lock must be held.
+        void forgetLocked(FilesMap::iterator it);
+
+        // close the least recently used files until the handles fit in the budget. _lock must be held.
+        void evictLocked();
+
+        // _lock must be held
+        void insertInfoLocked(const std::string& filename, const FileStamp& stamp, const FileInfo& info);
+    };
+
+    // holds a file for the duration of a scope
+    class FileLocker
+    {
+    public:
+        explicit FileLocker(const std::string& filename);
+
+        ~FileLocker();
+
+        File* operator->() const { return _file; }
+
+        File& operator*() const { return *_file; }
+
+    private:
+        FileLocker(const FileLocker&);
+        FileLocker& operator=(const FileLocker&);
+
+        File* _file;
     };
     
     FileManager FileManager::s_readerManager;
@@ -451,47 +856,227 @@ namespace Exr {
     // constructor
     FileManager::FileManager()
     : _files()
+    , _filesLru()
+    , _infos()
+    , _infosLru()
     , _isLoaded(false)
-#ifdef OFX_IO_MT_EXR
-    , _lock(0)
-#endif
+    , _lock()
+    , _opened()
+    , _nHandles(0)
+    , _maxOpenHandles(kMaxOpenHandlesDefault)
+    , _maxHandlesPerFile(1)
+    , _hits(0)
+    , _misses(0)
+    , _evictions(0)
     {
     }
     
     FileManager::~FileManager() {
         for (FilesMap::iterator it = _files.begin(); it!= _files.end(); ++it) {
-            delete it->second;
+            delete it->second.file; // NULL if it is being opened
         }
     }
     
     void FileManager::initialize() {
         if(!_isLoaded){
-#ifdef OFX_IO_MT_EXR
-            _lock = new OFX::MultiThread::Mutex();
-#endif
+            _maxHandlesPerFile = std::max(1, (int)OFX::MultiThread::getNumCPUs());
+            const char* maxOpen = std::getenv(kMaxOpenHandlesEnvVar);
+            if (maxOpen) {
+                _maxOpenHandles = std::max(1, std::atoi(maxOpen));
+            }
             _isLoaded = true;
         }
         
     }
     
-    // get a specific reader
-    File* FileManager::get(const std::string& filename)
+    File* FileManager::acquire(const std::string& filename)
+    {
+        return acquire(filename, getFileStamp(filename));
+    }
+
+    File* FileManager::acquire(const std::string& filename, const FileStamp& stamp)
     {
-        
         assert(_isLoaded);
-#ifdef OFX_IO_MT_EXR
-        OFX::MultiThread::AutoMutex g(*_lock);
-#endif
+        IO::AutoMutex g(_lock);
         FilesMap::iterator it = _files.find(filename);
-        if (it == _files.end()) {
-            std::pair<FilesMap::iterator,bool> ret = _files.insert(std::make_pair(std::string(filename), new File(filename)));
-            assert(ret.second);
-            return ret.first->second;
+        while (it != _files.end() && !it->second.file) {
+            // another thread is opening it
+            _opened.wait(_lock);
+            it = _files.find(filename);
+        }
+        if (it != _files.end()) {
+            File* file = it->second.file;
+            if (stamp == file->stamp()) {
+                ++_hits;
+                _filesLru.splice(_filesLru.begin(), _filesLru, it->second.lru);
+                ++file->_refs;
+                return file;
+            }
+            // the file changed on disk: forget it, and let its current users finish with the old handles
+            forgetLocked(it);
         }
-        else {
-            return it->second;
+        ++_misses;
+        // make room for the new handle before opening it
+        evictLocked();
+
+        // open the file outside of the lock: the other threads wait for it in acquire(), and
+        // evictLocked() and purge() skip it
+        _filesLru.push_front(filename);
+        OpenFile placeholder;
+        placeholder.file = NULL;
+        placeholder.lru = _filesLru.begin();
+        _files.insert(std::make_pair(filename, placeholder));
+        File* file = NULL;
+        _lock.unlock();
+        try {
+            file = new File(filename, stamp, _maxHandlesPerFile);
+        } catch (...) {
+            _lock.lock();
+            it = _files.find(filename);
+            assert(it != _files.end() && !it->second.file);
+            _filesLru.erase(it->second.lru);
+            _files.erase(it);
+            _opened.wakeAll();
+            throw;
+        }
+        _lock.lock();
+        it = _files.find(filename);
+        assert(it != _files.end() && !it->second.file);
+        it->second.file = file;
+        _opened.wakeAll();
+        ++file->_refs;
+        file->_countedHandles = file->getHandleCount();
+        _nHandles += file->_countedHandles;
+        insertInfoLocked(filename, file->stamp(), file->info());
+
+        return file;
+    }
+
+    void FileManager::release(File* file)
+    {
+        assert(_isLoaded && file);
+        IO::AutoMutex g(_lock);
+        assert(file->_refs > 0);
+        --file->_refs;
+        if (file->_outdated) {
+            if (file->_refs == 0) {
+                delete file;
+            }
+            return;
+        }
+        // the handles are only opened by the users of the file, so that the total is up to date
+        // before the file can be closed
+        const int nHandles = file->getHandleCount();
+        _nHandles += nHandles - file->_countedHandles;
+        file->_countedHandles = nHandles;
+        evictLocked();
+    }
+
+    void FileManager::forgetLocked(FilesMap::iterator it)
+    {
+        File* file = it->second.file;
+        assert(file);
+        _nHandles -= file->_countedHandles;
+        _filesLru.erase(it->second.lru);
+        _files.erase(it);
+        if (file->_refs == 0) {
+            delete file;
+        } else {
+            file->_outdated = true;
         }
     }
+
+    void FileManager::evictLocked()
+    {
+        // files in use are never closed, so the budget may be exceeded while they are read
+        std::list<std::string>::iterator it = _filesLru.end();
+        while (_nHandles > _maxOpenHandles && it != _filesLru.begin()) {
+            --it;
+            FilesMap::iterator f = _files.find(*it);
+            assert(f != _files.end());
+            if (f->second.file && f->second.file->_refs == 0) {
+                // forgetLocked() erases the current name: continue from the next one, which was already visited
+                ++it;
+                forgetLocked(f);
+                ++_evictions;
+            }
+        }
+    }
+
+    void FileManager::insertInfoLocked(const std::string& filename, const FileStamp& stamp, const FileInfo& info)
+    {
+        InfosMap::iterator it = _infos.find(filename);
+        if (it != _infos.end()) {
+            it->second.info = info;
+            it->second.stamp = stamp;
+            _infosLru.splice(_infosLru.begin(), _infosLru, it->second.lru);
+            return;
+        }
+        _infosLru.push_front(filename);
+        CachedInfo c;
+        c.info = info;
+        c.stamp = stamp;
+        c.lru = _infosLru.begin();
+        _infos.insert(std::make_pair(filename, c));
+        while (_infos.size() > kMaxCachedInfos) {
+            _infos.erase(_infosLru.back());
+            _infosLru.pop_back();
+        }
+    }
+
+    FileInfo FileManager::getInfo(const std::string& filename)
+    {
+        assert(_isLoaded);
+        const FileStamp stamp = getFileStamp(filename);
+        {
+            IO::AutoMutex g(_lock);
+            InfosMap::iterator it = _infos.find(filename);
+            if (it != _infos.end() && stamp == it->second.stamp) {
+                _infosLru.splice(_infosLru.begin(), _infosLru, it->second.lru);
+                return it->second.info;
+            }
+        }
+        // not cached, or outdated: acquire() reopens the file and updates the metadata
+        File* file = acquire(filename, stamp);
+        FileInfo info = file->info();
+        release(file);
+
+        return info;
+    }
+
+    void FileManager::purge()
+    {
+        assert(_isLoaded);
+        IO::AutoMutex g(_lock);
+        for (FilesMap::iterator it = _files.begin(); it != _files.end();) {
+            if (it->second.file && it->second.file->_refs == 0) {
+                forgetLocked(it++);
+            } else {
+                ++it;
+            }
+        }
+        _infos.clear();
+        _infosLru.clear();
+    }
+
+    void FileManager::getStats(unsigned long* hits, unsigned long* misses, unsigned long* evictions) const
+    {
+        assert(_isLoaded);
+        IO::AutoMutex g(_lock);
+        *hits = _hits;
+        *misses = _misses;
+        *evictions = _evictions;
+    }
+
+    FileLocker::FileLocker(const std::string& filename)
+    : _file(FileManager::s_readerManager.acquire(filename))
+    {
+    }
+
+    FileLocker::~FileLocker()
+    {
+        FileManager::s_readerManager.release(_file);
+    }
     
 }
 
@@ -515,11 +1100,237 @@ ReadEXRPlugin::changedParam(const OFX::InstanceChangedArgs &args,
     GenericReaderPlugin::changedParam(args, paramName);
 }
 
-struct DecodingChannelsMap {
-    float* buf;
-    bool subsampled;
-    std::string channelName;
-};
+void
+ReadEXRPlugin::purgeCaches()
+{
+    GenericReaderPlugin::purgeCaches();
+#ifdef DEBUG
+    unsigned long hits, misses, evictions;
+    Exr::FileManager::s_readerManager.getStats(&hits, &misses, &evictions);
+    std::cout << "ReadEXR open files: " << hits << " hits, " << misses << " misses, " << evictions << " evictions" << std::endl;
+#endif
+    Exr::FileManager::s_readerManager.purge();
+}
+
+// the address of pixel (x,y) in an OFX float image
+static inline float*
+pixelAddress(float* pixelData,
+             const OfxRectI& bounds,
+             int nComps,
+             int rowBytes,
+             int x,
+             int y)
+{
+    return (float*)((char*)pixelData + (std::ptrdiff_t)(y - bounds.y1) * rowBytes) + (std::ptrdiff_t)(x - bounds.x1) * nComps;
+}
+
+// set the pixels of renderWindow which are outside of dataRect to black
+static void
+fillOutsideWithBlack(const OfxRectI& renderWindow,
+                     const OfxRectI& dataRect,
+                     float* pixelData,
+                     const OfxRectI& bounds,
+                     int nComps,
+                     int rowBytes)
+{
+    const int width = renderWindow.x2 - renderWindow.x1;
+    const int left = std::max(0, std::min(dataRect.x1, renderWindow.x2) - renderWindow.x1);
+    const int right = std::max(renderWindow.x1, std::min(dataRect.x2, renderWindow.x2)) - renderWindow.x1;
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        float* row = pixelAddress(pixelData, bounds, nComps, rowBytes, renderWindow.x1, y);
+        if (y < dataRect.y1 || y >= dataRect.y2 || right <= left) {
+            std::fill(row, row + width * nComps, 0.f);
+        } else {
+            std::fill(row, row + left * nComps, 0.f);
+            std::fill(row + right * nComps, row + width * nComps, 0.f);
+        }
+    }
+}
+
+// insert the slices of the exr pixels (x,y) stored at base + (x*nComps+i)*sizeof(float) + y*yStride,
+// where i is the index of the channel in channels. Only these channels are read, and
+// those that are missing from the file are filled with 0 (1 for alpha).
+// Subsampled channels are stored in line firstLine, starting at column subsampledXOffset.
+static void
+insertSlices(const Exr::FileInfo& file,
+             const Exr::Channel* channels,
+             int nComps,
+             char* base,
+             std::size_t yStride,
+             int firstLine,
+             int subsampledXOffset,
+             Imf_::FrameBuffer* fbuf)
+{
+    static const char* const missingNames[4] = { "__missing_R", "__missing_G", "__missing_B", "__missing_A" };
+    const std::size_t xStride = sizeof(float) * nComps;
+    for (int i = 0; i < nComps; ++i) {
+        const Exr::Channel c = channels[i];
+        Exr::FileInfo::ChannelsMap::const_iterator it = file.channel_map.find(c);
+        if (it == file.channel_map.end()) {
+            fbuf->insert(missingNames[c],
+                         Imf_::Slice(Imf_::FLOAT, base + i * sizeof(float), xStride, yStride, 1, 1, c == Exr::Channel_alpha ? 1. : 0.));
+        } else if (it->second == "BY" || it->second == "RY") {
+            // subsampled chroma channels are only found in scanline files, and read one line at a time
+            char* line = base + (std::ptrdiff_t)firstLine * (std::ptrdiff_t)yStride;
+            fbuf->insert(it->second.c_str(),
+                         Imf_::Slice(Imf_::FLOAT, line + (std::ptrdiff_t)(subsampledXOffset * nComps + i) * (std::ptrdiff_t)sizeof(float), xStride, 0, 2, 2));
+        } else {
+            fbuf->insert(it->second.c_str(),
+                         Imf_::Slice(Imf_::FLOAT, base + i * sizeof(float), xStride, yStride));
+        }
+    }
+}
+
+// the exr channels that are read, in the order of the output components, or NULL if the components are not supported
+static const Exr::Channel*
+getChannels(OFX::PixelComponentEnum pixelComponents,
+            int pixelComponentCount)
+{
+    static const Exr::Channel rgba[4] = { Exr::Channel_red, Exr::Channel_green, Exr::Channel_blue, Exr::Channel_alpha };
+    static const Exr::Channel alpha[1] = { Exr::Channel_alpha };
+    const Exr::Channel* channels;
+    switch (pixelComponents) {
+        case OFX::ePixelComponentRGBA:
+        case OFX::ePixelComponentRGB:
+            channels = rgba;
+            break;
+        case OFX::ePixelComponentAlpha:
+            channels = alpha;
+            break;
+        default:
+            channels = 0;
+            break;
+    }
+    const int nComps = pixelComponentCount;
+    if (nComps != 4 && nComps != 3 && nComps != 1) {
+        return 0;
+    }
+    return channels;
+}
+
+// the number of lines of lineBytes bytes decoded by each call to OpenEXR
+static int
+getBandLines(int nThreads,
+             std::size_t lineBytes)
+{
+    const int lines = std::max(kDecodeBandMinLines, 32 * nThreads);
+    return (int)std::max((std::size_t)1, std::min((std::size_t)lines, kDecodeBandMaxBytes / std::max(lineBytes, (std::size_t)1)));
+}
+
+// decode the render window of a file, using nThreads to size the bands of lines read at once.
+// Does not call any OFX suite, so that it can run on the read-ahead threads. Throws std::exception on error.
+static void
+decodeFile(const std::string& filename,
+           const OfxRectI& renderWindow,
+           float *pixelData,
+           const OfxRectI& bounds,
+           const Exr::Channel* channels,
+           int nComps,
+           int rowBytes,
+           int nThreads)
+{
+    Exr::FileLocker file(filename);
+    const Exr::FileInfo& info = file->info();
+    const Imath::Box2i& dispwin = info.exrDisplayWindow;
+    const Imath::Box2i& datawin = info.exrDataWindow;
+
+    // the part of the render window covered by the exr data window, in OFX pixel coordinates
+    // (the exr y axis points down, and x is shifted by dataOffset)
+    OfxRectI readRect;
+    readRect.x1 = std::max(renderWindow.x1, datawin.min.x + info.dataOffset);
+    readRect.x2 = std::min(renderWindow.x2, datawin.max.x + info.dataOffset + 1);
+    readRect.y1 = std::max(renderWindow.y1, dispwin.max.y - datawin.max.y);
+    readRect.y2 = std::min(renderWindow.y2, dispwin.max.y - datawin.min.y + 1);
+
+    fillOutsideWithBlack(renderWindow, readRect, pixelData, bounds, nComps, rowBytes);
+    if (isRectNull(readRect)) {
+        return;
+    }
+
+    // the same rectangle in exr coordinates (inclusive)
+    const int exrX1 = readRect.x1 - info.dataOffset;
+    const int exrX2 = readRect.x2 - 1 - info.dataOffset;
+    const int exrY1 = dispwin.max.y - (readRect.y2 - 1);
+    const int exrY2 = dispwin.max.y - readRect.y1;
+    const std::size_t readBytes = (std::size_t)(exrX2 - exrX1 + 1) * nComps * sizeof(float);
+
+    {
+        Exr::HandleLocker handle(*file);
+        if (handle->tiledfile) {
+            // read the intersecting tiles by bands of rows of tiles
+            Imf_::TiledInputFile& tiled = *handle->tiledfile;
+            const int tileW = tiled.tileXSize();
+            const int tileH = tiled.tileYSize();
+            const int dx1 = (exrX1 - datawin.min.x) / tileW;
+            const int dx2 = (exrX2 - datawin.min.x) / tileW;
+            const int dy1 = (exrY1 - datawin.min.y) / tileH;
+            const int dy2 = (exrY2 - datawin.min.y) / tileH;
+            const int tilesX1 = datawin.min.x + dx1 * tileW;
+            const int tilesX2 = std::min(datawin.min.x + (dx2 + 1) * tileW - 1, datawin.max.x);
+            const int tilesWidth = tilesX2 - tilesX1 + 1;
+            const std::size_t tilesRowBytes = (std::size_t)tilesWidth * nComps * sizeof(float);
+            // each call to OpenEXR decodes a band of rows of tiles, with one frame buffer for the whole band
+            const int bandTiles = std::max(1, getBandLines(nThreads, tilesRowBytes) / tileH);
+            std::vector<float> buf((std::size_t)tilesWidth * std::min(bandTiles, dy2 - dy1 + 1) * tileH * nComps);
+
+            for (int dy = dy1; dy <= dy2; dy += bandTiles) {
+                const int dyLast = std::min(dy + bandTiles - 1, dy2);
+                const int tilesY1 = datawin.min.y + dy * tileH;
+                Imf_::FrameBuffer fbuf;
+                char* base = (char*)&buf[0] - (std::ptrdiff_t)tilesY1 * (std::ptrdiff_t)tilesRowBytes - (std::ptrdiff_t)tilesX1 * (std::ptrdiff_t)(nComps * sizeof(float));
+                insertSlices(info, channels, nComps, base, tilesRowBytes, tilesY1, 0, &fbuf);
+                tiled.setFrameBuffer(fbuf);
+                tiled.readTiles(dx1, dx2, dy, dyLast);
+
+                const int y1 = std::max(exrY1, tilesY1);
+                const int y2 = std::min(exrY2, datawin.min.y + (dyLast + 1) * tileH - 1);
+                for (int exrY = y1; exrY <= y2; ++exrY) {
+                    const float* src = &buf[((std::size_t)(exrY - tilesY1) * tilesWidth + (exrX1 - tilesX1)) * nComps];
+                    std::memcpy(pixelAddress(pixelData, bounds, nComps, rowBytes, readRect.x1, dispwin.max.y - exrY), src, readBytes);
+                }
+            }
+        } else {
+            // scanline files are decoded by full lines, only the columns of the render window are copied.
+            // Subsampled chroma channels are stored in the line they are read in, so these files are read line by line.
+            bool hasSubsampled = false;
+            for (int i = 0; i < nComps; ++i) {
+                Exr::FileInfo::ChannelsMap::const_iterator it = info.channel_map.find(channels[i]);
+                hasSubsampled = hasSubsampled || (it != info.channel_map.end() && (it->second == "BY" || it->second == "RY"));
+            }
+            if (!hasSubsampled && exrX1 == datawin.min.x && exrX2 == datawin.max.x) {
+                // the lines are entirely in the render window: decode them directly to the destination,
+                // with a negative y stride since the OFX y axis points up
+                Imf_::FrameBuffer fbuf;
+                char* base = (char*)pixelData + (std::ptrdiff_t)(dispwin.max.y - bounds.y1) * rowBytes
+                             + (std::ptrdiff_t)(info.dataOffset - bounds.x1) * (std::ptrdiff_t)(nComps * sizeof(float));
+                insertSlices(info, channels, nComps, base, (std::size_t)(-(std::ptrdiff_t)rowBytes), exrY1, 0, &fbuf);
+                handle->inputfile->setFrameBuffer(fbuf);
+                handle->inputfile->readPixels(exrY1, exrY2);
+
+                return;
+            }
+            const int dataWidth = datawin.max.x - datawin.min.x + 1;
+            const std::size_t dataRowBytes = (std::size_t)dataWidth * nComps * sizeof(float);
+            // each call to OpenEXR decodes a band of lines, with one frame buffer for the whole band
+            const int lines = hasSubsampled ? 1 : std::min(getBandLines(nThreads, dataRowBytes), exrY2 - exrY1 + 1);
+            std::vector<float> buf((std::size_t)dataWidth * lines * nComps);
+
+            for (int bandY1 = exrY1; bandY1 <= exrY2; bandY1 += lines) {
+                const int bandY2 = std::min(bandY1 + lines - 1, exrY2);
+                Imf_::FrameBuffer fbuf;
+                char* base = (char*)&buf[0] - (std::ptrdiff_t)bandY1 * (std::ptrdiff_t)dataRowBytes - (std::ptrdiff_t)datawin.min.x * (std::ptrdiff_t)(nComps * sizeof(float));
+                insertSlices(info, channels, nComps, base, dataRowBytes, bandY1, datawin.min.x - datawin.min.x / 2, &fbuf);
+                handle->inputfile->setFrameBuffer(fbuf);
+                handle->inputfile->readPixels(bandY1, bandY2);
+
+                for (int exrY = bandY1; exrY <= bandY2; ++exrY) {
+                    const float* src = &buf[((std::size_t)(exrY - bandY1) * dataWidth + (exrX1 - datawin.min.x)) * nComps];
+                    std::memcpy(pixelAddress(pixelData, bounds, nComps, rowBytes, readRect.x1, dispwin.max.y - exrY), src, readBytes);
+                }
+            }
+        }
+    }
+}
 
 void
 ReadEXRPlugin::decode(const std::string& filename,
@@ -533,71 +1344,42 @@ ReadEXRPlugin::decode(const std::string& filename,
                       int pixelComponentCount,
                       int rowBytes)
 {
-    /// we only support RGBA output clip
-    if (pixelComponents != OFX::ePixelComponentRGBA || pixelComponentCount != 4) {
+    const Exr::Channel* channels = getChannels(pixelComponents, pixelComponentCount);
+    if (!channels) {
         OFX::throwSuiteStatusException(kOfxStatErrFormat);
         return;
     }
+    const int nThreads = Exr::ensureGlobalThreadCount();
+    try {
+        decodeFile(filename, renderWindow, pixelData, bounds, channels, pixelComponentCount, rowBytes, nThreads);
+    } catch (const std::exception& e) {
+        setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+}
 
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    OfxRectI roi = bounds; // used to be dstImg->getRegionOfDefinition(); why?
-    assert(kSupportsTiles || (renderWindow.x1 == file->dataWindow.x1 && renderWindow.x2 == file->dataWindow.x2 && renderWindow.y1 == file->dataWindow.y1 && renderWindow.y2 == file->dataWindow.y2));
-
-    for (int y = roi.y1; y < roi.y2; ++y) {
-        
-        
-        std::map<Exr::Channel, DecodingChannelsMap > channels;
-        for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it!=file->channel_map.end(); ++it) {
-            DecodingChannelsMap d;
-            
-            ///This line means we only support FLOAT dst images with the RGBA format.
-            d.buf = (float*)((char*)pixelData + (y-roi.y1)*rowBytes) + (int)it->first;
-            
-            d.subsampled = it->second == "BY" || it->second == "RY";
-            d.channelName = it->second;
-            channels.insert(std::make_pair(it->first, d));
-        }
-        
-        const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
-        const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
-        int exrY = dispwin.max.y - y;
-        //int r = roi.x2;
-        //int x = roi.x1;
-        
-        //const int X = std::max(x, datawin.min.x + file->dataOffset);
-        //const int R = std::min(r, datawin.max.x + file->dataOffset + 1);
-        
-        // if we're below or above the data window
-        if (exrY < datawin.min.y || exrY > datawin.max.y/* || R <= X*/) {
-            continue;
-        }
-        
-        Imf_::FrameBuffer fbuf;
-        for (std::map<Exr::Channel,DecodingChannelsMap >::const_iterator z = channels.begin(); z != channels.end();++z) {
-            if( !z->second.subsampled) {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT,(char*)(z->second.buf /*+ file->dataOffset*/),sizeof(float) * 4, 0));
-            } else {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT,(char*)(z->second.buf /*+ file->dataOffset*/),sizeof(float) * 4, 0,2,2));
-            }
-            
-        }
-        {
-#ifdef OFX_IO_MT_EXR
-            OFX::MultiThread::AutoMutex locker(file->lock);
-#endif
-            try {
-                file->inputfile->setFrameBuffer(fbuf);
-                file->inputfile->readPixels(exrY);
-            } catch (const std::exception& e) {
-                setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
-                return;
-            }
-        }
-        
+bool
+ReadEXRPlugin::decodeForPrefetch(const std::string& filename,
+                                 OfxTime /*time*/,
+                                 int /*view*/,
+                                 const OfxRectI& renderWindow,
+                                 float *pixelData,
+                                 const OfxRectI& bounds,
+                                 OFX::PixelComponentEnum pixelComponents,
+                                 int pixelComponentCount,
+                                 const std::string& /*rawComponents*/,
+                                 int rowBytes)
+{
+    const Exr::Channel* channels = getChannels(pixelComponents, pixelComponentCount);
+    if (!channels) {
+        // render() reports the error
+        return false;
     }
-    
+    // ensureGlobalThreadCount() may ask the host for the number of CPUs: the pool is sized by the render threads
+    const int nThreads = std::max(1, Imf_::globalThreadCount());
+    decodeFile(filename, renderWindow, pixelData, bounds, channels, pixelComponentCount, rowBytes, nThreads);
+
+    return true;
 }
 
 void
@@ -614,16 +1396,16 @@ ReadEXRPlugin::onInputFileChanged(const std::string& newFile,
 #     endif
     }
     assert(premult && components);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(newFile);
+    const Exr::FileInfo info = Exr::FileManager::s_readerManager.getInfo(newFile);
     bool hasRed;
     bool hasGreen;
     bool hasBlue;
     bool hasAlpha;
     
-    hasRed = file->channel_map.find(Exr::Channel_red) != file->channel_map.end();
-    hasGreen = file->channel_map.find(Exr::Channel_green) != file->channel_map.end();
-    hasBlue = file->channel_map.find(Exr::Channel_blue) != file->channel_map.end();
-    hasAlpha = file->channel_map.find(Exr::Channel_alpha) != file->channel_map.end();
+    hasRed = info.channel_map.find(Exr::Channel_red) != info.channel_map.end();
+    hasGreen = info.channel_map.find(Exr::Channel_green) != info.channel_map.end();
+    hasBlue = info.channel_map.find(Exr::Channel_blue) != info.channel_map.end();
+    hasAlpha = info.channel_map.find(Exr::Channel_alpha) != info.channel_map.end();
     
     if (hasAlpha) {
         // if any color channel is present, let it be RGBA
@@ -658,22 +1440,46 @@ ReadEXRPlugin::getFrameBounds(const std::string& filename,
                               std::string *error)
 {
     assert(bounds && par);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    if (!file) {
+    // the metadata stays cached after the file is closed
+    Exr::FileInfo info;
+    try {
+        info = Exr::FileManager::s_readerManager.getInfo(filename);
+    } catch (const std::exception& e) {
         if (error) {
-            *error = "No such file";
+            *error = e.what();
         }
         return false;
     }
-    bounds->x1 = file->dataWindow.x1;
-    bounds->x2 = file->dataWindow.x2;
-    bounds->y1 = file->dataWindow.y1;
-    bounds->y2 = file->dataWindow.y2;
-    *par = file->pixelAspectRatio;
+    bounds->x1 = info.dataWindow.x1;
+    bounds->x2 = info.dataWindow.x2;
+    bounds->y1 = info.dataWindow.y1;
+    bounds->y2 = info.dataWindow.y2;
+    *par = info.pixelAspectRatio;
 
     return true;
 }
 
+bool
+ReadEXRPlugin::getFrameBoundsForPrefetch(const std::string& filename,
+                                         OfxTime time,
+                                         OfxRectI *bounds,
+                                         double *par)
+{
+    // getFrameBounds does not call any suite, and the read-ahead thread reports the failure itself
+    return getFrameBounds(filename, time, bounds, par, NULL);
+}
+
+OFX::BitDepthEnum
+ReadEXRPlugin::getFrameBitDepth(const std::string& filename,
+                                OfxTime /*time*/)
+{
+    try {
+        return Exr::FileManager::s_readerManager.getInfo(filename).isHalf ? OFX::eBitDepthHalf : OFX::eBitDepthFloat;
+    } catch (const std::exception&) {
+        return OFX::eBitDepthFloat;
+    }
+}
+
 using namespace OFX;
 
 mDeclareReaderPluginFactory(ReadEXRPluginFactory, {}, {},false);
@@ -706,7 +1512,7 @@ ReadEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 {
     // make some pages and to things in
     PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(),
-                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles);
+                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles, kSupportsPrefetch);
 
     GenericReaderDescribeInContextEnd(desc, context, page, "reference", "reference");
 }
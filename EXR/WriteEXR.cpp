@@ -22,13 +22,22 @@
  */
 
 #include "WriteEXR.h"
+#include "ExrThreadPool.h"
 
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 #include <ImfChannelList.h>
 #include <ImfArray.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfTileDescription.h>
+#include <ImfThreading.h>
 #include <half.h>
 
+#include <ofxsMultiThread.h>
+
 
 #include <ImfChannelList.h>
 #include <ImfArray.h>
@@ -37,6 +46,7 @@
 
 #include "GenericOCIO.h"
 #include "GenericWriter.h"
+#include "IOHalf.h"
 
 #define kPluginName "WriteEXR"
 #define kPluginGrouping "Image/Writers"
@@ -47,6 +57,33 @@
 
 #define kParamWriteEXRCompression "compression"
 #define kParamWriteEXRDataType "dataType"
+#define kParamWriteEXRDataTypeLabel "Data Type"
+#define kParamWriteEXRDataTypeHint "Precision of the pixels stored in the file. Half floats take half the disk space and bandwidth of 32-bit floats, with an 11-bit mantissa and a range of +/-65504."
+
+#define kParamWriteEXRStorage "storage"
+#define kParamWriteEXRStorageLabel "Storage"
+#define kParamWriteEXRStorageHint "How the pixels are stored in the file. Tiled files can be read by regions. " \
+"Mipmapped and ripmapped files also contain lower resolution versions of the image, which can be read directly for proxy renders."
+#define kParamWriteEXRStorageOptionScanline "Scanline"
+#define kParamWriteEXRStorageOptionTiled "Tiled"
+#define kParamWriteEXRStorageOptionMipmap "Tiled (mipmap)"
+#define kParamWriteEXRStorageOptionRipmap "Tiled (ripmap)"
+
+enum StorageEnum
+{
+    eStorageScanline = 0,
+    eStorageTiled,
+    eStorageMipmap,
+    eStorageRipmap
+};
+
+#define kParamWriteEXRTileSize "tileSize"
+#define kParamWriteEXRTileSizeLabel "Tile Size"
+#define kParamWriteEXRTileSizeHint "Width and height of the tiles of tiled files, in pixels."
+
+// minimum number of lines given to each call to OpenEXR: it must hold several blocks of lines
+// so that they are compressed in parallel, and bounds the size of the intermediate buffer
+#define kEncodeBandMinLines 256
 
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
@@ -124,6 +161,8 @@ private:
 
     OFX::ChoiceParam* _compression;
     OFX::ChoiceParam* _bitDepth;
+    OFX::ChoiceParam* _storage;
+    OFX::IntParam* _tileSize;
     
 };
 
@@ -131,9 +170,14 @@ WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle)
 : GenericWriterPlugin(handle)
 , _compression(0)
 , _bitDepth(0)
+, _storage(0)
+, _tileSize(0)
 {
     _compression = fetchChoiceParam(kParamWriteEXRCompression);
     _bitDepth = fetchChoiceParam(kParamWriteEXRDataType);
+    _storage = fetchChoiceParam(kParamWriteEXRStorage);
+    _tileSize = fetchIntParam(kParamWriteEXRTileSize);
+    assert(_compression && _bitDepth && _storage && _tileSize);
 }
 
 WriteEXRPlugin::~WriteEXRPlugin(){
@@ -145,6 +189,160 @@ WriteEXRPlugin::~WriteEXRPlugin(){
 //}
 
 
+// A float image, with its rows in the exr order (top to bottom)
+struct ExrImage
+{
+    const char* data; // the top row
+    std::ptrdiff_t rowBytes; // may be negative
+    int width;
+    int height;
+    int nComps;
+
+    const float* row(int y) const { return (const float*)(data + y * rowBytes); }
+};
+
+static ExrImage
+makeExrImage(const std::vector<float>& pixels, int width, int height, int nComps)
+{
+    ExrImage image;
+    image.data = (const char*)&pixels[0];
+    image.rowBytes = (std::ptrdiff_t)width * nComps * sizeof(float);
+    image.width = width;
+    image.height = height;
+    image.nComps = nComps;
+    return image;
+}
+
+// downscale src to the size of the next mipmap/ripmap level (half the size, rounded down,
+// in x and/or y) with a box filter
+static void
+downscaleExrImage(const ExrImage& src,
+                  int dstWidth,
+                  int dstHeight,
+                  std::vector<float>* dst)
+{
+    const int nComps = src.nComps;
+    const bool halveX = dstWidth < src.width;
+    const bool halveY = dstHeight < src.height;
+    dst->resize((std::size_t)dstWidth * dstHeight * nComps);
+    for (int y = 0; y < dstHeight; ++y) {
+        const float* src0 = src.row(halveY ? 2 * y : y);
+        const float* src1 = src.row(halveY ? std::min(2 * y + 1, src.height - 1) : y);
+        float* dstRow = &(*dst)[(std::size_t)y * dstWidth * nComps];
+        for (int x = 0; x < dstWidth; ++x) {
+            const int x0 = (halveX ? 2 * x : x) * nComps;
+            const int x1 = (halveX ? std::min(2 * x + 1, src.width - 1) : x) * nComps;
+            for (int c = 0; c < nComps; ++c) {
+                dstRow[x * nComps + c] = 0.25f * (src0[x0 + c] + src0[x1 + c] + src1[x0 + c] + src1[x1 + c]);
+            }
+        }
+    }
+}
+
+// converts the rows [y1,y2) of an image to half, packed in dst, in parallel
+class HalfBandConverter : public OFX::MultiThread::Processor
+{
+public:
+    HalfBandConverter(const ExrImage& image,
+                      int y1,
+                      int y2,
+                      unsigned short* dst)
+    : _image(image)
+    , _y1(y1)
+    , _y2(y2)
+    , _dst(dst)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int n = _y2 - _y1;
+        const int begin = _y1 + (int)((long long)n * threadID / nThreads);
+        const int end = _y1 + (int)((long long)n * (threadID + 1) / nThreads);
+        const std::size_t rowSize = (std::size_t)_image.width * _image.nComps;
+        for (int y = begin; y < end; ++y) {
+            IO::floatToHalfRow(_image.row(y), _dst + (std::size_t)(y - _y1) * rowSize, rowSize);
+        }
+    }
+
+private:
+    const ExrImage& _image;
+    const int _y1;
+    const int _y2;
+    unsigned short* _dst;
+};
+
+// convert the rows [y1,y2) of image to pixelType, packed in buf
+static void
+fillBand(const ExrImage& image,
+         int y1,
+         int y2,
+         Imf_::PixelType pixelType,
+         std::vector<char>* buf)
+{
+    const std::size_t n = (std::size_t)image.width * image.nComps;
+    const std::size_t compBytes = (pixelType == Imf_::FLOAT) ? sizeof(float) : sizeof(half);
+    buf->resize(std::max(buf->size(), (std::size_t)(y2 - y1) * n * compBytes));
+    if (pixelType == Imf_::FLOAT) {
+        for (int y = y1; y < y2; ++y) {
+            std::memcpy(&(*buf)[(std::size_t)(y - y1) * n * sizeof(float)], image.row(y), n * sizeof(float));
+        }
+    } else {
+        assert(sizeof(half) == sizeof(unsigned short));
+        HalfBandConverter converter(image, y1, y2, (unsigned short*)&(*buf)[0]);
+        converter.multiThread();
+    }
+}
+
+// the frame buffer of a band filled by fillBand(), whose first row is line y of the file,
+// and whose first column is column x
+static Imf_::FrameBuffer
+bandFrameBuffer(std::vector<char>& buf,
+                const char* const* chanNames,
+                int nComps,
+                int width,
+                int x,
+                int y,
+                Imf_::PixelType pixelType)
+{
+    const std::size_t compBytes = (pixelType == Imf_::FLOAT) ? sizeof(float) : sizeof(half);
+    const std::size_t pixelBytes = compBytes * nComps;
+    const std::size_t bandRowBytes = pixelBytes * width;
+    char* base = &buf[0] - (std::ptrdiff_t)y * (std::ptrdiff_t)bandRowBytes - (std::ptrdiff_t)x * (std::ptrdiff_t)pixelBytes;
+    Imf_::FrameBuffer fbuf;
+    for (int c = 0; c < nComps; ++c) {
+        fbuf.insert(chanNames[c], Imf_::Slice(pixelType, base + c * compBytes, pixelBytes, bandRowBytes));
+    }
+    return fbuf;
+}
+
+// write a level of a tiled file, by bands of rows of tiles
+static void
+writeTiledLevel(Imf_::TiledOutputFile& file,
+                const ExrImage& image,
+                int lx,
+                int ly,
+                const char* const* chanNames,
+                Imf_::PixelType pixelType,
+                int bandLines,
+                std::vector<char>* buf)
+{
+    const Imath::Box2i dataW = file.dataWindowForLevel(lx, ly);
+    assert(dataW.max.x - dataW.min.x + 1 == image.width && dataW.max.y - dataW.min.y + 1 == image.height);
+    const int tileH = file.tileYSize();
+    const int nTilesX = file.numXTiles(lx);
+    const int nTilesY = file.numYTiles(ly);
+    const int bandTiles = std::max(1, bandLines / tileH);
+    for (int dy = 0; dy < nTilesY; dy += bandTiles) {
+        const int dyLast = std::min(nTilesY - 1, dy + bandTiles - 1);
+        const int y1 = dy * tileH;
+        const int y2 = std::min(image.height, (dyLast + 1) * tileH);
+        fillBand(image, y1, y2, pixelType, buf);
+        file.setFrameBuffer(bandFrameBuffer(*buf, chanNames, image.nComps, image.width, dataW.min.x, dataW.min.y + y1, pixelType));
+        file.writeTiles(0, nTilesX - 1, dy, dyLast, lx, ly);
+    }
+}
+
 void
 WriteEXRPlugin::encode(const std::string& filename,
                        OfxTime /*time*/,
@@ -187,6 +385,15 @@ WriteEXRPlugin::encode(const std::string& filename,
         _bitDepth->getValue(depthIndex);
         
         int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
+
+        int storage_i;
+        _storage->getValue(storage_i);
+        const StorageEnum storage = (StorageEnum)storage_i;
+
+        const int nThreads = Exr::ensureGlobalThreadCount();
+        // each call to OpenEXR encodes a band of lines, so that the blocks are compressed in parallel
+        const int bandLines = std::max(kEncodeBandMinLines, 32 * nThreads);
+
         Imath::Box2i exrDataW;
 
         exrDataW.min.x = bounds.x1;
@@ -219,40 +426,73 @@ WriteEXRPlugin::encode(const std::string& filename,
             exrheader.channels().insert(chanNames[chan],Imf_::Channel(pixelType));
         }
 
-        Imf_::OutputFile outputFile(filename.c_str(),exrheader);
-        
-        for (int y = bounds.y1; y < bounds.y2; ++y) {
-            /*First we create a row that will serve as the output buffer.
-             We copy the scan-line (with y inverted) in the inputImage to the row.*/
-            int exrY = bounds.y2 - y - 1;
-            
-            float* src_pixels = (float*)((char*)pixelData + (exrY - bounds.y1)*rowBytes);
-            
-            /*we create the frame buffer*/
-            Imf_::FrameBuffer fbuf;
-            if (depth == 32) {
-                for (int chan = 0; chan < numChannels; ++chan) {
-                    fbuf.insert(chanNames[chan],Imf_::Slice(Imf_::FLOAT, (char*)src_pixels + chan, sizeof(float) * numChannels, 0));
+        // the OFX image, flipped vertically: the exr lines go from top to bottom
+        ExrImage image;
+        image.data = (const char*)pixelData + (std::ptrdiff_t)(bounds.y2 - 1 - bounds.y1) * rowBytes;
+        image.rowBytes = -(std::ptrdiff_t)rowBytes;
+        image.width = bounds.x2 - bounds.x1;
+        image.height = bounds.y2 - bounds.y1;
+        image.nComps = numChannels;
+
+        std::vector<char> buf;
+        if (storage == eStorageScanline) {
+            Imf_::OutputFile outputFile(filename.c_str(),exrheader);
+            for (int y1 = 0; y1 < image.height; y1 += bandLines) {
+                const int y2 = std::min(image.height, y1 + bandLines);
+                fillBand(image, y1, y2, pixelType, &buf);
+                outputFile.setFrameBuffer(bandFrameBuffer(buf, chanNames, numChannels, image.width, exrDataW.min.x, exrDataW.min.y + y1, pixelType));
+                outputFile.writePixels(y2 - y1);
+            }
+        } else {
+            int tileSize;
+            _tileSize->getValue(tileSize);
+            Imf_::LevelMode levelMode = Imf_::ONE_LEVEL;
+            if (storage == eStorageMipmap) {
+                levelMode = Imf_::MIPMAP_LEVELS;
+            } else if (storage == eStorageRipmap) {
+                levelMode = Imf_::RIPMAP_LEVELS;
+            }
+            exrheader.setTileDescription(Imf_::TileDescription(tileSize, tileSize, levelMode, Imf_::ROUND_DOWN));
+            Imf_::TiledOutputFile outputFile(filename.c_str(), exrheader);
+
+            writeTiledLevel(outputFile, image, 0, 0, chanNames, pixelType, bandLines, &buf);
+            if (levelMode == Imf_::MIPMAP_LEVELS) {
+                // each level is computed from the previous one
+                std::vector<float> level;
+                std::vector<float> nextLevel;
+                ExrImage levelImage = image;
+                for (int l = 1; l < outputFile.numLevels(); ++l) {
+                    downscaleExrImage(levelImage, outputFile.levelWidth(l), outputFile.levelHeight(l), &nextLevel);
+                    level.swap(nextLevel);
+                    levelImage = makeExrImage(level, outputFile.levelWidth(l), outputFile.levelHeight(l), numChannels);
+                    writeTiledLevel(outputFile, levelImage, l, l, chanNames, pixelType, bandLines, &buf);
                 }
-            } else {
-                Imf_::Array2D<half> halfwriterow(numChannels ,bounds.x2 - bounds.x1);
-                
-                for (int chan = 0; chan < numChannels; ++chan) {
-                    fbuf.insert(chanNames[chan],
-                                Imf_::Slice(Imf_::HALF,
-                                            (char*)(&halfwriterow[chan][0] - exrDataW.min.x),
-                                            sizeof(halfwriterow[chan][0]), 0));
-                    const float* from = src_pixels + chan;
-                    for (int i = exrDataW.min.x,f = exrDataW.min.x; i < exrDataW.max.x ; ++i, f += numChannels) {
-                        halfwriterow[chan][i - exrDataW.min.x] = from[f];
+            } else if (levelMode == Imf_::RIPMAP_LEVELS) {
+                // the levels (0,ly) are computed from (0,ly-1), and the levels (lx,ly) from (lx-1,ly)
+                std::vector<float> column;
+                std::vector<float> nextColumn;
+                std::vector<float> level;
+                std::vector<float> nextLevel;
+                ExrImage columnImage = image;
+                for (int ly = 0; ly < outputFile.numYLevels(); ++ly) {
+                    const int height = outputFile.levelHeight(ly);
+                    if (ly > 0) {
+                        downscaleExrImage(columnImage, image.width, height, &nextColumn);
+                        column.swap(nextColumn);
+                        columnImage = makeExrImage(column, image.width, height, numChannels);
+                        writeTiledLevel(outputFile, columnImage, 0, ly, chanNames, pixelType, bandLines, &buf);
+                    }
+                    ExrImage levelImage = columnImage;
+                    for (int lx = 1; lx < outputFile.numXLevels(); ++lx) {
+                        const int width = outputFile.levelWidth(lx);
+                        downscaleExrImage(levelImage, width, height, &nextLevel);
+                        level.swap(nextLevel);
+                        levelImage = makeExrImage(level, width, height, numChannels);
+                        writeTiledLevel(outputFile, levelImage, lx, ly, chanNames, pixelType, bandLines, &buf);
                     }
                 }
             }
-            outputFile.setFrameBuffer(fbuf);
-            outputFile.writePixels(1);
         }
-
-        
         
     } catch (const std::exception& e) {
         setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
@@ -321,6 +561,8 @@ void WriteEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     ////////Data type
     {
         OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRDataType);
+        param->setLabel(kParamWriteEXRDataTypeLabel);
+        param->setHint(kParamWriteEXRDataTypeHint);
         param->setAnimates(true);
         for(int i = 0 ; i < 2 ; ++i) {
             param->appendOption(Exr::depthNames[i]);
@@ -329,6 +571,34 @@ void WriteEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         page->addChild(*param);
     }
 
+    {
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRStorage);
+        param->setLabel(kParamWriteEXRStorageLabel);
+        param->setHint(kParamWriteEXRStorageHint);
+        assert(param->getNOptions() == (int)eStorageScanline);
+        param->appendOption(kParamWriteEXRStorageOptionScanline);
+        assert(param->getNOptions() == (int)eStorageTiled);
+        param->appendOption(kParamWriteEXRStorageOptionTiled);
+        assert(param->getNOptions() == (int)eStorageMipmap);
+        param->appendOption(kParamWriteEXRStorageOptionMipmap);
+        assert(param->getNOptions() == (int)eStorageRipmap);
+        param->appendOption(kParamWriteEXRStorageOptionRipmap);
+        param->setDefault(eStorageScanline);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kParamWriteEXRTileSize);
+        param->setLabel(kParamWriteEXRTileSizeLabel);
+        param->setHint(kParamWriteEXRTileSizeHint);
+        param->setDefault(64);
+        param->setRange(16, 4096);
+        param->setDisplayRange(16, 512);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
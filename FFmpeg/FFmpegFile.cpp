@@ -30,13 +30,22 @@
 #include "FFmpegFile.h"
 
 #include <cmath>
+#include <cstdlib>
+#include <cstdio>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "ReadFFmpeg.h"
 
 #if defined(_WIN32) || defined(WIN64)
 #  include <windows.h> // for GetSystemInfo()
+#  include <direct.h> // for _mkdir()
+#  include <process.h> // for _getpid()
 #define strncasecmp _strnicmp
 #else
 #  include <unistd.h> // for sysconf()
@@ -406,6 +415,59 @@ FFmpegFile::Stream::GetStreamAspectRatio(Stream* stream)
     return stream->_aspect;
 }
 
+// Get the layout of the planar YUV pixel formats that the reader converts directly to float RGB. Returns false for
+// other formats, which are converted to packed RGB by sws_scale.
+static bool
+getPlanarYUVLayout(AVPixelFormat pixelFormat,
+                   int* chromaShiftX,
+                   int* chromaShiftY,
+                   int* bitDepth,
+                   bool* fullRange)
+{
+    *fullRange = false;
+    switch (pixelFormat) {
+    case AV_PIX_FMT_YUVJ420P:
+        *fullRange = true;
+        // fall through
+    case AV_PIX_FMT_YUV420P:
+        *chromaShiftX = 1; *chromaShiftY = 1; *bitDepth = 8;
+        return true;
+    case AV_PIX_FMT_YUVJ422P:
+        *fullRange = true;
+        // fall through
+    case AV_PIX_FMT_YUV422P:
+        *chromaShiftX = 1; *chromaShiftY = 0; *bitDepth = 8;
+        return true;
+    case AV_PIX_FMT_YUVJ444P:
+        *fullRange = true;
+        // fall through
+    case AV_PIX_FMT_YUV444P:
+        *chromaShiftX = 0; *chromaShiftY = 0; *bitDepth = 8;
+        return true;
+    // native endianness only
+    case AV_PIX_FMT_YUV420P10:
+        *chromaShiftX = 1; *chromaShiftY = 1; *bitDepth = 10;
+        return true;
+    case AV_PIX_FMT_YUV422P10:
+        *chromaShiftX = 1; *chromaShiftY = 0; *bitDepth = 10;
+        return true;
+    case AV_PIX_FMT_YUV444P10:
+        *chromaShiftX = 0; *chromaShiftY = 0; *bitDepth = 10;
+        return true;
+    case AV_PIX_FMT_YUV420P12:
+        *chromaShiftX = 1; *chromaShiftY = 1; *bitDepth = 12;
+        return true;
+    case AV_PIX_FMT_YUV422P12:
+        *chromaShiftX = 1; *chromaShiftY = 0; *bitDepth = 12;
+        return true;
+    case AV_PIX_FMT_YUV444P12:
+        *chromaShiftX = 0; *chromaShiftY = 0; *bitDepth = 12;
+        return true;
+    default:
+        return false;
+    }
+}
+
 // get stream start time
 int64_t
 FFmpegFile::getStreamStartTime(Stream & stream)
@@ -569,18 +631,23 @@ FFmpegFile::getStreamFrames(Stream & stream)
 
         int64_t maxPts = stream._startPTS;
 
-        // Seek last key-frame.
-        avcodec_flush_buffers(stream._codecContext);
-        av_seek_frame(_context, stream._idx, stream.frameToPts(1 << 29), AVSEEK_FLAG_BACKWARD);
+        if ( stream._lastPTS != int64_t(AV_NOPTS_VALUE) ) {
+            // buildIndex() already read all the packets
+            maxPts = std::max(maxPts, stream._lastPTS);
+        } else {
+            // Seek last key-frame.
+            avcodec_flush_buffers(stream._codecContext);
+            av_seek_frame(_context, stream._idx, stream.frameToPts(1 << 29), AVSEEK_FLAG_BACKWARD);
 
-        // Read up to last frame, extending max PTS for every valid PTS value found for the video stream.
-        av_init_packet(&_avPacket);
+            // Read up to last frame, extending max PTS for every valid PTS value found for the video stream.
+            av_init_packet(&_avPacket);
 
-        while (av_read_frame(_context, &_avPacket) >= 0) {
-            if ( (_avPacket.stream_index == stream._idx) && ( _avPacket.pts != int64_t(AV_NOPTS_VALUE) ) && (_avPacket.pts > maxPts) ) {
-                maxPts = _avPacket.pts;
+            while (av_read_frame(_context, &_avPacket) >= 0) {
+                if ( (_avPacket.stream_index == stream._idx) && ( _avPacket.pts != int64_t(AV_NOPTS_VALUE) ) && (_avPacket.pts > maxPts) ) {
+                    maxPts = _avPacket.pts;
+                }
+                av_free_packet(&_avPacket);
             }
-            av_free_packet(&_avPacket);
         }
 #if TRACE_FILE_OPEN
         std::cout << "          Start PTS=" << stream._startPTS << ", Max PTS found=" << maxPts << std::endl;
@@ -601,7 +668,362 @@ FFmpegFile::getStreamFrames(Stream & stream)
     return frames;
 } // FFmpegFile::getStreamFrames
 
-FFmpegFile::FFmpegFile(const std::string & filename)
+// The key-frame index of a file is cached in memory (for the other decoders opened on the same file) and in a file
+// of the index cache directory, named after a hash of the video file name. The contents start with a key that
+// identifies the video file, its version and the timing of the stream, followed by the index itself.
+namespace {
+#define kFFmpegIndexCacheVersion "openfx-io FFmpeg index 1"
+#define kFFmpegIndexCacheMaxEntries 64
+
+IO::Mutex gIndexCacheLock;
+std::map<std::string, std::string> gIndexCache; // index file name -> contents
+int gIndexCacheGeneration = 0; // incremented each time an index is built
+
+int
+getIndexCacheGeneration()
+{
+    IO::AutoMutex l(gIndexCacheLock);
+
+    return gIndexCacheGeneration;
+}
+
+// the index cache directory, or an empty string if the index is disabled
+std::string
+getIndexCacheDir()
+{
+    const char* env = std::getenv(kFFmpegIndexCacheEnvVar);
+    if (env) {
+        return env;
+    }
+    std::string dir;
+#if defined(_WIN32) || defined(WIN64)
+    const char* base = std::getenv("LOCALAPPDATA");
+    if (!base) {
+        base = std::getenv("TEMP");
+    }
+    if (base) {
+        dir = std::string(base) + "\\openfx-io\\FFmpegIndex";
+    }
+#else
+    const char* home = std::getenv("HOME");
+#  if defined(__APPLE__)
+    if (home) {
+        dir = std::string(home) + "/Library/Caches/openfx-io/FFmpegIndex";
+    }
+#  else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0]) {
+        dir = std::string(xdg) + "/openfx-io/FFmpegIndex";
+    } else if (home) {
+        dir = std::string(home) + "/.cache/openfx-io/FFmpegIndex";
+    }
+#  endif
+    if ( dir.empty() ) {
+        const char* tmp = std::getenv("TMPDIR");
+        dir = std::string(tmp ? tmp : "/tmp") + "/openfx-io-FFmpegIndex";
+    }
+#endif
+
+    return dir;
+}
+
+// create the directory and its parents
+bool
+makeDirs(const std::string& dir)
+{
+    int error = 0;
+    for (std::size_t pos = dir.find_first_of("/\\", 1); ; pos = dir.find_first_of("/\\", pos + 1)) {
+        // only the error on the last component matters: the first ones may be drives or unreadable parents
+        const std::string path = dir.substr(0, pos);
+#if defined(_WIN32) || defined(WIN64)
+        error = _mkdir( path.c_str() );
+#else
+        error = mkdir(path.c_str(), 0755);
+#endif
+        if (pos == std::string::npos) {
+            break;
+        }
+    }
+
+    return error == 0 || errno == EEXIST;
+}
+
+// the name of the index cache file of a video file, or an empty string if the index is disabled
+std::string
+getIndexFileName(const std::string& filename)
+{
+    const std::string dir = getIndexCacheDir();
+    if ( dir.empty() ) {
+        return std::string();
+    }
+    // 64-bit FNV-1a hash of the file name
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < filename.size(); ++i) {
+        hash ^= (unsigned char)filename[i];
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream name;
+    name << dir << '/' << std::hex << std::setfill('0') << std::setw(16) << hash << ".idx";
+
+    return name.str();
+}
+
+// the key that identifies the indexed stream, or an empty string if the index is disabled or the file cannot be stat'ed
+std::string
+getIndexKey(const std::string& filename,
+            int streamIdx,
+            const AVStream* avstream,
+            int fpsNum,
+            int fpsDen)
+{
+#if defined(_WIN32) || defined(WIN64)
+    struct __stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0) {
+        return std::string();
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return std::string();
+    }
+#endif
+    std::ostringstream key;
+    key << kFFmpegIndexCacheVersion << '\n'
+        << filename << '\n'
+        << (long long)st.st_size << ' ' << (long long)st.st_mtime << ' ' << streamIdx << ' '
+        << avstream->time_base.num << ' ' << avstream->time_base.den << ' ' << fpsNum << ' ' << fpsDen << '\n';
+
+    return key.str();
+}
+} // anon namespace
+
+void
+FFmpegFile::buildIndex(Stream & stream,
+                       const IndexCancel& cancel)
+{
+    if ( getIndexFileName(_filename).empty() ) {
+        // without a cache, the whole file would be read each time it is opened
+        return;
+    }
+
+    // Read all the packets of the file from the start, and record the key-frames of the stream.
+    avcodec_flush_buffers(stream._codecContext);
+    if (av_seek_frame(_context, stream._idx, stream._startPTS, AVSEEK_FLAG_BACKWARD) < 0) {
+        return;
+    }
+
+    std::vector<Stream::KeyFrame> keyFrames;
+    bool intraOnly = true;
+    bool ptsMissing = false;
+    int64_t lastPTS = AV_NOPTS_VALUE;
+    av_init_packet(&_avPacket);
+    while (av_read_frame(_context, &_avPacket) >= 0) {
+        if (_avPacket.stream_index == stream._idx) {
+            if ( _avPacket.pts == int64_t(AV_NOPTS_VALUE) ) {
+                // frames cannot be identified
+                ptsMissing = true;
+            } else {
+                if (_avPacket.flags & AV_PKT_FLAG_KEY) {
+                    Stream::KeyFrame keyFrame;
+                    keyFrame.frame = stream.ptsToFrame(_avPacket.pts);
+                    // the DTS is the timestamp used by most demuxers to seek; it is never after the PTS
+                    keyFrame.timestamp = ( _avPacket.dts == int64_t(AV_NOPTS_VALUE) ) ? _avPacket.pts : std::min(_avPacket.dts, _avPacket.pts);
+                    keyFrames.push_back(keyFrame);
+                } else {
+                    intraOnly = false;
+                }
+                if ( ( lastPTS == int64_t(AV_NOPTS_VALUE) ) || (_avPacket.pts > lastPTS) ) {
+                    lastPTS = _avPacket.pts;
+                }
+            }
+        }
+        av_free_packet(&_avPacket);
+        if ( ptsMissing || cancel.isCancelled() ) {
+            break;
+        }
+    }
+    // the next decode() seeks, since no frame was decoded
+
+    if ( ptsMissing || cancel.isCancelled() || keyFrames.empty() ) {
+        return;
+    }
+    std::stable_sort( keyFrames.begin(), keyFrames.end(), Stream::KeyFrameLess() );
+    // keep the first of the key-frames with the same frame index
+    std::vector<Stream::KeyFrame>::iterator last = keyFrames.begin();
+    for (std::vector<Stream::KeyFrame>::iterator it = keyFrames.begin() + 1; it != keyFrames.end(); ++it) {
+        if (it->frame != last->frame) {
+            *(++last) = *it;
+        }
+    }
+    keyFrames.erase( last + 1, keyFrames.end() );
+
+    stream._intraOnly = intraOnly;
+    if (intraOnly) {
+        // any frame can be sought to directly
+        stream._keyFrames.clear();
+    } else {
+        stream._keyFrames.swap(keyFrames);
+    }
+    stream._lastPTS = lastPTS;
+} // FFmpegFile::buildIndex
+
+bool
+FFmpegFile::loadIndex(Stream & stream,
+                      bool keyFramesOnly)
+{
+    const std::string indexFileName = getIndexFileName(_filename);
+    if ( indexFileName.empty() ) {
+        return false;
+    }
+    const std::string key = getIndexKey(_filename, stream._idx, stream._avstream, stream._fpsNum, stream._fpsDen);
+    if ( key.empty() ) {
+        return false;
+    }
+
+    std::string contents;
+    {
+        IO::AutoMutex l(gIndexCacheLock);
+        std::map<std::string, std::string>::const_iterator found = gIndexCache.find(indexFileName);
+        if ( found != gIndexCache.end() ) {
+            contents = found->second;
+        }
+    }
+    if ( contents.compare(0, key.size(), key) != 0 ) {
+        if (keyFramesOnly) {
+            return false;
+        }
+        std::ifstream file(indexFileName.c_str(), std::ios::in | std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        std::ostringstream buf;
+        buf << file.rdbuf();
+        contents = buf.str();
+        if ( contents.compare(0, key.size(), key) != 0 ) {
+            // another file with the same hash, or the file was modified
+            return false;
+        }
+    }
+
+    std::istringstream is( contents.substr( key.size() ) );
+    long long startPTS, frames, lastPTS;
+    int intraOnly;
+    std::size_t count;
+    if ( !(is >> startPTS >> frames >> lastPTS >> intraOnly >> count) || (frames <= 0) || (!intraOnly && count == 0) ) {
+        return false;
+    }
+    std::vector<Stream::KeyFrame> keyFrames(intraOnly ? 0 : count);
+    for (std::size_t i = 0; i < keyFrames.size(); ++i) {
+        long long timestamp;
+        if ( !(is >> keyFrames[i].frame >> timestamp) ) {
+            return false;
+        }
+        keyFrames[i].timestamp = timestamp;
+    }
+
+    if (keyFramesOnly) {
+        // the key-frames are numbered from the start PTS
+        if (startPTS != stream._startPTS) {
+            return false;
+        }
+    } else {
+        stream._startPTS = startPTS;
+#ifdef OFX_IO_MT_FFMPEG
+        IO::AutoMutex guard(_infoLock);
+#endif
+        stream._frames = frames;
+    }
+    stream._lastPTS = lastPTS;
+    stream._intraOnly = (intraOnly != 0);
+    stream._keyFrames.swap(keyFrames);
+    {
+        IO::AutoMutex l(gIndexCacheLock);
+        if (gIndexCache.size() >= kFFmpegIndexCacheMaxEntries) {
+            gIndexCache.clear();
+        }
+        gIndexCache[indexFileName] = contents;
+    }
+
+    return true;
+} // FFmpegFile::loadIndex
+
+void
+FFmpegFile::saveIndex(const Stream & stream)
+{
+    const std::string indexFileName = getIndexFileName(_filename);
+    if ( indexFileName.empty() ) {
+        return;
+    }
+    const std::string key = getIndexKey(_filename, stream._idx, stream._avstream, stream._fpsNum, stream._fpsDen);
+    if ( key.empty() ) {
+        return;
+    }
+
+    std::ostringstream os;
+    os << key << (long long)stream._startPTS << ' ' << (long long)stream._frames << ' ' << (long long)stream._lastPTS << ' '
+       << (stream._intraOnly ? 1 : 0) << ' ' << stream._keyFrames.size() << '\n';
+    for (std::size_t i = 0; i < stream._keyFrames.size(); ++i) {
+        os << stream._keyFrames[i].frame << ' ' << (long long)stream._keyFrames[i].timestamp << '\n';
+    }
+    const std::string contents = os.str();
+    {
+        IO::AutoMutex l(gIndexCacheLock);
+        if (gIndexCache.size() >= kFFmpegIndexCacheMaxEntries) {
+            gIndexCache.clear();
+        }
+        gIndexCache[indexFileName] = contents;
+        // the decoders opened before the index was built look for it again
+        ++gIndexCacheGeneration;
+    }
+
+    // write to a temporary file and rename it, so that concurrent readers never see a partial index
+    const std::string dir = indexFileName.substr( 0, indexFileName.find_last_of('/') );
+    if ( !makeDirs(dir) ) {
+        return;
+    }
+    std::ostringstream tmpName;
+#if defined(_WIN32) || defined(WIN64)
+    tmpName << indexFileName << ".tmp" << _getpid() << '.' << (void*)this;
+#else
+    tmpName << indexFileName << ".tmp" << getpid() << '.' << (void*)this;
+#endif
+    {
+        std::ofstream file(tmpName.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return;
+        }
+        file << contents;
+        file.close();
+        if (!file) {
+            std::remove( tmpName.str().c_str() );
+            return;
+        }
+    }
+#if defined(_WIN32) || defined(WIN64)
+    const bool renamed = MoveFileExA(tmpName.str().c_str(), indexFileName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = std::rename( tmpName.str().c_str(), indexFileName.c_str() ) == 0;
+#endif
+    if (!renamed) {
+        std::remove( tmpName.str().c_str() );
+    }
+} // FFmpegFile::saveIndex
+
+void
+FFmpegFile::updatePendingIndex(Stream & stream)
+{
+    const int generation = getIndexCacheGeneration();
+    if (generation == _indexGeneration) {
+        return;
+    }
+    _indexGeneration = generation;
+    if ( loadIndex(stream, true) ) {
+        _indexPending = false;
+    }
+}
+
+FFmpegFile::FFmpegFile(const std::string & filename,
+                       const IndexCancel* indexer)
     : _filename(filename)
     , _context(NULL)
     , _format(NULL)
@@ -610,12 +1032,16 @@ FFmpegFile::FFmpegFile(const std::string & filename)
     , _invalidState(false)
     , _avPacket()
     , _data(0)
+    , _decodeThreads(0)
+    , _indexPending(false)
+    , _indexGeneration(-1)
 #ifdef OFX_IO_MT_FFMPEG
-    , _lock(0)
+    , _lock()
+    , _infoLock()
 #endif
 {
 #ifdef OFX_IO_MT_FFMPEG
-    //OFX::MultiThread::AutoMutex guard(_lock); // not needed in a constructor: we are the only owner
+    //IO::AutoMutex guard(_lock); // not needed in a constructor: we are the only owner
 #endif
 
 #if TRACE_FILE_OPEN
@@ -675,12 +1101,24 @@ FFmpegFile::FFmpegFile(const std::string & filename)
             continue;
         }
 
+        // Only the first stream is decoded: the others get a single thread.
+        int threads = 1;
         if (avstream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
             // source: http://git.savannah.gnu.org/cgit/bino.git/tree/src/media_object.cpp
 
             // Activate multithreaded decoding. This must be done before opening the codec; see
             // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
-            avstream->codec->thread_count = video_decoding_threads();
+            // Multi-threaded decoding is fast but causes problems when opening many readers simultaneously if each opens as
+            // many threads as you have cores. This leads to resource starvation and failed reads. The threads thus come from
+            // a budget shared by all the decoders of the process.
+            // A decoder that is only opened to build the index never decodes: it keeps a single thread.
+            if ( _streams.empty() && !indexer ) {
+                threads = FFmpegThreadBudget::acquire();
+            }
+            avstream->codec->thread_count = threads;
+            // Frame threading adds a latency of thread_count-1 frames (see Stream::getCodecDelay()), slice threading
+            // does not but only helps with streams encoded with several slices: let the codec use the one it supports.
+            avstream->codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
             // Set CODEC_FLAG_EMU_EDGE in the same situations in which ffplay sets it.
             // I don't know what exactly this does, but it is necessary to fix the problem
             // described in this thread: http://lists.nongnu.org/archive/html/bino-list/2012-02/msg00039.html
@@ -693,28 +1131,22 @@ FFmpegFile::FFmpegFile(const std::string & filename)
             }
         }
 
-        // Some codecs support multi-threaded decoding (eg mpeg). Its fast but causes problems when opening many readers
-        // simultaneously since each opens as many threads as you have cores. This leads to resource starvation and failed reads.
-        // For now, revert to the previous ffmpeg behaviour (single-threaded decode) unless overridden by env var.
-#if OFX_FFMPEG_MULTI_THREADED_CODEC_SUPPORT
-# if TRACE_FILE_OPEN
-        std::cout << "FFmpeg Reader: Multi-threaded decode" << std::endl;
-# endif
-#else
-# if TRACE_FILE_OPEN
-        std::cout << "FFmpeg Reader: Single-threaded decode" << std::endl;
-# endif
-        // Default behaviour
-        avstream->codec->thread_count = 1;
-        avstream->codec->thread_type = FF_THREAD_FRAME;
+#if TRACE_FILE_OPEN
+        std::cout << "FFmpeg Reader: " << threads << " decoding thread(s)" << std::endl;
 #endif
         // skip if the codec can't be open
         if (avcodec_open2(avstream->codec, videoCodec, NULL) < 0) {
 #if TRACE_FILE_OPEN
             std::cout << "Decoder \"" << videoCodec->name << "\" failed to open, skipping..." << std::endl;
 #endif
+            if ( _streams.empty() && !indexer ) {
+                FFmpegThreadBudget::release(threads);
+            }
             continue;
         }
+        if ( _streams.empty() && !indexer ) {
+            _decodeThreads = threads;
+        }
 
 #if TRACE_FILE_OPEN
         std::cout << "Video decoder \"" << videoCodec->name << "\" opened ok, getting stream properties:" << std::endl;
@@ -801,9 +1233,22 @@ FFmpegFile::FFmpegFile(const std::string & filename)
         // set aspect ratio
         stream->_aspect = Stream::GetStreamAspectRatio(stream);
 
-        // set stream start time and numbers of frames
-        stream->_startPTS = getStreamStartTime(*stream);
-        stream->_frames   = getStreamFrames(*stream);
+        // set stream start time and numbers of frames. Only the first stream is decoded, and indexed.
+        // Reading the whole file to index it would block the render that opens the decoder: the index is built by
+        // another decoder, in the background, and the frame count is estimated meanwhile.
+        const bool indexed = _streams.empty();
+        if ( !indexed || !loadIndex(*stream) ) {
+            stream->_startPTS = getStreamStartTime(*stream);
+            if (indexed && indexer) {
+                buildIndex(*stream, *indexer);
+            }
+            stream->_frames   = getStreamFrames(*stream);
+            if ( indexed && stream->isIndexed() ) {
+                saveIndex(*stream);
+            } else if (indexed && !indexer) {
+                _indexPending = !getIndexFileName(_filename).empty();
+            }
+        }
 
         // not in FFmpeg Reader: initialize the output buffer
         if (_streams.empty()) {
@@ -811,7 +1256,26 @@ FFmpegFile::FFmpegFile(const std::string & filename)
             std::size_t pixelDepth = stream->_bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char);
             // this is the first stream (in fact the only one we consider for now), allocate the output buffer according to the bitdepth
             assert(!_data);
-            _data = new unsigned char[stream->_width * stream->_height * stream->_numberOfComponents * pixelDepth];
+            stream->_frameBytes = (std::size_t)stream->_width * stream->_height * stream->_numberOfComponents * pixelDepth;
+
+            // keep the planes of YUV frames as they are: the reader converts them directly to float RGB
+            PlanarYUVInfo& yuv = stream->_planarYUV;
+            if ( (stream->_numberOfComponents == 3) &&
+                 getPlanarYUVLayout(stream->_codecContext->pix_fmt, &yuv.chromaShiftX, &yuv.chromaShiftY, &yuv.bitDepth, &yuv.fullRange) ) {
+                const std::size_t sampleBytes = yuv.bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char);
+                const std::size_t chromaWidth = -( (-stream->_width) >> yuv.chromaShiftX );
+                const std::size_t chromaHeight = -( (-stream->_height) >> yuv.chromaShiftY );
+                stream->_isPlanarYUV = true;
+                stream->_planarYUVFormat = stream->_codecContext->pix_fmt;
+                stream->_frameBytes = sampleBytes * ( (std::size_t)stream->_width * stream->_height + 2 * chromaWidth * chromaHeight );
+            }
+            _data = new unsigned char[stream->_frameBytes];
+
+            // keep the recently decoded frames, as long as the rings of all the decoders fit in their budget. The decoder
+            // that only builds the index never decodes.
+            if ( (stream->_frameBytes > 0) && !indexer ) {
+                stream->_ringCapacity = std::min( FFmpegRingBudget::getSize() / stream->_frameBytes, (std::size_t)kFFmpegFrameRingMaxFrames );
+            }
         }
 
         // save the stream
@@ -826,7 +1290,7 @@ FFmpegFile::FFmpegFile(const std::string & filename)
 FFmpegFile::~FFmpegFile()
 {
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_lock);
 #endif
 
     // force to close all resources needed for all streams
@@ -834,6 +1298,9 @@ FFmpegFile::~FFmpegFile()
         delete _streams[i];
     }
     _streams.clear();
+    // the codec threads are stopped
+    FFmpegThreadBudget::release(_decodeThreads);
+    _decodeThreads = 0;
 
     if (_context) {
         avformat_close_input(&_context);
@@ -909,11 +1376,11 @@ FFmpegFile::getColorspace() const
     return isYUV() ? "Gamma2.2" : "Gamma1.8";
 }
 
-const std::string &
+std::string
 FFmpegFile::getError() const
 {
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_infoLock);
 #endif
 
     return _errorMsg;
@@ -924,7 +1391,7 @@ bool
 FFmpegFile::isInvalid() const
 {
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_infoLock);
 #endif
 
     return _invalidState;
@@ -937,7 +1404,9 @@ FFmpegFile::seekFrame(int frame,
     ///Private should not lock
 
     avcodec_flush_buffers(stream->_codecContext);
-    int64_t timestamp = stream->frameToPts(frame);
+    // with an index, seek straight to the key-frame before the frame
+    Stream::KeyFrame keyFrame;
+    int64_t timestamp = stream->getKeyFrame(frame, &keyFrame) ? keyFrame.timestamp : stream->frameToPts(frame);
     int error = av_seek_frame(_context, stream->_idx, timestamp, AVSEEK_FLAG_BACKWARD);
     if (error < 0) {
         // Seek error. Abort attempt to read and decode frames.
@@ -955,13 +1424,57 @@ FFmpegFile::decode(int frame,
                    bool loadNearest,
                    int maxRetries)
 {
-    
-    const unsigned int streamIdx = 0;
-    
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_lock);
+#endif
+
+    if ( !decodeFrame(frame, loadNearest, maxRetries) ) {
+        return false;
+    }
+    // the next frames may be decoded ahead of this one (see readAhead())
+    Stream* stream = _streams[0];
+    stream->_lastRendered = std::max( 0, std::min(frame, (int)stream->_frames - 1) );
+
+    return true;
+}
+
+bool
+FFmpegFile::readAhead(int maxFrames)
+{
+#ifdef OFX_IO_MT_FFMPEG
+    IO::AutoMutex guard(_lock);
 #endif
 
+    if (_streams.empty() || _invalidState) {
+        return false;
+    }
+    Stream* stream = _streams[0];
+    if (stream->_lastRendered < 0) {
+        return false;
+    }
+    const int lastFrame = stream->_lastRendered + std::min( maxFrames, stream->getReadAheadCapacity() );
+    int frame = stream->_lastRendered + 1;
+    while ( frame <= lastFrame && stream->hasRingFrame(frame) ) {
+        ++frame;
+    }
+    // seeking in the background would move the decoder away from the frames the renders want
+    if ( (frame > lastFrame) || (frame >= stream->_frames) || !stream->canDecodeForward(frame) ) {
+        return false;
+    }
+
+    // the target frame is stored in the ring by decodeFrame()
+    return decodeFrame(frame, false, 1) && stream->hasRingFrame(frame);
+}
+
+// decode a single frame into the buffer
+bool
+FFmpegFile::decodeFrame(int frame,
+                        bool loadNearest,
+                        int maxRetries)
+{
+    
+    const unsigned int streamIdx = 0;
+
     if ( streamIdx >= _streams.size() ) {
         return false;
     }
@@ -971,6 +1484,10 @@ FFmpegFile::decode(int frame,
     // get the stream
     Stream* stream = _streams[streamIdx];
 
+    if (_indexPending) {
+        updatePendingIndex(*stream);
+    }
+
     // Early-out if out-of-range frame requested.
 
     if (frame < 0) {
@@ -991,6 +1508,16 @@ FFmpegFile::decode(int frame,
     std::cout << "FFmpeg Reader=" << this << "::decode(): frame=" << frame << ", videoStream=" << streamIdx << ", streamIdx=" << stream->_idx << std::endl;
 #endif
 
+    // Frames decoded recently, or on the way to a frame after a seek, are kept in memory: stepping backward does not
+    // have to seek and decode the whole GOP again.
+    if ( stream->getRingFrame(frame, _data) ) {
+#if TRACE_DECODE_PROCESS
+        std::cout << "<-validPicture=1 for frame " << frame << " (recently decoded)" << std::endl;
+#endif
+
+        return true;
+    }
+
     // Number of read retries remaining when decode stall is detected before we give up (in the case of post-seek stalls,
     // such retries are applied only after we've searched all the way back to the start of the file and failed to find a
     // successful start point for playback)..
@@ -1025,7 +1552,9 @@ FFmpegFile::decode(int frame,
     int lastSeekedFrame = -1; // 0-based index of the last frame to which we seeked when seek in progress / negative when no
     // seek in progress,
 
-    if (frame != stream->_decodeNextFrameOut) {
+    // If the frame we want is a few frames ahead (or after the key-frame a seek would land on), decoding the frames in
+    // between is cheaper than seeking back to a key-frame.
+    if ( !stream->canDecodeForward(frame) ) {
 #if TRACE_DECODE_PROCESS
         std::cout << "  Next frame expected out=" << stream->_decodeNextFrameOut << ", Seeking to desired frame" << std::endl;
 #endif
@@ -1073,7 +1602,12 @@ FFmpegFile::decode(int frame,
             // the following if() was not in Nuke's FFmpeg Reader.cpp
             if (error == (int)AVERROR_EOF) {
                 // getStreamFrames() was probably wrong
-                stream->_frames = stream->_decodeNextFrameIn;
+                {
+#ifdef OFX_IO_MT_FFMPEG
+                    IO::AutoMutex guard(_infoLock);
+#endif
+                    stream->_frames = stream->_decodeNextFrameIn;
+                }
                 if (loadNearest) {
                     // try again
                     frame = (int)stream->_frames - 1;
@@ -1145,9 +1679,10 @@ FFmpegFile::decode(int frame,
                         }
 #endif
 
-                        // Wind back 1 frame from last seeked frame. If that takes us to before frame 0, we're never going to be
-                        // able to synchronise using the current timestamp source...
-                        if (--lastSeekedFrame < 0) {
+                        // Wind back 1 frame (or to the previous key-frame if the stream is indexed) from last seeked frame. If that
+                        // takes us to before frame 0, we're never going to be able to synchronise using the current timestamp source...
+                        lastSeekedFrame = stream->getPreviousSeekFrame(lastSeekedFrame);
+                        if (lastSeekedFrame < 0) {
 #if TRACE_DECODE_PROCESS
                             std::cout << ", can't seek before start";
 #endif
@@ -1300,30 +1835,29 @@ FFmpegFile::decode(int frame,
                 std::cout << ", is desired frame" << std::endl;
 #endif
 
-                SwsContext* context = NULL;
-                {
-                    context = stream->getConvertCtx(stream->_codecContext->pix_fmt, stream->_width, stream->_height,
-                                                    srcColourRange,
-                                                    stream->_outputPixelFormat, stream->_width, stream->_height);
-                }
-
-                // Scale if any of the decoding path has provided a convert
-                // context. Otherwise, no scaling/conversion is required after
-                // decoding the frame.
-                if (context) {
-                    AVPicture output;
-                    avpicture_fill(&output, _data, stream->_outputPixelFormat, stream->_width, stream->_height);
-                    sws_scale(context,
-                              stream->_avFrame->data,
-                              stream->_avFrame->linesize,
-                              0,
-                              stream->_height,
-                              output.data,
-                              output.linesize);
+                if ( convertFrame(stream, srcColourRange, _data) ) {
+                    unsigned char* ringData = stream->getRingSlot(frame);
+                    if (ringData) {
+                        std::copy(_data, _data + stream->_frameBytes, ringData);
+                    }
                 }
 
                 hasPicture = true;
             }
+            // If it is one of the frames just before the desired one (typically decoded after seeking to a key-frame), keep
+            // it for backward scrubbing.
+            else if ( (stream->_decodeNextFrameOut >= 0) && (stream->_decodeNextFrameOut < frame) &&
+                      ( (std::size_t)(frame - stream->_decodeNextFrameOut) < stream->_ringCapacity ) &&
+                      !stream->hasRingFrame(stream->_decodeNextFrameOut) ) {
+#if TRACE_DECODE_PROCESS
+                std::cout << ", is not desired frame (" << frame << "), kept" << std::endl;
+#endif
+                unsigned char* ringData = stream->getRingSlot(stream->_decodeNextFrameOut);
+                if ( ringData && !convertFrame(stream, srcColourRange, ringData) ) {
+                    // no conversion, drop the slot
+                    stream->dropRingFront();
+                }
+            }
 #if TRACE_DECODE_PROCESS
             else {
                 std::cout << ", is not desired frame (" << frame << ")" << std::endl;
@@ -1429,12 +1963,111 @@ FFmpegFile::decode(int frame,
     return hasPicture;
 } // FFmpegFile::decode
 
+bool
+FFmpegFile::convertFrame(Stream* stream,
+                         int srcColourRange,
+                         unsigned char* dst)
+{
+    if (stream->_isPlanarYUV) {
+        const AVFrame* frame = stream->_avFrame;
+        if ( (frame->format >= 0) && (frame->format != stream->_planarYUVFormat) ) {
+            // the pixel format changed since the file was opened
+            setError("FFmpeg Reader: the pixel format of the video changed");
+
+            return false;
+        }
+        const PlanarYUVInfo& yuv = stream->_planarYUV;
+        const int sampleBytes = yuv.bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char);
+        const int chromaWidth = -( (-stream->_width) >> yuv.chromaShiftX );
+        const int chromaHeight = -( (-stream->_height) >> yuv.chromaShiftY );
+        av_image_copy_plane(dst, stream->_width * sampleBytes, frame->data[0], frame->linesize[0],
+                            stream->_width * sampleBytes, stream->_height);
+        dst += (std::size_t)stream->_width * stream->_height * sampleBytes;
+        for (int p = 1; p <= 2; ++p) {
+            av_image_copy_plane(dst, chromaWidth * sampleBytes, frame->data[p], frame->linesize[p],
+                                chromaWidth * sampleBytes, chromaHeight);
+            dst += (std::size_t)chromaWidth * chromaHeight * sampleBytes;
+        }
+
+        return true;
+    }
+
+    SwsContext* context = stream->getConvertCtx(stream->_codecContext->pix_fmt, stream->_width, stream->_height,
+                                                srcColourRange,
+                                                stream->_outputPixelFormat, stream->_width, stream->_height);
+
+    // Scale if any of the decoding path has provided a convert
+    // context. Otherwise, no scaling/conversion is required after
+    // decoding the frame.
+    if (!context) {
+        return false;
+    }
+    AVPicture output;
+    avpicture_fill(&output, dst, stream->_outputPixelFormat, stream->_width, stream->_height);
+    sws_scale(context,
+              stream->_avFrame->data,
+              stream->_avFrame->linesize,
+              0,
+              stream->_height,
+              output.data,
+              output.linesize);
+
+    return true;
+}
+
+bool
+FFmpegFile::getPlanarYUVInfo(PlanarYUVInfo* info) const
+{
+#ifdef OFX_IO_MT_FFMPEG
+    IO::AutoMutex guard(_lock);
+#endif
+
+    if ( _streams.empty() || !_streams[0]->_isPlanarYUV ) {
+        return false;
+    }
+    Stream* stream = _streams[0];
+    *info = stream->_planarYUV;
+    // same choices as Stream::getConvertCtx()
+    if (stream->_codecContext->color_range == AVCOL_RANGE_JPEG) {
+        info->fullRange = true;
+    } else if (stream->_codecContext->color_range == AVCOL_RANGE_MPEG) {
+        info->fullRange = false;
+    }
+    info->rec709 = stream->isRec709Format();
+    if (stream->_colorMatrixTypeOverride > 0) {
+        info->rec709 = (stream->_colorMatrixTypeOverride == 1);
+    }
+
+    return true;
+}
+
+int
+FFmpegFile::getDecodeDistance(int frame) const
+{
+#ifdef OFX_IO_MT_FFMPEG
+    IO::AutoMutex guard(_lock);
+#endif
+
+    if (_streams.empty()) {
+        return -1;
+    }
+    const Stream* stream = _streams[0];
+    if ( stream->hasRingFrame(frame) ) {
+        return 0;
+    }
+    if ( !stream->canDecodeForward(frame) ) {
+        return -1;
+    }
+
+    return frame - stream->_decodeNextFrameOut;
+}
+
 bool
 FFmpegFile::getFPS(double & fps,
                    unsigned streamIdx)
 {
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_infoLock);
 #endif
 
     if ( streamIdx >= _streams.size() ) {
@@ -1457,7 +2090,7 @@ FFmpegFile::getInfo(int & width,
                     unsigned streamIdx)
 {
 #ifdef OFX_IO_MT_FFMPEG
-    OFX::MultiThread::AutoMutex guard(_lock);
+    IO::AutoMutex guard(_infoLock);
 #endif
 
     if ( streamIdx >= _streams.size() ) {
@@ -1494,39 +2127,234 @@ FFmpegFile::getBufferSize() const
     return getRowSize() * getHeight();
 }
 
+namespace {
+IO::Mutex gRingBudgetLock;
+std::size_t gRingBudget = 0; // in bytes
+bool gRingBudgetRead = false;
+std::size_t gRingBytesHeld = 0;
+} // anon namespace
+
+std::size_t
+FFmpegRingBudget::getSize()
+{
+    IO::AutoMutex l(gRingBudgetLock);
+    if (!gRingBudgetRead) {
+        long ringMegaBytes = kFFmpegFrameRingSizeDefault;
+        const char* env = std::getenv(kFFmpegFrameRingSizeEnvVar);
+        if (env) {
+            ringMegaBytes = std::max(std::atol(env), 0L);
+        }
+        gRingBudget = (std::size_t)ringMegaBytes * 1024 * 1024;
+        gRingBudgetRead = true;
+    }
+
+    return gRingBudget;
+}
+
+bool
+FFmpegRingBudget::acquire(std::size_t bytes)
+{
+    const std::size_t budget = getSize();
+    IO::AutoMutex l(gRingBudgetLock);
+    if (gRingBytesHeld + bytes > budget) {
+        return false;
+    }
+    gRingBytesHeld += bytes;
+
+    return true;
+}
+
+void
+FFmpegRingBudget::release(std::size_t bytes)
+{
+    IO::AutoMutex l(gRingBudgetLock);
+    assert(gRingBytesHeld >= bytes);
+    gRingBytesHeld -= bytes;
+}
+
+namespace {
+IO::Mutex gThreadBudgetLock;
+int gThreadBudget = 0; // the number of decoding threads, 0 until the first decoder is opened
+int gThreadsHeld = 0;
+int gThreadHolders = 0;
+
+// gThreadBudgetLock must be held
+int
+getThreadBudget()
+{
+    if (gThreadBudget <= 0) {
+        gThreadBudget = video_decoding_threads();
+        const char* env = std::getenv(kFFmpegDecodeThreadsEnvVar);
+        if (env) {
+            gThreadBudget = std::atoi(env);
+        }
+        gThreadBudget = std::max(1, gThreadBudget);
+    }
+
+    return gThreadBudget;
+}
+
+// The share of a new decoder. Dividing by one more than the number of decoders (the new one included) leaves threads
+// for the next one: the first decoder gets half the threads, the second a third...
+// gThreadBudgetLock must be held
+int
+getThreadFairShare()
+{
+    return std::max(1, getThreadBudget() / (gThreadHolders + 2));
+}
+} // anon namespace
+
+int
+FFmpegThreadBudget::acquire()
+{
+    IO::AutoMutex l(gThreadBudgetLock);
+    const int available = getThreadBudget() - gThreadsHeld;
+    const int threads = std::max( 1, std::min(getThreadFairShare(), available) );
+    gThreadsHeld += threads;
+    ++gThreadHolders;
+
+    return threads;
+}
+
+void
+FFmpegThreadBudget::release(int threads)
+{
+    if (threads <= 0) {
+        return;
+    }
+    IO::AutoMutex l(gThreadBudgetLock);
+    gThreadsHeld -= threads;
+    --gThreadHolders;
+    assert(gThreadsHeld >= 0 && gThreadHolders >= 0);
+}
+
+bool
+FFmpegThreadBudget::isContended()
+{
+    IO::AutoMutex l(gThreadBudgetLock);
+
+    return getThreadBudget() - gThreadsHeld < getThreadFairShare();
+}
+
 FFmpegFileManager::FFmpegFileManager()
 : _files()
-, _lock(0)
+, _orphans()
+, _maxDecoders(1)
+, _readAheadFrames(0)
+, _lock()
+, _released()
+, _readAheadCond()
+, _readAheadThreads()
+, _lastOpening(0)
+, _indexQueue()
+, _indexRequests()
+, _indexCond()
+, _indexThread(NULL)
+, _quit(false)
 {
     
 }
 
 FFmpegFileManager::~FFmpegFileManager()
 {
+    stopThreads();
     for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            delete *it2;
+        for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            delete it2->file;
         }
     }
     _files.clear();
-    delete _lock;
+    for (std::map<FFmpegFile*, int>::iterator it = _orphans.begin(); it != _orphans.end(); ++it) {
+        delete it->first;
+    }
+    _orphans.clear();
 }
 
 void
 FFmpegFileManager::init()
 {
-    _lock = new OFX::MultiThread::Mutex(0);
+    // the multithread suite is available from now on
+    int maxDecoders = std::min((int)OFX::MultiThread::getNumCPUs(), kFFmpegMaxDecodersDefault);
+    const char* env = std::getenv(kFFmpegMaxDecodersEnvVar);
+    if (env) {
+        maxDecoders = std::atoi(env);
+    }
+    int readAheadFrames = kFFmpegReadAheadDefault;
+    env = std::getenv(kFFmpegReadAheadEnvVar);
+    if (env) {
+        readAheadFrames = std::atoi(env);
+    }
+    IO::AutoMutex guard(_lock);
+    _maxDecoders = std::max(1, maxDecoders);
+    _readAheadFrames = std::max(0, readAheadFrames);
+}
+
+void
+FFmpegFileManager::stopThreads()
+{
+    std::vector<IO::Thread*> threads;
+    {
+        IO::AutoMutex guard(_lock);
+        _quit = true;
+        threads.swap(_readAheadThreads);
+        if (_indexThread) {
+            threads.push_back(_indexThread);
+            _indexThread = NULL;
+        }
+        _readAheadCond.wakeAll();
+        _indexCond.wakeAll();
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    IO::AutoMutex guard(_lock);
+    // the threads are started again by the next sequential render, or the next file to index
+    _quit = false;
+    _indexQueue.clear();
+    _indexRequests.clear();
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            it2->readAhead = false;
+        }
+    }
+}
+
+void
+FFmpegFileManager::reclaimThreads()
+{
+    if ( !FFmpegThreadBudget::isContended() ) {
+        return;
+    }
+    // the thread count of a codec is fixed: close the decoder, it will be reopened with its share when needed
+    const std::time_t now = std::time(0);
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end();) {
+            if ( !it2->busy && (it2->users == 0) && (it2->file->getDecodeThreads() > 1) && (now - it2->lastUse >= kFFmpegDecoderIdleSeconds) ) {
+                delete it2->file;
+                it2 = it->second.erase(it2);
+            } else {
+                ++it2;
+            }
+        }
+    }
 }
 
 void
 FFmpegFileManager::clear(void* plugin)
 {
-    assert(_lock);
-    OFX::MultiThread::AutoMutex guard(*_lock);
+    IO::AutoMutex guard(_lock);
     FilesMap::iterator found = _files.find(plugin);
     if (found != _files.end()) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            delete *it;
+        for (std::list<Decoder>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
+            if (!it->file) {
+                // being opened: openDecoder() deletes it
+            } else if (it->busy || it->users > 0) {
+                // deleted by release() or unref(), whichever comes last
+                _orphans[it->file] = (it->busy ? 1 : 0) + it->users;
+            } else {
+                delete it->file;
+            }
         }
         _files.erase(found);
     }
@@ -1538,33 +2366,364 @@ FFmpegFileManager::getOrCreate(void* plugin,const std::string &filename)
     if (filename.empty() || !plugin) {
         return 0;
     }
-    assert(_lock);
-    OFX::MultiThread::AutoMutex guard(*_lock);
-    FilesMap::iterator found = _files.find(plugin);
-    if (found != _files.end()) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ((*it)->getFilename() == filename) {
-                if ((*it)->isInvalid()) {
-                    delete *it;
-                    found->second.erase(it);
-                    break;
+    IO::AutoMutex guard(_lock);
+    bool opening = true;
+    while (opening) {
+        opening = false;
+        std::list<Decoder>& decoders = _files[plugin];
+        for (std::list<Decoder>::iterator it = decoders.begin(); it != decoders.end();) {
+            if (it->filename != filename) {
+                ++it;
+            } else if (!it->file) {
+                opening = true;
+                ++it;
+            } else if (!it->file->isInvalid()) {
+                // the caller uses it without holding it, possibly while another thread decodes with it
+                it->lastUse = std::time(0);
+                ++it->users;
+                return it->file;
+            } else if (!it->busy && it->users == 0) {
+                delete it->file;
+                it = decoders.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (opening) {
+            // another thread is opening the file: wait for it rather than opening it twice
+            _released.wait(_lock);
+        }
+    }
+    
+    Decoder* decoder = openDecoder(plugin, filename);
+    if (!decoder) {
+        return 0;
+    }
+    decoder->busy = false;
+    decoder->users = 1;
+    _released.wakeAll();
+    return decoder->file;
+}
+
+void
+FFmpegFileManager::unref(FFmpegFile* file)
+{
+    IO::AutoMutex guard(_lock);
+    if ( releaseOrphan(file) ) {
+        return;
+    }
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            if (it2->file == file) {
+                assert(it2->users > 0);
+                --it2->users;
+                return;
+            }
+        }
+    }
+    assert(false);
+}
+
+FFmpegFile*
+FFmpegFileManager::acquire(void* plugin,
+                           const std::string &filename,
+                           int frame)
+{
+    if (filename.empty() || !plugin) {
+        return 0;
+    }
+    IO::AutoMutex guard(_lock);
+    for (;;) {
+        std::list<Decoder>& decoders = _files[plugin];
+        std::list<Decoder>::iterator best = decoders.end(); // the closest decoder that does not need to seek
+        std::list<Decoder>::iterator lru = decoders.end(); // the least recently acquired idle decoder
+        std::list<Decoder>::iterator readingAhead = decoders.end(); // a decoder that is decoding this frame in the background
+        int bestDistance = 0;
+        int count = 0;
+        for (std::list<Decoder>::iterator it = decoders.begin(); it != decoders.end();) {
+            if (it->filename != filename) {
+                ++it;
+                continue;
+            }
+            // the decoders being opened are busy
+            if (!it->busy && it->file->isInvalid()) {
+                // a previous decode failed: reopen the file, and close this one unless its properties are being read
+                if (it->users == 0) {
+                    delete it->file;
+                    it = decoders.erase(it);
                 } else {
-                    return *it;
+                    ++it;
+                }
+                continue;
+            }
+            ++count;
+            if (!it->busy) {
+                if (lru == decoders.end()) {
+                    lru = it;
+                }
+                const int distance = it->file->getDecodeDistance(frame);
+                if (distance >= 0 && (best == decoders.end() || distance < bestDistance)) {
+                    best = it;
+                    bestDistance = distance;
                 }
+            } else if ( it->readingAhead && (frame > it->lastFrame) && (frame - it->lastFrame <= _readAheadFrames) ) {
+                readingAhead = it;
             }
+            ++it;
         }
+        if ( readingAhead != decoders.end() && (best == decoders.end() || bestDistance > 0) ) {
+            // wait for the frame being decoded rather than decoding it again, and keep the read-ahead thread from
+            // taking the decoder back before this render
+            readingAhead->readAhead = false;
+            _released.wait(_lock);
+            continue;
+        }
+        if (best == decoders.end() && count < _maxDecoders) {
+            // open a new decoder rather than moving one that may be used by a sequential render elsewhere in the file
+            Decoder* decoder = openDecoder(plugin, filename);
+            if (!decoder) {
+                return 0;
+            }
+            // it is ours: it was busy since it was inserted
+            decoder->lastUse = std::time(0);
+            decoder->lastFrame = frame;
+            return decoder->file;
+        }
+        if (best == decoders.end()) {
+            best = lru;
+        }
+        if (best != decoders.end()) {
+            best->busy = true;
+            best->lastUse = std::time(0);
+            // read ahead once the renders are sequential, stop on a seek
+            best->readAhead = (_readAheadFrames > 0) && (best->lastFrame >= 0) && (frame == best->lastFrame + 1);
+            best->lastFrame = frame;
+            // move to the end of the LRU list
+            decoders.splice(decoders.end(), decoders, best);
+            return best->file;
+        }
+        // all the decoders of this file are busy
+        _released.wait(_lock);
     }
-    
-    
-    FFmpegFile* file = new FFmpegFile(filename);
-    if (found == _files.end()) {
-        std::list<FFmpegFile*> fileList;
-        fileList.push_back(file);
-        _files.insert(std::make_pair(plugin, fileList));
-    } else {
-        found->second.push_back(file);
+}
+
+void
+FFmpegFileManager::release(FFmpegFile* file)
+{
+    IO::AutoMutex guard(_lock);
+    Decoder* decoder = releaseDecoder(file);
+    if (decoder && decoder->readAhead) {
+        startReadAhead();
+    }
+}
+
+bool
+FFmpegFileManager::releaseOrphan(FFmpegFile* file)
+{
+    std::map<FFmpegFile*, int>::iterator orphan = _orphans.find(file);
+    if (orphan == _orphans.end()) {
+        return false;
+    }
+    if (--orphan->second == 0) {
+        _orphans.erase(orphan);
+        delete file;
+    }
+
+    return true;
+}
+
+FFmpegFileManager::Decoder*
+FFmpegFileManager::releaseDecoder(FFmpegFile* file)
+{
+    if ( releaseOrphan(file) ) {
+        return NULL;
+    }
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            if (it2->file == file) {
+                assert(it2->busy);
+                it2->busy = false;
+                it2->readingAhead = false;
+                it2->lastUse = std::time(0);
+                _released.wakeAll();
+                return &*it2;
+            }
+        }
     }
-    return file;
+    assert(false);
+    return NULL;
 }
 
+FFmpegFileManager::Decoder*
+FFmpegFileManager::openDecoder(void* plugin,
+                               const std::string &filename)
+{
+    reclaimThreads();
+    Decoder placeholder;
+    placeholder.file = NULL;
+    placeholder.filename = filename;
+    placeholder.opening = ++_lastOpening;
+    placeholder.busy = true;
+    placeholder.lastUse = std::time(0);
+    placeholder.lastFrame = -1;
+    placeholder.readAhead = false;
+    placeholder.readingAhead = false;
+    placeholder.users = 0;
+    _files[plugin].push_back(placeholder);
+    const int opening = placeholder.opening;
+
+    // opening a file reads its headers, and may read much more to get its frame count (see getStreamFrames()): the other
+    // threads keep using the manager meanwhile
+    _lock.unlock();
+    FFmpegFile* file = NULL;
+    try {
+        file = new FFmpegFile(filename);
+    } catch (const std::exception &) {
+        file = NULL;
+    }
+    _lock.lock();
+    // the threads waiting for the placeholder look again
+    _released.wakeAll();
 
+    FilesMap::iterator found = _files.find(plugin);
+    if (found != _files.end()) {
+        for (std::list<Decoder>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
+            if (it->opening != opening) {
+                continue;
+            }
+            if (!file) {
+                found->second.erase(it);
+                return NULL;
+            }
+            it->file = file;
+            it->opening = 0;
+            if ( file->isIndexPending() ) {
+                requestIndex(filename);
+            }
+            return &*it;
+        }
+    }
+    // clear() was called meanwhile
+    delete file;
+    return NULL;
+}
+
+void
+FFmpegFileManager::requestIndex(const std::string &filename)
+{
+    if ( _quit || !_indexRequests.insert(filename).second ) {
+        return;
+    }
+    _indexQueue.push_back(filename);
+    // a single thread: indexing reads whole files, which the decoders are reading too
+    if (!_indexThread) {
+        IO::Thread* thread = new IO::Thread;
+        if ( thread->start(&FFmpegFileManager::indexEntry, this) ) {
+            _indexThread = thread;
+        } else {
+            delete thread;
+            _indexQueue.clear();
+            return;
+        }
+    }
+    _indexCond.wakeOne();
+}
+
+void
+FFmpegFileManager::indexWorker()
+{
+    _lock.lock();
+    while (!_quit) {
+        if ( _indexQueue.empty() ) {
+            _indexCond.wait(_lock);
+            continue;
+        }
+        const std::string filename = _indexQueue.front();
+        _indexQueue.pop_front();
+        _lock.unlock();
+        // the decoder saves the index to the cache, where the opened decoders find it
+        try {
+            FFmpegFile* indexer = new FFmpegFile(filename, this);
+            delete indexer;
+        } catch (const std::exception &) {
+        }
+        _lock.lock();
+    }
+    _lock.unlock();
+}
+
+bool
+FFmpegFileManager::isCancelled() const
+{
+    IO::AutoMutex guard(_lock);
+
+    return _quit;
+}
+
+void
+FFmpegFileManager::startReadAhead()
+{
+    std::size_t readers = 0;
+    for (FilesMap::const_iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<Decoder>::const_iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            if (it2->readAhead) {
+                ++readers;
+            }
+        }
+    }
+    // the threads are kept until the plugin is unloaded
+    if ( !_quit && (_readAheadThreads.size() < readers) && (_readAheadThreads.size() < (std::size_t)_maxDecoders) ) {
+        IO::Thread* thread = new IO::Thread;
+        if ( thread->start(&FFmpegFileManager::readAheadEntry, this) ) {
+            _readAheadThreads.push_back(thread);
+        } else {
+            delete thread;
+        }
+    }
+    _readAheadCond.wakeOne();
+}
+
+void
+FFmpegFileManager::readAheadWorker()
+{
+    _lock.lock();
+    for (;;) {
+        FFmpegFile* file = NULL;
+        while (!_quit && !file) {
+            for (FilesMap::iterator it = _files.begin(); it != _files.end() && !file; ++it) {
+                for (std::list<Decoder>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+                    if (it2->readAhead && !it2->busy) {
+                        it2->busy = true;
+                        it2->readingAhead = true;
+                        file = it2->file;
+                        break;
+                    }
+                }
+            }
+            if (!file) {
+                _readAheadCond.wait(_lock);
+            }
+        }
+        if (_quit) {
+            break;
+        }
+
+        // decode one frame at a time without holding the lock, so that a render waiting for the decoder gets it quickly
+        const int readAheadFrames = _readAheadFrames;
+        _lock.unlock();
+        bool decoded = false;
+        try {
+            decoded = file->readAhead(readAheadFrames);
+        } catch (const std::exception &) {
+            decoded = false;
+        }
+        _lock.lock();
+
+        Decoder* decoder = releaseDecoder(file);
+        if (decoder && !decoded) {
+            // the frames ahead are decoded (or the render seeked away): wait for the next sequential render
+            decoder->readAhead = false;
+        }
+    }
+    _lock.unlock();
+}
@@ -35,9 +35,11 @@
 #include <string>
 #include <map>
 #include <list>
+#include <set>
 #include <algorithm>
 #include <locale>
 #include <cstdio>
+#include <ctime>
 extern "C" {
 #include <errno.h>
 #include <libavformat/avformat.h>
@@ -53,6 +55,8 @@ extern "C" {
 
 #include "ofxsMultiThread.h"
 
+#include "IOThread.h"
+
 #define CHECKMSG(x,msg) \
 {\
   int error = (x);\
@@ -89,10 +93,88 @@ extern "C" {
 
 #define kChunkSizeKey "fn_log2chunksize"
 
+// decode() decodes forward instead of seeking when the requested frame is at most this
+// number of frames after the next frame out of the decoder
+#define kFFmpegMaxDecodeForwardFrames 8
+
+// the maximum number of decoders opened on the same file by a reader instance (default: the number of CPUs, at most 4)
+#define kFFmpegMaxDecodersEnvVar "OFX_IO_FFMPEG_MAX_DECODERS"
+#define kFFmpegMaxDecodersDefault 4
+
+// the directory where the key-frame indexes of the video files are cached (default: "openfx-io/FFmpegIndex" in the
+// user cache directory). An empty value disables the index.
+#define kFFmpegIndexCacheEnvVar "OFX_IO_FFMPEG_INDEX_CACHE"
+
+// the size in MB of the recently decoded frames kept by all the decoders of the process, for backward scrubbing
+// (0 disables it)
+#define kFFmpegFrameRingSizeEnvVar "OFX_IO_FFMPEG_FRAME_RING_SIZE"
+#define kFFmpegFrameRingSizeDefault 512
+// the maximum number of frames kept by each decoder
+#define kFFmpegFrameRingMaxFrames 64
+
+// the number of decoding threads shared by all the decoders of the process (default: the number of CPUs, at most 16)
+#define kFFmpegDecodeThreadsEnvVar "OFX_IO_FFMPEG_DECODE_THREADS"
+
+// idle decoders that hold several threads are closed after that many seconds when other decoders need the threads
+#define kFFmpegDecoderIdleSeconds 5
+
+// the maximum number of frames decoded in the background ahead of a sequential render, for each decoder (0 disables
+// read-ahead). It is also limited to half of the frame ring (see kFFmpegFrameRingSizeEnvVar).
+#define kFFmpegReadAheadEnvVar "OFX_IO_FFMPEG_READ_AHEAD"
+#define kFFmpegReadAheadDefault 16
+
+/**
+ * @brief The memory of the decoded frames kept by the decoders (see kFFmpegFrameRingSizeEnvVar), shared by all the
+ * decoders of the process.
+ *
+ * A decoder adds a frame to its ring only if the budget allows it, else it recycles its least recently used frame.
+ **/
+class FFmpegRingBudget
+{
+public:
+    /// the size of the budget, in bytes
+    static std::size_t getSize();
+
+    /// reserve the memory of a new frame. Returns false if the rings already use the whole budget.
+    static bool acquire(std::size_t bytes);
+
+    /// give back the memory of deleted frames
+    static void release(std::size_t bytes);
+};
+
 class FFmpegFile {
 
+public:
+    // Layout of the decoded frames of a planar YUV stream: they are kept as the Y, Cb and Cr planes of the decoder, one
+    // after the other without padding, and converted to RGB by the reader (see getPlanarYUVInfo()).
+    struct PlanarYUVInfo
+    {
+        int chromaShiftX; // log2 of the horizontal chroma subsampling
+        int chromaShiftY; // log2 of the vertical chroma subsampling
+        int bitDepth;     // 8 (samples are bytes), 10 or 12 (samples are native unsigned shorts)
+        bool fullRange;   // true if the samples use the full (JPEG) range, false for the video (MPEG) range
+        bool rec709;      // true for the Rec. 709 matrix, false for Rec. 601
+    };
+
+    // Lets another thread interrupt the construction of a decoder that builds the key-frame index (see FFmpegFile()).
+    class IndexCancel
+    {
+    public:
+        virtual bool isCancelled() const = 0;
+
+    protected:
+        ~IndexCancel() {}
+    };
+
+private:
     struct Stream
     {
+        struct KeyFrame
+        {
+            int frame;         // 0-based index of the key-frame
+            int64_t timestamp; // timestamp to seek to, to land on the key-frame (its DTS if known, else its PTS)
+        };
+
         int _idx;                      // stream index
         AVStream* _avstream;           // video stream
         AVCodecContext* _codecContext; // video codec context
@@ -107,6 +189,25 @@ class FFmpegFile {
         int64_t _startPTS;     // PTS of the first frame in the stream
         int64_t _frames;       // video duration in frames
 
+        std::vector<KeyFrame> _keyFrames; // key-frames of the stream, sorted by frame, or empty if the stream is not indexed
+        bool _intraOnly;                  // true if the stream is indexed and all its frames are key-frames
+        int64_t _lastPTS;                 // largest PTS found while indexing the stream, or AV_NOPTS_VALUE
+
+        struct RingFrame
+        {
+            int frame;           // 0-based index of the frame
+            unsigned char* data; // the frame, converted to the output pixel format
+        };
+        std::list<RingFrame> _ring;  // recently decoded frames, most recently used first
+        std::size_t _ringCapacity;   // maximum number of frames in _ring
+        std::size_t _frameBytes;     // size of a converted frame
+        int _lastRendered;           // the last frame returned by decode(), or -1. The frames decoded ahead of it are
+                                     // not recycled by getRingSlot() until they are rendered.
+
+        bool _isPlanarYUV;            // true if the decoded frames are kept in their planar YUV layout
+        PlanarYUVInfo _planarYUV;     // that layout
+        AVPixelFormat _planarYUVFormat; // the pixel format of the decoder for that layout
+
         bool _ptsSeen;                      // True if a read AVPacket has ever contained a valid PTS during this stream's decode,
         // indicating that this stream does contain PTSs.
         int64_t AVPacket::*_timestampField; // Pointer to member of AVPacket from which timestamps are to be retrieved. Enables
@@ -147,6 +248,16 @@ class FFmpegFile {
         , _fpsDen(1)
         , _startPTS(0)
         , _frames(0)
+        , _keyFrames()
+        , _intraOnly(false)
+        , _lastPTS(AV_NOPTS_VALUE)
+        , _ring()
+        , _ringCapacity(0)
+        , _frameBytes(0)
+        , _lastRendered(-1)
+        , _isPlanarYUV(false)
+        , _planarYUV()
+        , _planarYUVFormat(AV_PIX_FMT_NONE)
         , _ptsSeen(false)
         , _timestampField(&AVPacket::pts)
         , _width(0)
@@ -186,6 +297,8 @@ class FFmpegFile {
 
             if (_convertCtx)
                 sws_freeContext(_convertCtx);
+
+            clearRing();
         }
 
         static void destroy(Stream* s)
@@ -207,6 +320,150 @@ class FFmpegFile {
             return static_cast<int>(numerator / denominator);
         }
 
+        bool isIndexed() const
+        {
+            return _intraOnly || !_keyFrames.empty();
+        }
+
+        // Get the last key-frame at or before the given frame. Returns false if the stream is not indexed, or if there is
+        // no key-frame before that frame.
+        bool getKeyFrame(int frame, KeyFrame* keyFrame) const
+        {
+            if (_intraOnly) {
+                keyFrame->frame = frame;
+                keyFrame->timestamp = frameToPts(frame);
+                return true;
+            }
+            // first key-frame after frame
+            std::vector<KeyFrame>::const_iterator it = std::upper_bound(_keyFrames.begin(), _keyFrames.end(), frame, KeyFrameLess());
+            if ( it == _keyFrames.begin() ) {
+                return false;
+            }
+            *keyFrame = *(it - 1);
+            return true;
+        }
+
+        // True if decoding from the next frame out of the decoder up to the given frame is cheaper than seeking to it.
+        // With an index, this is the case when the decoder has already passed the key-frame a seek would land on.
+        bool canDecodeForward(int frame) const
+        {
+            if (_decodeNextFrameOut < 0 || frame < _decodeNextFrameOut) {
+                return false;
+            }
+            KeyFrame keyFrame;
+            if ( getKeyFrame(frame, &keyFrame) ) {
+                return keyFrame.frame <= _decodeNextFrameOut;
+            }
+            return frame - _decodeNextFrameOut <= kFFmpegMaxDecodeForwardFrames;
+        }
+
+        // The frame to seek to after a seek to the given frame landed after it: the frame before the key-frame we tried to
+        // land on, or the previous frame if the stream is not indexed. Negative if there is nothing before.
+        int getPreviousSeekFrame(int frame) const
+        {
+            KeyFrame keyFrame;
+            if ( getKeyFrame(frame, &keyFrame) && keyFrame.frame < frame ) {
+                return keyFrame.frame - 1;
+            }
+            return frame - 1;
+        }
+
+        bool hasRingFrame(int frame) const
+        {
+            for (std::list<RingFrame>::const_iterator it = _ring.begin(); it != _ring.end(); ++it) {
+                if (it->frame == frame) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Delete all the frames, e.g. when they would be converted differently
+        void clearRing()
+        {
+            for (std::list<RingFrame>::iterator it = _ring.begin(); it != _ring.end(); ++it) {
+                delete [] it->data;
+            }
+            FFmpegRingBudget::release(_ring.size() * _frameBytes);
+            _ring.clear();
+        }
+
+        // Delete the most recently used frame, which was not filled
+        void dropRingFront()
+        {
+            delete [] _ring.front().data;
+            _ring.pop_front();
+            FFmpegRingBudget::release(_frameBytes);
+        }
+
+        // Copy a recently decoded frame to dst. Returns false if the frame is not in the ring.
+        bool getRingFrame(int frame, unsigned char* dst)
+        {
+            for (std::list<RingFrame>::iterator it = _ring.begin(); it != _ring.end(); ++it) {
+                if (it->frame == frame) {
+                    std::copy(it->data, it->data + _frameBytes, dst);
+                    // move to the front
+                    _ring.splice(_ring.begin(), _ring, it);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The maximum number of frames decoded ahead of the last rendered frame, and kept in the ring.
+        int getReadAheadCapacity() const
+        {
+            return (int)_ringCapacity / 2;
+        }
+
+        // true if the frame was decoded ahead and has not been rendered yet
+        bool isReadAheadFrame(int frame) const
+        {
+            return _lastRendered >= 0 && frame > _lastRendered && frame - _lastRendered <= getReadAheadCapacity();
+        }
+
+        // Get the buffer where a decoded frame is to be stored, recycling the least recently used one if the ring is full
+        // or the memory budget of the rings is used (but not a frame decoded ahead). Returns NULL if the ring is disabled,
+        // or if it is empty and there is no memory left.
+        unsigned char* getRingSlot(int frame)
+        {
+            if (_ringCapacity == 0) {
+                return NULL;
+            }
+            std::list<RingFrame>::iterator it = _ring.begin();
+            while ( it != _ring.end() && it->frame != frame ) {
+                ++it;
+            }
+            if ( it == _ring.end() ) {
+                if ( (_ring.size() < _ringCapacity) && FFmpegRingBudget::acquire(_frameBytes) ) {
+                    RingFrame ringFrame;
+                    ringFrame.frame = frame;
+                    ringFrame.data = new unsigned char[_frameBytes];
+                    _ring.push_front(ringFrame);
+                    return ringFrame.data;
+                }
+                if ( _ring.empty() ) {
+                    return NULL;
+                }
+                it = --_ring.end();
+                // at most half of the ring is decoded ahead
+                while ( it != _ring.begin() && isReadAheadFrame(it->frame) ) {
+                    --it;
+                }
+            }
+            it->frame = frame;
+            _ring.splice(_ring.begin(), _ring, it);
+            return it->data;
+        }
+
+        // orders the key-frames by frame
+        struct KeyFrameLess
+        {
+            bool operator()(const KeyFrame& a, const KeyFrame& b) const { return a.frame < b.frame; }
+            bool operator()(int frame, const KeyFrame& keyFrame) const { return frame < keyFrame.frame; }
+            bool operator()(const KeyFrame& keyFrame, int frame) const { return keyFrame.frame < frame; }
+        };
+
         bool isRec709Format()
         {
             // First check for codecs which require special handling:
@@ -238,11 +495,13 @@ class FFmpegFile {
         // wait this many frames to receive output; any more and a decode stall is detected.
         // In FFmpeg 2.1.4, I found that some codecs now support multithreaded decode which appears as latency
         // I needed to add the thread_count onto the codec delay - pickles
+        // [openfx-io note] only frame threading adds latency. Single-threaded and slice-threaded decoding keep the margin
+        // of one frame they always had.
         int getCodecDelay() const
         {
             return (((_videoCodec->capabilities & CODEC_CAP_DELAY) ? _codecContext->delay : 0)
                     + _codecContext->has_b_frames
-                    + _codecContext->thread_count);
+                    + ((_codecContext->active_thread_type & FF_THREAD_FRAME) ? _codecContext->thread_count : 1));
         }
     };
 
@@ -262,15 +521,27 @@ class FFmpegFile {
     AVPacket _avPacket;
 
     unsigned char* _data;
-    
+
+    int _decodeThreads; // the threads of the decoding budget held by the codec of the first stream
+
+    bool _indexPending;   // the first stream is not indexed yet: its index is built in the background
+    int _indexGeneration; // the index cache generation when the index was last looked for
+
 #ifdef OFX_IO_MT_FFMPEG
-    // internal lock for multithread access
-    mutable OFX::MultiThread::Mutex _lock;
+    // internal lock for multithread access. The decoders are also used by the read-ahead and indexing threads, which may
+    // not use the host suites.
+    mutable IO::Mutex _lock;
+    // protects the properties that a decode may change (the error state and the frame counts), so that
+    // isInvalid(), getError(), getFPS() and getInfo() do not wait for a decode. They are written with both locks held.
+    mutable IO::Mutex _infoLock;
 #endif
 
     // set reader error
     void setError(const char* msg, const char* prefix = 0)
     {
+#ifdef OFX_IO_MT_FFMPEG
+        IO::AutoMutex guard(_infoLock);
+#endif
         if (prefix) {
             _errorMsg = prefix;
             _errorMsg += msg;
@@ -303,12 +574,36 @@ class FFmpegFile {
 
     bool seekFrame(int frame,Stream* stream);
 
+    // Build the key-frame index of the stream by reading all its packets once. Does nothing if the index is disabled.
+    // Stops early, without an index, if cancel says so.
+    void buildIndex(Stream& stream, const IndexCancel& cancel);
+
+    // Set the start PTS, duration and key-frames of the stream from the index cache. Returns false if the file is not in
+    // the cache, or if it was modified since it was indexed.
+    // If keyFramesOnly, only the index kept in memory is used, and only the key-frames are set: the frame range of an
+    // opened decoder does not change.
+    bool loadIndex(Stream& stream, bool keyFramesOnly = false);
+
+    // Use the index built in the background since the stream was opened, if any.
+    void updatePendingIndex(Stream& stream);
+
+    // Save the start PTS, duration and key-frames of the stream to the index cache.
+    void saveIndex(const Stream& stream);
+
+    // Convert the last picture decoded from the stream to the output pixel format. Returns false if there is no
+    // conversion context.
+    bool convertFrame(Stream* stream, int srcColourRange, unsigned char* dst);
+
+    // decode() without locking
+    bool decodeFrame(int frame, bool loadNearest, int maxRetries);
+
 public:
 
     //FFmpegFile();
 
-    // constructor
-    FFmpegFile(const std::string& filename);
+    // constructor. If the key-frame index of the first stream is not in the cache, it is built and saved if indexer is not
+    // NULL, which reads the whole file, else it is left to be built in the background (see isIndexPending()).
+    FFmpegFile(const std::string& filename, const IndexCancel* indexer = NULL);
 
     // destructor
     ~FFmpegFile();
@@ -319,7 +614,7 @@ public:
 
 
     // get the internal error string
-    const std::string& getError() const;
+    std::string getError() const;
 
     // return true if the reader can't decode the frame
     bool isInvalid() const;
@@ -331,14 +626,23 @@ public:
 
     void setColorMatrixTypeOverride(int colorMatrixType) const
     {
+#ifdef OFX_IO_MT_FFMPEG
+        IO::AutoMutex guard(_lock);
+#endif
         if (_streams.empty()) {
             return;
         }
 
         // mov64Reader::decode always uses stream 0
         Stream* stream = _streams[0];
+        if (stream->_colorMatrixTypeOverride == colorMatrixType) {
+            return;
+        }
         stream->_colorMatrixTypeOverride = colorMatrixType;
         stream->_resetConvertCtx = true;
+        // the frames of the ring were converted with the previous matrix (the output pixel format is set once and for
+        // all when the file is opened)
+        stream->clearRing();
     }
 
     void setDoNotAttachPrefix(bool doNotAttachPrefix) const
@@ -442,9 +746,31 @@ public:
         return _streams[0]->_bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char);
     }
 
+    // If the decoded frames are kept as YUV planes, rather than converted to packed RGB, get their layout and return true.
+    bool getPlanarYUVInfo(PlanarYUVInfo* info) const;
+
     // decode a single frame into the buffer (stream 0). Thread safe
     bool decode(int frame, bool loadNearest, int maxRetries);
 
+    // decode the next frame after the last one returned by decode() that is not in the ring yet, and keep it in the ring.
+    // Returns false if nothing was decoded: at most maxFrames frames (and half of the ring) are decoded ahead, and the
+    // decoder is never moved by a seek. Thread safe
+    bool readAhead(int maxFrames);
+
+    // the number of frames decode(frame) has to decode before it gets the frame, or -1 if it has to seek
+    int getDecodeDistance(int frame) const;
+
+    // the number of threads used by the decoder
+    int getDecodeThreads() const {
+        return _decodeThreads;
+    }
+
+    // true if the file has to be indexed: another FFmpegFile is then constructed with an indexer, and this one picks
+    // up the index from the cache before its next seek
+    bool isIndexPending() const {
+        return _indexPending;
+    }
+
     // get stream information
     bool getFPS(double& fps,
                 unsigned streamIdx = 0);
@@ -473,13 +799,97 @@ public:
 };
 
 
-class FFmpegFileManager
+/**
+ * @brief The decoding threads of the process, shared by all the decoders.
+ *
+ * The thread count of a codec cannot change once it is opened: each decoder gets its share of the threads that are
+ * not held by the other decoders when it is opened, and gives them back when it is closed. A decoder always gets at
+ * least one thread (the calling thread, with no extra latency).
+ **/
+class FFmpegThreadBudget
 {
-    ///For each plug-in instance, a list of opened files
-    typedef std::map<void*,std::list<FFmpegFile*> > FilesMap;
+public:
+    /// the threads for a decoder being opened
+    static int acquire();
+
+    /// give back the threads of a closed decoder
+    static void release(int threads);
+
+    /// true if a decoder opened now would get less than its fair share of the threads
+    static bool isContended();
+};
+
+class FFmpegFileManager : private FFmpegFile::IndexCancel
+{
+    struct Decoder
+    {
+        FFmpegFile* file; // NULL while it is being opened
+        std::string filename;
+        int opening; // while it is being opened, the number that identifies it (see openDecoder()), else 0
+        bool busy; // acquired by a thread, or being opened
+        std::time_t lastUse; // when it was last acquired, released or returned by getOrCreate()
+        int lastFrame; // the last frame it was acquired for by a render, or -1
+        bool readAhead; // the renders are sequential: decode the next frames in the background while it is idle
+        bool readingAhead; // acquired by a read-ahead thread
+        int users; // the callers of getOrCreate() that did not call unref() yet: it is not deleted meanwhile
+    };
+
+    ///For each plug-in instance, a list of opened files, least recently acquired first.
+    ///The same file may be opened several times, so that several frames can be decoded concurrently.
+    typedef std::map<void*,std::list<Decoder> > FilesMap;
     FilesMap _files;
-    mutable OFX::MultiThread::Mutex* _lock;
-    
+    std::map<FFmpegFile*, int> _orphans; //< decoders in use removed by clear(), with their number of users, deleted when the last one gives them back
+    int _maxDecoders;
+    int _readAheadFrames;
+    mutable IO::Mutex _lock;
+    IO::Condition _released;
+    IO::Condition _readAheadCond; // signaled when a decoder has to read ahead, or on quit
+    std::vector<IO::Thread*> _readAheadThreads;
+    int _lastOpening;
+    std::list<std::string> _indexQueue; // the files to index in the background
+    std::set<std::string> _indexRequests; // the files queued for indexing since the threads were started
+    IO::Condition _indexCond; // signaled when a file has to be indexed, or on quit
+    IO::Thread* _indexThread;
+    bool _quit;
+
+    // close the idle decoders that hold several threads, if other decoders need them. _lock must be held.
+    void reclaimThreads();
+
+    // give back a decoder. Returns it, or NULL if it was deleted because clear() was called meanwhile. _lock must be held.
+    Decoder* releaseDecoder(FFmpegFile* file);
+
+    // one user of a decoder removed by clear() is done with it: delete it if it was the last one.
+    // Returns false if it is not an orphan. _lock must be held.
+    bool releaseOrphan(FFmpegFile* file);
+
+    // wake up a read-ahead thread, starting one if each decoder that reads ahead does not have its own. _lock must be held.
+    void startReadAhead();
+
+    static void readAheadEntry(void* arg)
+    {
+        static_cast<FFmpegFileManager*>(arg)->readAheadWorker();
+    }
+
+    void readAheadWorker();
+
+    // open a decoder of the file, without holding _lock while the file is opened. It is a busy placeholder meanwhile.
+    // Returns the decoder, still busy, or NULL if it could not be opened or clear() was called meanwhile.
+    // _lock must be held.
+    Decoder* openDecoder(void* plugin, const std::string& filename);
+
+    // build the index of the file in the background, once. _lock must be held.
+    void requestIndex(const std::string& filename);
+
+    static void indexEntry(void* arg)
+    {
+        static_cast<FFmpegFileManager*>(arg)->indexWorker();
+    }
+
+    void indexWorker();
+
+    // interrupts the index being built when the threads are stopped
+    virtual bool isCancelled() const;
+
 public:
     
     FFmpegFileManager();
@@ -487,11 +897,81 @@ public:
     ~FFmpegFileManager();
     
     void init();
+
+    /// stop the read-ahead and indexing threads (e.g. when the plugin is unloaded)
+    void stopThreads();
     
     void clear(void* plugin);
     
+    /// a decoder of the file, to get its properties (not to decode). It may be decoding for another thread meanwhile.
+    /// It is not deleted until it is given back with unref().
     FFmpegFile* getOrCreate(void* plugin,const std::string &filename);
-        
+
+    void unref(FFmpegFile* file);
+
+    /// get exclusive access to a decoder of the file, preferably one that can decode frame without seeking.
+    /// Waits if all the decoders of the file are busy. The decoder must be given back with release().
+    FFmpegFile* acquire(void* plugin, const std::string &filename, int frame);
+
+    void release(FFmpegFile* file);
+};
+
+/**
+ * @brief A decoder from a FFmpegFileManager to get the properties of a file, for the lifetime of this object.
+ **/
+class FFmpegFileRef
+{
+public:
+    FFmpegFileRef(FFmpegFileManager& manager, void* plugin, const std::string &filename)
+    : _manager(manager)
+    , _file(manager.getOrCreate(plugin, filename))
+    {
+    }
+
+    ~FFmpegFileRef()
+    {
+        if (_file) {
+            _manager.unref(_file);
+        }
+    }
+
+    FFmpegFile* get() const { return _file; }
+
+private:
+    FFmpegFileRef(const FFmpegFileRef&);
+    FFmpegFileRef& operator=(const FFmpegFileRef&);
+
+    FFmpegFileManager& _manager;
+    FFmpegFile* _file;
+};
+
+/**
+ * @brief Exclusive access to a decoder from a FFmpegFileManager, for the lifetime of this object.
+ **/
+class FFmpegFileLocker
+{
+public:
+    FFmpegFileLocker(FFmpegFileManager& manager, void* plugin, const std::string &filename, int frame)
+    : _manager(manager)
+    , _file(manager.acquire(plugin, filename, frame))
+    {
+    }
+
+    ~FFmpegFileLocker()
+    {
+        if (_file) {
+            _manager.release(_file);
+        }
+    }
+
+    FFmpegFile* get() const { return _file; }
+
+private:
+    FFmpegFileLocker(const FFmpegFileLocker&);
+    FFmpegFileLocker& operator=(const FFmpegFileLocker&);
+
+    FFmpegFileManager& _manager;
+    FFmpegFile* _file;
 };
 
 
@@ -0,0 +1,175 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX FFmpeg YUV conversions.
+ * Converts rows of normalized Y, Cb and Cr samples to interleaved float RGB(A), using SSE2
+ * when the compiler targets it.
+ */
+
+#ifndef IO_FFmpegYUV_h
+#define IO_FFmpegYUV_h
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FFMPEG_SSE2
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+namespace FFmpeg {
+
+// Convert the normalized Y, Cb and Cr samples to R, G and B in [0,1], in place.
+inline void
+yuvToRGBRowScalar(float* y,
+                  float* cb,
+                  float* cr,
+                  int n,
+                  float crR,
+                  float cbG,
+                  float crG,
+                  float cbB)
+{
+    for (int i = 0; i < n; ++i) {
+        const float r = y[i] + crR * cr[i];
+        const float g = y[i] + cbG * cb[i] + crG * cr[i];
+        const float b = y[i] + cbB * cb[i];
+        // clamp like the integer RGB output of sws_scale
+        y[i] = std::min(std::max(r, 0.f), 1.f);
+        cb[i] = std::min(std::max(g, 0.f), 1.f);
+        cr[i] = std::min(std::max(b, 0.f), 1.f);
+    }
+}
+
+#ifdef FFMPEG_SSE2
+// Same as yuvToRGBRowScalar(), with the operations in the same order.
+inline void
+yuvToRGBRowSSE2(float* y,
+                float* cb,
+                float* cr,
+                int n,
+                float crR,
+                float cbG,
+                float crG,
+                float cbB)
+{
+    int i = 0;
+    const __m128 vcrR = _mm_set1_ps(crR);
+    const __m128 vcbG = _mm_set1_ps(cbG);
+    const __m128 vcrG = _mm_set1_ps(crG);
+    const __m128 vcbB = _mm_set1_ps(cbB);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 vy = _mm_loadu_ps(y + i);
+        const __m128 vcb = _mm_loadu_ps(cb + i);
+        const __m128 vcr = _mm_loadu_ps(cr + i);
+        const __m128 r = _mm_add_ps( vy, _mm_mul_ps(vcrR, vcr) );
+        const __m128 g = _mm_add_ps( _mm_add_ps( vy, _mm_mul_ps(vcbG, vcb) ), _mm_mul_ps(vcrG, vcr) );
+        const __m128 b = _mm_add_ps( vy, _mm_mul_ps(vcbB, vcb) );
+        _mm_storeu_ps( y + i, _mm_min_ps(_mm_max_ps(r, zero), one) );
+        _mm_storeu_ps( cb + i, _mm_min_ps(_mm_max_ps(g, zero), one) );
+        _mm_storeu_ps( cr + i, _mm_min_ps(_mm_max_ps(b, zero), one) );
+    }
+    yuvToRGBRowScalar(y + i, cb + i, cr + i, n - i, crR, cbG, crG, cbB);
+}
+#endif
+
+inline void
+yuvToRGBRow(float* y,
+            float* cb,
+            float* cr,
+            int n,
+            float crR,
+            float cbG,
+            float crG,
+            float cbB)
+{
+#ifdef FFMPEG_SSE2
+    yuvToRGBRowSSE2(y, cb, cr, n, crR, cbG, crG, cbB);
+#else
+    yuvToRGBRowScalar(y, cb, cr, n, crR, cbG, crG, cbB);
+#endif
+}
+
+// interleave the R, G and B rows into n RGB or RGBA pixels (alpha is 0, see fillWindow())
+template <int nDstComp>
+void
+interleaveRowScalar(const float* r,
+                    const float* g,
+                    const float* b,
+                    int n,
+                    float* dst)
+{
+    for (int i = 0; i < n; ++i) {
+        dst[nDstComp * i + 0] = r[i];
+        dst[nDstComp * i + 1] = g[i];
+        dst[nDstComp * i + 2] = b[i];
+        if (nDstComp == 4) {
+            dst[nDstComp * i + 3] = 0.f;
+        }
+    }
+}
+
+#ifdef FFMPEG_SSE2
+// Same as interleaveRowScalar(). Only the RGBA pixels are vectorized.
+template <int nDstComp>
+void
+interleaveRowSSE2(const float* r,
+                  const float* g,
+                  const float* b,
+                  int n,
+                  float* dst)
+{
+    int i = 0;
+    if (nDstComp == 4) {
+        for (; i + 4 <= n; i += 4) {
+            __m128 vr = _mm_loadu_ps(r + i);
+            __m128 vg = _mm_loadu_ps(g + i);
+            __m128 vb = _mm_loadu_ps(b + i);
+            __m128 va = _mm_setzero_ps();
+            _MM_TRANSPOSE4_PS(vr, vg, vb, va);
+            _mm_storeu_ps(dst + 4 * i, vr);
+            _mm_storeu_ps(dst + 4 * i + 4, vg);
+            _mm_storeu_ps(dst + 4 * i + 8, vb);
+            _mm_storeu_ps(dst + 4 * i + 12, va);
+        }
+    }
+    interleaveRowScalar<nDstComp>(r + i, g + i, b + i, n - i, dst + nDstComp * i);
+}
+#endif
+
+template <int nDstComp>
+void
+interleaveRow(const float* r,
+              const float* g,
+              const float* b,
+              int n,
+              float* dst)
+{
+#ifdef FFMPEG_SSE2
+    interleaveRowSSE2<nDstComp>(r, g, b, n, dst);
+#else
+    interleaveRowScalar<nDstComp>(r, g, b, n, dst);
+#endif
+}
+
+} // namespace FFmpeg
+
+#endif
@@ -32,12 +32,17 @@
 #include <cmath>
 #include <sstream>
 #include <algorithm>
+#include <vector>
+
+#include "ofxsMultiThread.h"
+#include "ofxsMacros.h"
 
 #include "IOUtility.h"
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
 #include "FFmpegFile.h"
+#include "FFmpegYUV.h"
 
 #define kPluginName "ReadFFmpegOFX"
 #define kPluginGrouping "Image/Readers"
@@ -55,6 +60,7 @@
 #define kSupportsRGB true
 #define kSupportsAlpha false
 #define kSupportsTiles false
+#define kSupportsPrefetch false
 
 
 class ReadFFmpegPlugin : public GenericReaderPlugin
@@ -86,6 +92,8 @@ private:
     virtual bool getFrameBounds(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
     
     virtual bool getFrameRate(const std::string& filename, double* fps) OVERRIDE FINAL;
+
+    virtual OFX::BitDepthEnum getFrameBitDepth(const std::string& filename, OfxTime time) OVERRIDE FINAL;
     
     virtual void restoreState(const std::string& filename) OVERRIDE FINAL;
 };
@@ -171,7 +179,8 @@ ReadFFmpegPlugin::onInputFileChanged(const std::string& filename,
     assert(premult && components && componentCount);
     //Clear all opened files by this plug-in since the user changed the selected file/sequence
     _manager.clear(this);
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFileRef ref(_manager, this, filename);
+    FFmpegFile* file = ref.get();
     
     if (!file || file->isInvalid()) {
         if (file) {
@@ -236,6 +245,196 @@ fillWindow(const PIX* buffer,
     }
 }
 
+// normalize n samples: dst = (src - offset) * scale
+template <typename PIX>
+static void
+loadRow(const PIX* src,
+        int n,
+        float offset,
+        float scale,
+        float* dst)
+{
+    for (int i = 0; i < n; ++i) {
+        dst[i] = ( (float)src[i] - offset ) * scale;
+    }
+}
+
+// Normalize the chroma samples cx1..cx2-1 at the vertical position of the luma row srcY. With 4:2:0 subsampling, the
+// chroma samples are sited between two luma rows: blend the two nearest chroma rows.
+template <typename PIX>
+static void
+loadChromaRow(const PIX* plane,
+              int chromaWidth,
+              int chromaHeight,
+              int chromaShiftY,
+              int srcY,
+              int cx1,
+              int cx2,
+              float offset,
+              float scale,
+              float* dst)
+{
+    if (chromaShiftY == 0) {
+        loadRow(plane + (std::size_t)srcY * chromaWidth + cx1, cx2 - cx1, offset, scale, dst);
+
+        return;
+    }
+    const int j = srcY >> 1;
+    const int k = (srcY & 1) ? std::min(j + 1, chromaHeight - 1) : std::max(j - 1, 0);
+    const PIX* nearRow = plane + (std::size_t)j * chromaWidth;
+    const PIX* farRow = plane + (std::size_t)k * chromaWidth;
+    for (int i = cx1; i < cx2; ++i) {
+        dst[i - cx1] = (0.75f * nearRow[i] + 0.25f * farRow[i] - offset) * scale;
+    }
+}
+
+// Expand a chroma row starting at column cx1 to the luma columns x1..x2-1. With horizontal subsampling, the chroma
+// samples are co-sited with the even luma columns.
+static void
+expandChromaRow(const float* src,
+                int cx1,
+                int chromaWidth,
+                int chromaShiftX,
+                int x1,
+                int x2,
+                float* dst)
+{
+    if (chromaShiftX == 0) {
+        std::copy(src + (x1 - cx1), src + (x2 - cx1), dst);
+
+        return;
+    }
+    for (int x = x1; x < x2; ++x) {
+        const int j = x >> 1;
+        if (x & 1) {
+            const int j2 = std::min(j + 1, chromaWidth - 1);
+            dst[x - x1] = 0.5f * (src[j - cx1] + src[j2 - cx1]);
+        } else {
+            dst[x - x1] = src[j - cx1];
+        }
+    }
+}
+
+// Converts the planes of a YUV frame (see FFmpegFile::PlanarYUVInfo) directly to float RGB(A), by bands of rows.
+template <typename PIX>
+class YUVToRGBConverter : public OFX::MultiThread::Processor
+{
+public:
+    YUVToRGBConverter(const unsigned char* data,
+                      int width,
+                      int height,
+                      const FFmpegFile::PlanarYUVInfo& yuv,
+                      const OfxRectI& window,
+                      float* pixelData,
+                      const OfxRectI& bounds,
+                      int pixelComponentCount,
+                      int rowBytes)
+    : _yPlane( reinterpret_cast<const PIX*>(data) )
+    , _cbPlane(0)
+    , _crPlane(0)
+    , _width(width)
+    , _height(height)
+    , _chromaWidth( -( (-width) >> yuv.chromaShiftX ) )
+    , _chromaHeight( -( (-height) >> yuv.chromaShiftY ) )
+    , _yuv(yuv)
+    , _window(window)
+    , _pixelData(pixelData)
+    , _bounds(bounds)
+    , _nComps(pixelComponentCount)
+    , _rowBytes(rowBytes)
+    {
+        _cbPlane = _yPlane + (std::size_t)_width * _height;
+        _crPlane = _cbPlane + (std::size_t)_chromaWidth * _chromaHeight;
+
+        // normalization of the samples
+        const int shift = yuv.bitDepth - 8;
+        if (yuv.fullRange) {
+            _yOffset = 0.f;
+            _yScale = 1.f / ( (1 << yuv.bitDepth) - 1 );
+            _cOffset = (float)(1 << (yuv.bitDepth - 1));
+            _cScale = _yScale;
+        } else {
+            _yOffset = (float)(16 << shift);
+            _yScale = 1.f / (219 << shift);
+            _cOffset = (float)(128 << shift);
+            _cScale = 1.f / (224 << shift);
+        }
+
+        // YCbCr to RGB matrix
+        const double kr = yuv.rec709 ? 0.2126 : 0.299;
+        const double kb = yuv.rec709 ? 0.0722 : 0.114;
+        const double kg = 1. - kr - kb;
+        _crR = (float)( 2. * (1. - kr) );
+        _cbG = (float)( -2. * kb * (1. - kb) / kg );
+        _crG = (float)( -2. * kr * (1. - kr) / kg );
+        _cbB = (float)( 2. * (1. - kb) );
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _window.y2 - _window.y1;
+        const int y1 = _window.y1 + (int)((long long)h * threadID / nThreads);
+        const int y2 = _window.y1 + (int)((long long)h * (threadID + 1) / nThreads);
+        const int x1 = std::max(_window.x1, 0);
+        const int x2 = std::min(_window.x2, _width);
+        if (y1 >= y2 || x1 >= x2) {
+            return;
+        }
+        const int n = x2 - x1;
+        // the chroma columns needed by expandChromaRow()
+        const int cx1 = x1 >> _yuv.chromaShiftX;
+        const int cx2 = std::min( ( (x2 - 1) >> _yuv.chromaShiftX ) + 2, _chromaWidth );
+        std::vector<float> rows(3 * n + 2 * (cx2 - cx1));
+        float* yRow = &rows[0];
+        float* cbRow = yRow + n;
+        float* crRow = cbRow + n;
+        float* cbChroma = crRow + n;
+        float* crChroma = cbChroma + (cx2 - cx1);
+        for (int y = y1; y < y2; ++y) {
+            // the image is upside down
+            const int srcY = _height - 1 - y;
+            if (srcY < 0 || srcY >= _height) {
+                continue;
+            }
+            loadRow(_yPlane + (std::size_t)srcY * _width + x1, n, _yOffset, _yScale, yRow);
+            loadChromaRow(_cbPlane, _chromaWidth, _chromaHeight, _yuv.chromaShiftY, srcY, cx1, cx2, _cOffset, _cScale, cbChroma);
+            loadChromaRow(_crPlane, _chromaWidth, _chromaHeight, _yuv.chromaShiftY, srcY, cx1, cx2, _cOffset, _cScale, crChroma);
+            expandChromaRow(cbChroma, cx1, _chromaWidth, _yuv.chromaShiftX, x1, x2, cbRow);
+            expandChromaRow(crChroma, cx1, _chromaWidth, _yuv.chromaShiftX, x1, x2, crRow);
+            FFmpeg::yuvToRGBRow(yRow, cbRow, crRow, n, _crR, _cbG, _crG, _cbB);
+            float* dst = (float*)((char*)_pixelData + (std::ptrdiff_t)(y - _bounds.y1) * _rowBytes) + (std::ptrdiff_t)(x1 - _bounds.x1) * _nComps;
+            if (_nComps == 4) {
+                FFmpeg::interleaveRow<4>(yRow, cbRow, crRow, n, dst);
+            } else {
+                FFmpeg::interleaveRow<3>(yRow, cbRow, crRow, n, dst);
+            }
+        }
+    }
+
+private:
+    const PIX* _yPlane;
+    const PIX* _cbPlane;
+    const PIX* _crPlane;
+    int _width;
+    int _height;
+    int _chromaWidth;
+    int _chromaHeight;
+    FFmpegFile::PlanarYUVInfo _yuv;
+    OfxRectI _window;
+    float* _pixelData;
+    OfxRectI _bounds;
+    int _nComps;
+    int _rowBytes;
+    float _yOffset;
+    float _yScale;
+    float _cOffset;
+    float _cScale;
+    float _crR;
+    float _cbG;
+    float _crG;
+    float _cbB;
+};
+
 void
 ReadFFmpegPlugin::decode(const std::string& filename,
                          OfxTime time,
@@ -248,7 +447,11 @@ ReadFFmpegPlugin::decode(const std::string& filename,
                          int pixelComponentCount,
                          int rowBytes)
 {
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    // first frame of the video file is 1 in OpenFX, but 0 in File::decode, thus the -0.5
+    const int frame = (int)std::floor(time-0.5);
+    // the decoder stays ours until the decoded image is copied
+    FFmpegFileLocker locker(_manager, this, filename, frame);
+    FFmpegFile* file = locker.get();
     if (file && file->isInvalid()) {
         setPersistentMessage(OFX::Message::eMessageError, "", file->getError());
         return;
@@ -290,8 +493,7 @@ ReadFFmpegPlugin::decode(const std::string& filename,
     _maxRetries->getValue(maxRetries);
     
     try {
-        // first frame of the video file is 1 in OpenFX, but 0 in File::decode, thus the -0.5 
-        if ( !file->decode((int)std::floor(time-0.5), loadNearestFrame(), maxRetries) ) {
+        if ( !file->decode(frame, loadNearestFrame(), maxRetries) ) {
             
             setPersistentMessage(OFX::Message::eMessageError, "", file->getError());
             OFX::throwSuiteStatusException(kOfxStatFailed);
@@ -310,6 +512,19 @@ ReadFFmpegPlugin::decode(const std::string& filename,
     }
 
     const unsigned char* buffer = file->getData();
+    FFmpegFile::PlanarYUVInfo yuv;
+    if ( file->getPlanarYUVInfo(&yuv) ) {
+        // convert the YUV planes straight to float, without an intermediate RGB frame
+        if (yuv.bitDepth > 8) {
+            YUVToRGBConverter<unsigned short> converter(buffer, width, height, yuv, renderWindow, pixelData, imgBounds, pixelComponentCount, rowBytes);
+            converter.multiThread();
+        } else {
+            YUVToRGBConverter<unsigned char> converter(buffer, width, height, yuv, renderWindow, pixelData, imgBounds, pixelComponentCount, rowBytes);
+            converter.multiThread();
+        }
+
+        return;
+    }
     std::size_t sizeOfData = file->getSizeOfData();
     unsigned int numComponents = file->getNumberOfComponents();
     assert(sizeOfData == sizeof(unsigned char) || sizeOfData == sizeof(unsigned short));
@@ -356,7 +571,8 @@ ReadFFmpegPlugin::getSequenceTimeDomain(const std::string& filename, OfxRangeI &
 
     int width,height,frames;
     double ap;
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFileRef ref(_manager, this, filename);
+    FFmpegFile* file = ref.get();
     if (!file || file->isInvalid()) {
         range.min = range.max = 0.;
         return false;
@@ -374,7 +590,8 @@ ReadFFmpegPlugin::getFrameRate(const std::string& filename,
 {
     assert(fps);
     
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFileRef ref(_manager, this, filename);
+    FFmpegFile* file = ref.get();
     if (!file || file->isInvalid()) {
         return false;
     }
@@ -392,7 +609,8 @@ ReadFFmpegPlugin::getFrameBounds(const std::string& filename,
                                  std::string *error)
 {
     assert(bounds && par);
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFileRef ref(_manager, this, filename);
+    FFmpegFile* file = ref.get();
     if (!file || file->isInvalid()) {
         if (error && file) {
             *error = file->getError();
@@ -415,6 +633,20 @@ ReadFFmpegPlugin::getFrameBounds(const std::string& filename,
     return true;
 }
 
+OFX::BitDepthEnum
+ReadFFmpegPlugin::getFrameBitDepth(const std::string& filename,
+                                   OfxTime /*time*/)
+{
+    FFmpegFileRef ref(_manager, this, filename);
+    FFmpegFile* file = ref.get();
+    if (!file || file->isInvalid()) {
+        return OFX::eBitDepthFloat;
+    }
+
+    // the frames are converted to 8-bit or 16-bit RGB(A) before being converted to float
+    return file->getBitDepth() > 8 ? OFX::eBitDepthUShort : OFX::eBitDepthUByte;
+}
+
 
 using namespace OFX;
 
@@ -429,7 +661,10 @@ public:
     {}
     
     virtual void load() {}
-    virtual void unload() {}
+    virtual void unload()
+    {
+        _manager.stopThreads();
+    }
     
     virtual OFX::ImageEffect* createInstance(OfxImageEffectHandle handle, OFX::ContextEnum context);
     
@@ -592,7 +827,8 @@ ReadFFmpegPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
     desc.setPluginEvaluation(0);
 #endif
     
-    desc.setRenderThreadSafety(OFX::eRenderInstanceSafe);
+    // frames are decoded concurrently by a pool of decoders (see FFmpegFileManager::acquire())
+    desc.setRenderThreadSafety(OFX::eRenderFullySafe);
     
   
     
@@ -605,7 +841,7 @@ ReadFFmpegPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 {
     // make some pages and to things in
     PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(),
-                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles);
+                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles, kSupportsPrefetch);
     
     {
         OFX::IntParamDescriptor *param = desc.defineIntParam(kParamMaxRetries);
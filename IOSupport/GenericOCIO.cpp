@@ -792,6 +792,55 @@ GenericOCIO::apply(double time, const OfxRectI& renderWindow, float *pixelData,
 #endif
 }
 
+#ifdef OFX_IO_USING_OCIO
+OCIO_NAMESPACE::ConstProcessorRcPtr
+GenericOCIO::getProcessor(double time)
+{
+    assert(_created);
+    if (!_config) {
+        return OCIO_NAMESPACE::ConstProcessorRcPtr();
+    }
+    if (isIdentity(time)) {
+        return OCIO_NAMESPACE::ConstProcessorRcPtr();
+    }
+    std::string inputSpace;
+    getInputColorspaceAtTime(time, inputSpace);
+    std::string outputSpace;
+    getOutputColorspaceAtTime(time, outputSpace);
+    OCIO::ConstContextRcPtr context = getLocalContext(time);//_config->getCurrentContext();
+    try {
+        return _config->getProcessor(context, inputSpace.c_str(), outputSpace.c_str());
+    } catch (OCIO::Exception &e) {
+        _parent->setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenColorIO error: ") + e.what());
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    return OCIO_NAMESPACE::ConstProcessorRcPtr();
+}
+
+std::string
+GenericOCIO::getCacheID(double time)
+{
+    assert(_created);
+    if (!_config) {
+        return std::string();
+    }
+    std::string inputSpace;
+    getInputColorspaceAtTime(time, inputSpace);
+    std::string outputSpace;
+    getOutputColorspaceAtTime(time, outputSpace);
+    std::string id = inputSpace + '\n' + outputSpace;
+    try {
+        // the config cache ID depends on the context variables
+        OCIO::ConstContextRcPtr context = getLocalContext(time);
+        id += '\n';
+        id += _config->getCacheID(context);
+    } catch (OCIO::Exception &) {
+        // the colorspace names are enough to identify the conversion within a config
+    }
+    return id;
+}
+#endif
+
 
 void
 GenericOCIO::changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName)
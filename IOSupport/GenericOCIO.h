@@ -93,6 +93,11 @@ public:
 #ifdef OFX_IO_USING_OCIO
     OCIO_NAMESPACE::ConstContextRcPtr getLocalContext(double time);
     OCIO_NAMESPACE::ConstConfigRcPtr getConfig() { return _config; };
+    // get the OCIO processor to apply at the given time, or NULL if there is nothing to apply.
+    // The returned processor can be applied from several threads.
+    OCIO_NAMESPACE::ConstProcessorRcPtr getProcessor(double time);
+    // a string that identifies the colorspace conversion applied at the given time, to be used in cache keys
+    std::string getCacheID(double time);
 #endif
     bool configIsDefault();
 
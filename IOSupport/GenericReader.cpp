@@ -26,10 +26,28 @@
 #include <memory>
 #include <algorithm>
 #include <climits>
+#include <cstdlib>
+#include <stdexcept>
 #include <cmath>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+#include <cctype>
+#include <list>
+#include <map>
+#include <set>
+#include <new>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
 #ifdef DEBUG
 #include <cstdio>
+#include <iostream>
 #define DBG(x) (void)0//x
 #else
 #define DBG(x) (void)0
@@ -50,6 +68,7 @@
 #include "GenericOCIO.h"
 #endif
 #include "IOUtility.h"
+#include "IOThread.h"
 
 #define kPluginGrouping "Image/Readers"
 
@@ -200,6 +219,25 @@ enum MissingEnum
 #define kParamOutputComponentsOptionRGB "RGB"
 #define kParamOutputComponentsOptionAlpha "Alpha"
 
+#define kParamOutputBitDepth "outputBitDepth"
+#define kParamOutputBitDepthLabel "Output Depth"
+#define kParamOutputBitDepthHint "Bit depth of the images produced by this effect, if the host supports choosing it. " \
+"Smaller depths use less memory in the host cache, but values outside of [0,1] are clipped by the 8 and 16 bits integer depths."
+#define kParamOutputBitDepthOptionAuto "Auto"
+#define kParamOutputBitDepthOptionAutoHint "The smallest depth that holds the decoded image without loss, taking the colorspace conversion and premultiplication into account."
+#define kParamOutputBitDepthOptionByte "8 bits"
+#define kParamOutputBitDepthOptionShort "16 bits"
+#define kParamOutputBitDepthOptionHalf "Half"
+#define kParamOutputBitDepthOptionFloat "Float"
+enum OutputBitDepthEnum
+{
+    eOutputBitDepthAuto = 0,
+    eOutputBitDepthByte,
+    eOutputBitDepthShort,
+    eOutputBitDepthHalf,
+    eOutputBitDepthFloat,
+};
+
 #define kParamInputSpaceLabel "File Colorspace"
 
 #define kParamFrameRate "frameRate"
@@ -211,6 +249,23 @@ enum MissingEnum
 #define kParamCustomFpsLabel "Custom FPS"
 #define kParamCustomFpsHint "If checked, you can freely force the value of the frame rate parameter."
 
+#define kParamPrefetch "prefetch"
+#define kParamPrefetchLabel "Read Ahead"
+#define kParamPrefetchHint "When the host renders a sequence of frames (e.g. during playback), decode the next frames in background threads, " \
+"so that the latency of file access (e.g. on network storage) is hidden."
+
+#define kParamPrefetchFrames "prefetchFrames"
+#define kParamPrefetchFramesLabel "Read Ahead Frames"
+#define kParamPrefetchFramesHint "Number of frames to decode in advance."
+
+#define kParamPrefetchThreads "prefetchThreads"
+#define kParamPrefetchThreadsLabel "Read Ahead Threads"
+#define kParamPrefetchThreadsHint "Number of background threads used to decode the next frames."
+
+#define kParamPrefetchMemory "prefetchMemory"
+#define kParamPrefetchMemoryLabel "Read Ahead Memory (MB)"
+#define kParamPrefetchMemoryHint "Maximum amount of memory used to hold the frames decoded in advance, in megabytes."
+
 #define MISSING_FRAME_NEAREST_RANGE 100
 
 #define kSupportsMultiResolution 1
@@ -240,6 +295,849 @@ premultString(OFX::PreMultiplicationEnum e)
     return "Unknown";
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Read-ahead
+
+// During a sequential render (e.g. playback), the frames following the one being rendered are
+// decoded by background threads, using the getFrameBoundsForPrefetch()/decodeForPrefetch() functions
+// of the subclass, into a staging area which is consumed by the next render() calls.
+// These threads are not host threads: they never call a host suite. Everything the generic part
+// needs (file, time, window, components) is read by the render thread into the Job.
+// The worker threads only run between beginSequenceRender() and endSequenceRender().
+class GenericReaderPrefetcher
+{
+public:
+    struct Job
+    {
+        std::string filename;
+        OfxTime time; // sequence time
+        int view;
+        OfxRectI window; // window to decode, in the pixel coordinates of the file
+        OFX::PixelComponentEnum comps;
+        int numChans;
+        std::string rawComps;
+    };
+
+    explicit GenericReaderPrefetcher(GenericReaderPlugin* effect)
+    : _effect(effect)
+    , _lock()
+    , _cond()
+    , _threads()
+    , _frames()
+    , _queue()
+    , _frameRange()
+    , _frameStep(1.)
+    , _maxBytes(0)
+    , _usedBytes(0)
+    , _nextId(0)
+    , _quit(false)
+    {
+        _frameRange.min = _frameRange.max = 0.;
+    }
+
+    ~GenericReaderPrefetcher()
+    {
+        stop();
+    }
+
+    void start(const OfxRangeD& frameRange, double frameStep, int nThreads, std::size_t maxBytes);
+
+    void stop();
+
+    // returns false if the read-ahead threads are not running
+    bool getSequence(OfxRangeD* frameRange, double* frameStep);
+
+    // replace the set of frames to read ahead. Jobs are given by order of priority.
+    void schedule(const std::list<Job>& jobs);
+
+    // copy the prefetched frame to dst. Returns false if it is not available, in which case it has to be decoded.
+    bool fetch(const std::string& filename, OfxTime time, int view, const std::string& rawComps, int numChans,
+               const OfxRectI& window, float* dstPixelData, const OfxRectI& dstBounds, int dstRowBytes);
+
+    void clear();
+
+private:
+    enum FrameStatusEnum
+    {
+        eFrameStatusQueued,
+        eFrameStatusDecoding,
+        eFrameStatusReady,
+        eFrameStatusFailed,
+    };
+
+    struct Frame
+    {
+        Job job;
+        FrameStatusEnum status;
+        std::vector<float> data; // the decoded job.window, packed
+        std::size_t bytes;
+        unsigned long id; // to recognize a frame that was dropped and re-scheduled while it was being decoded
+    };
+
+    typedef std::map<std::string, Frame> FrameMap;
+
+    static std::string makeKey(const std::string& filename, OfxTime time, int view, const std::string& rawComps, int numChans);
+
+    static void workerEntry(void* arg)
+    {
+        static_cast<GenericReaderPrefetcher*>(arg)->worker();
+    }
+
+    void worker();
+
+    bool decodeJob(const Job& job, OfxRectI* window, std::vector<float>* data);
+
+    // _lock must be held
+    void eraseFrame(FrameMap::iterator it)
+    {
+        assert(_usedBytes >= it->second.bytes);
+        _usedBytes -= it->second.bytes;
+        _frames.erase(it);
+    }
+
+private:
+    GenericReaderPlugin* _effect;
+    IO::Mutex _lock; // protects everything below
+    IO::Condition _cond; // signaled when frames are queued or decoded, and when the threads must quit
+    std::vector<IO::Thread*> _threads;
+    FrameMap _frames;
+    std::list<std::string> _queue; // keys of the queued frames, by order of priority
+    OfxRangeD _frameRange;
+    double _frameStep;
+    std::size_t _maxBytes;
+    std::size_t _usedBytes; // memory reserved by the queued, decoding and ready frames
+    unsigned long _nextId;
+    bool _quit;
+};
+
+std::string
+GenericReaderPrefetcher::makeKey(const std::string& filename,
+                                 OfxTime time,
+                                 int view,
+                                 const std::string& rawComps,
+                                 int numChans)
+{
+    std::ostringstream ss;
+    ss << filename << '\n' << time << '\n' << view << '\n' << rawComps << '\n' << numChans;
+    return ss.str();
+}
+
+void
+GenericReaderPrefetcher::start(const OfxRangeD& frameRange,
+                               double frameStep,
+                               int nThreads,
+                               std::size_t maxBytes)
+{
+    stop();
+
+    IO::AutoMutex l(_lock);
+    _frameRange = frameRange;
+    _frameStep = (frameStep > 0.) ? frameStep : 1.;
+    _maxBytes = maxBytes;
+    _quit = false;
+    for (int i = 0; i < nThreads; ++i) {
+        IO::Thread* thread = new IO::Thread;
+        if (!thread->start(&GenericReaderPrefetcher::workerEntry, this)) {
+            delete thread;
+            break;
+        }
+        _threads.push_back(thread);
+    }
+}
+
+void
+GenericReaderPrefetcher::stop()
+{
+    std::vector<IO::Thread*> threads;
+    {
+        IO::AutoMutex l(_lock);
+        _quit = true;
+        threads.swap(_threads);
+        _cond.wakeAll();
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    clear();
+}
+
+bool
+GenericReaderPrefetcher::getSequence(OfxRangeD* frameRange,
+                                     double* frameStep)
+{
+    IO::AutoMutex l(_lock);
+    if (_threads.empty()) {
+        return false;
+    }
+    *frameRange = _frameRange;
+    *frameStep = _frameStep;
+    return true;
+}
+
+void
+GenericReaderPrefetcher::clear()
+{
+    IO::AutoMutex l(_lock);
+    // frames being decoded are simply forgotten: the worker drops the result when it is done
+    _frames.clear();
+    _queue.clear();
+    _usedBytes = 0;
+    _cond.wakeAll();
+}
+
+void
+GenericReaderPrefetcher::schedule(const std::list<Job>& jobs)
+{
+    IO::AutoMutex l(_lock);
+    if (_threads.empty()) {
+        return;
+    }
+
+    std::list<std::string> keys;
+    for (std::list<Job>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        keys.push_back(makeKey(it->filename, it->time, it->view, it->rawComps, it->numChans));
+    }
+
+    // drop the frames that are not needed anymore, to make room for the new ones
+    for (FrameMap::iterator it = _frames.begin(); it != _frames.end();) {
+        if (std::find(keys.begin(), keys.end(), it->first) == keys.end()) {
+            eraseFrame(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    _queue.clear();
+    std::list<std::string>::const_iterator kit = keys.begin();
+    for (std::list<Job>::const_iterator it = jobs.begin(); it != jobs.end(); ++it, ++kit) {
+        FrameMap::iterator found = _frames.find(*kit);
+        if (found != _frames.end()) {
+            if (found->second.status == eFrameStatusQueued) {
+                _queue.push_back(*kit);
+            }
+            continue;
+        }
+        const std::size_t bytes = (std::size_t)(it->window.x2 - it->window.x1) * (it->window.y2 - it->window.y1) * it->numChans * sizeof(float);
+        if (bytes == 0 || _usedBytes + bytes > _maxBytes) {
+            // the staging area is full: frames with a lower priority will be scheduled by the next renders
+            break;
+        }
+        Frame& frame = _frames[*kit];
+        frame.job = *it;
+        frame.status = eFrameStatusQueued;
+        frame.bytes = bytes;
+        frame.id = _nextId++;
+        _usedBytes += bytes;
+        _queue.push_back(*kit);
+    }
+    _cond.wakeAll();
+}
+
+bool
+GenericReaderPrefetcher::fetch(const std::string& filename,
+                               OfxTime time,
+                               int view,
+                               const std::string& rawComps,
+                               int numChans,
+                               const OfxRectI& window,
+                               float* dstPixelData,
+                               const OfxRectI& dstBounds,
+                               int dstRowBytes)
+{
+    const std::string key = makeKey(filename, time, view, rawComps, numChans);
+    std::vector<float> data;
+    OfxRectI srcWindow;
+    {
+        IO::AutoMutex l(_lock);
+        FrameMap::iterator it = _frames.find(key);
+        // if the frame is being decoded, waiting for it is faster than decoding it again
+        while (it != _frames.end() && it->second.status == eFrameStatusDecoding && !_quit) {
+            _cond.wait(_lock);
+            it = _frames.find(key);
+        }
+        if (it == _frames.end()) {
+            return false;
+        }
+        if (it->second.status != eFrameStatusReady ||
+            window.x1 < it->second.job.window.x1 || window.x2 > it->second.job.window.x2 ||
+            window.y1 < it->second.job.window.y1 || window.y2 > it->second.job.window.y2) {
+            // not decoded yet, failed, or the wrong region: the caller decodes it
+            eraseFrame(it);
+
+            return false;
+        }
+        data.swap(it->second.data);
+        srcWindow = it->second.job.window;
+        eraseFrame(it);
+    }
+
+    const std::size_t srcRowElems = (std::size_t)(srcWindow.x2 - srcWindow.x1) * numChans;
+    const std::size_t rowSize = (std::size_t)(window.x2 - window.x1) * numChans * sizeof(float);
+    for (int y = window.y1; y < window.y2; ++y) {
+        const float* srcPix = &data[(y - srcWindow.y1) * srcRowElems + (window.x1 - srcWindow.x1) * numChans];
+        float* dstPix = (float*)((char*)dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes) + (window.x1 - dstBounds.x1) * numChans;
+        std::memcpy(dstPix, srcPix, rowSize);
+    }
+
+    return true;
+}
+
+bool
+GenericReaderPrefetcher::decodeJob(const Job& job,
+                                   OfxRectI* window,
+                                   std::vector<float>* data)
+{
+    try {
+        OfxRectI frameBounds;
+        double par = 1.;
+        if (!_effect->getFrameBoundsForPrefetchCached(job.filename, job.time, &frameBounds, &par)) {
+            return false;
+        }
+        if (!intersect(job.window, frameBounds, window)) {
+            return false;
+        }
+        const int rowBytes = (window->x2 - window->x1) * job.numChans * sizeof(float);
+        data->resize((std::size_t)(window->y2 - window->y1) * (window->x2 - window->x1) * job.numChans);
+        if (!_effect->decodeForPrefetch(job.filename, job.time, job.view, *window, &data->front(), *window, job.comps, job.numChans, job.rawComps, rowBytes)) {
+            return false;
+        }
+    } catch (...) {
+        // errors are reported when the frame is decoded again by render()
+        return false;
+    }
+
+    return true;
+}
+
+void
+GenericReaderPrefetcher::worker()
+{
+    _lock.lock();
+    for (;;) {
+        while (!_quit && _queue.empty()) {
+            _cond.wait(_lock);
+        }
+        if (_quit) {
+            break;
+        }
+        const std::string key = _queue.front();
+        _queue.pop_front();
+        FrameMap::iterator it = _frames.find(key);
+        if (it == _frames.end() || it->second.status != eFrameStatusQueued) {
+            continue;
+        }
+        it->second.status = eFrameStatusDecoding;
+        const Job job = it->second.job;
+        const unsigned long id = it->second.id;
+
+        // decode without holding the lock
+        _lock.unlock();
+        OfxRectI window = job.window;
+        std::vector<float> data;
+        bool ok = decodeJob(job, &window, &data);
+        _lock.lock();
+
+        it = _frames.find(key);
+        if (it != _frames.end() && it->second.id == id) {
+            if (ok) {
+                it->second.job.window = window;
+                it->second.data.swap(data);
+                it->second.status = eFrameStatusReady;
+            } else {
+                it->second.status = eFrameStatusFailed;
+            }
+        }
+        // wake up the renders waiting for this frame
+        _cond.wakeAll();
+    }
+    _lock.unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Decoded frame cache
+
+// The size of the decoded frame cache shared by all reader instances, in megabytes, can be set
+// using this environment variable. 0 disables the cache, e.g. if the host caches enough of the
+// rendered images itself.
+#define kFrameCacheSizeEnvVar "OFX_IO_READER_CACHE_SIZE"
+#define kFrameCacheSizeDefault 256
+
+// A process-wide LRU cache of the images produced by GenericReaderPlugin::render(), so that rendering
+// the same frame again (e.g. after a change downstream) does not re-open and re-decode the file.
+// The key contains everything that affects the output image (instance, file and its modification
+// stamp, time, view, plane, mipmap level, components, premultiplication, colorspace conversion).
+// Parameters of the subclasses are taken into account by evicting the entries of an instance
+// whenever one of its parameters changes. Each key may have several entries, one per rendered
+// window (e.g. the tiles of a render).
+class GenericReaderFrameCache
+{
+public:
+    GenericReaderFrameCache()
+    : _lock()
+    , _entries()
+    , _index()
+    , _maxBytes((std::size_t)kFrameCacheSizeDefault * 1024 * 1024)
+    , _usedBytes(0)
+    , _hits(0)
+    , _misses(0)
+    {
+        const char* size = std::getenv(kFrameCacheSizeEnvVar);
+        if (size) {
+            long megaBytes = std::atol(size);
+            _maxBytes = (std::size_t)std::max(megaBytes, 0L) * 1024 * 1024;
+        }
+    }
+
+    bool isEnabled() const
+    {
+        return _maxBytes > 0;
+    }
+
+    // copy the cached image to dst. Returns false if no entry of the key contains the window.
+    bool get(const std::string& key, const OfxRectI& window, void* dstPixelData, const OfxRectI& dstBounds, int dstRowBytes);
+
+    void insert(const std::string& key, const void* owner, const OfxRectI& window, int pixelBytes,
+                const void* srcPixelData, const OfxRectI& srcBounds, int srcRowBytes);
+
+    // remove all entries inserted by owner
+    void evict(const void* owner);
+
+    void getStats(std::size_t* usedBytes, std::size_t* maxBytes, unsigned long* hits, unsigned long* misses);
+
+private:
+    struct Entry
+    {
+        std::string key;
+        const void* owner;
+        OfxRectI window;
+        int pixelBytes;
+        std::vector<unsigned char> data; // window, packed
+    };
+
+    typedef std::list<Entry> EntryList; // most recently used first
+    typedef std::multimap<std::string, EntryList::iterator> EntryIndex;
+
+    // _lock must be held
+    void erase(EntryList::iterator it)
+    {
+        const std::size_t bytes = it->data.size();
+        assert(_usedBytes >= bytes);
+        _usedBytes -= bytes;
+        std::pair<EntryIndex::iterator, EntryIndex::iterator> range = _index.equal_range(it->key);
+        for (EntryIndex::iterator i = range.first; i != range.second; ++i) {
+            if (i->second == it) {
+                _index.erase(i);
+                break;
+            }
+        }
+        _entries.erase(it);
+    }
+
+private:
+    IO::Mutex _lock;
+    EntryList _entries;
+    EntryIndex _index;
+    std::size_t _maxBytes;
+    std::size_t _usedBytes;
+    unsigned long _hits;
+    unsigned long _misses;
+};
+
+static GenericReaderFrameCache gFrameCache;
+
+bool
+GenericReaderFrameCache::get(const std::string& key,
+                             const OfxRectI& window,
+                             void* dstPixelData,
+                             const OfxRectI& dstBounds,
+                             int dstRowBytes)
+{
+    IO::AutoMutex l(_lock);
+    std::pair<EntryIndex::iterator, EntryIndex::iterator> range = _index.equal_range(key);
+    EntryIndex::iterator found = range.second;
+    for (EntryIndex::iterator it = range.first; it != range.second; ++it) {
+        const OfxRectI& w = it->second->window;
+        if (window.x1 >= w.x1 && window.x2 <= w.x2 && window.y1 >= w.y1 && window.y2 <= w.y2) {
+            found = it;
+            break;
+        }
+    }
+    if (found == range.second) {
+        ++_misses;
+
+        return false;
+    }
+    ++_hits;
+    // move to the front of the LRU list
+    _entries.splice(_entries.begin(), _entries, found->second);
+
+    const Entry& entry = *found->second;
+    const int pixelBytes = entry.pixelBytes;
+    const std::size_t srcRowSize = (std::size_t)(entry.window.x2 - entry.window.x1) * pixelBytes;
+    const std::size_t rowSize = (std::size_t)(window.x2 - window.x1) * pixelBytes;
+    for (int y = window.y1; y < window.y2; ++y) {
+        const unsigned char* srcPix = &entry.data[(y - entry.window.y1) * srcRowSize + (window.x1 - entry.window.x1) * pixelBytes];
+        unsigned char* dstPix = (unsigned char*)dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes + (window.x1 - dstBounds.x1) * pixelBytes;
+        std::memcpy(dstPix, srcPix, rowSize);
+    }
+
+    return true;
+}
+
+void
+GenericReaderFrameCache::insert(const std::string& key,
+                                const void* owner,
+                                const OfxRectI& window,
+                                int pixelBytes,
+                                const void* srcPixelData,
+                                const OfxRectI& srcBounds,
+                                int srcRowBytes)
+{
+    const std::size_t rowSize = (std::size_t)(window.x2 - window.x1) * pixelBytes;
+    const std::size_t bytes = rowSize * (window.y2 - window.y1);
+    if (bytes == 0 || bytes > _maxBytes) {
+        return;
+    }
+
+    // copy outside of the lock
+    Entry entry;
+    entry.key = key;
+    entry.owner = owner;
+    entry.window = window;
+    entry.pixelBytes = pixelBytes;
+    try {
+        entry.data.resize(bytes);
+    } catch (const std::bad_alloc&) {
+        return;
+    }
+    for (int y = window.y1; y < window.y2; ++y) {
+        const unsigned char* srcPix = (const unsigned char*)srcPixelData + (std::ptrdiff_t)(y - srcBounds.y1) * srcRowBytes + (window.x1 - srcBounds.x1) * pixelBytes;
+        std::memcpy(&entry.data[(y - window.y1) * rowSize], srcPix, rowSize);
+    }
+
+    IO::AutoMutex l(_lock);
+    std::pair<EntryIndex::iterator, EntryIndex::iterator> range = _index.equal_range(key);
+    for (EntryIndex::iterator it = range.first; it != range.second; ++it) {
+        const OfxRectI& w = it->second->window;
+        if (w.x1 == window.x1 && w.x2 == window.x2 && w.y1 == window.y1 && w.y2 == window.y2) {
+            erase(it->second);
+            break;
+        }
+    }
+    while (!_entries.empty() && _usedBytes + bytes > _maxBytes) {
+        // evict the least recently used
+        erase(--_entries.end());
+    }
+    _entries.push_front(Entry());
+    EntryList::iterator it = _entries.begin();
+    it->key = entry.key;
+    it->owner = entry.owner;
+    it->window = entry.window;
+    it->pixelBytes = entry.pixelBytes;
+    it->data.swap(entry.data);
+    _index.insert(std::make_pair(key, it));
+    _usedBytes += bytes;
+}
+
+void
+GenericReaderFrameCache::evict(const void* owner)
+{
+    IO::AutoMutex l(_lock);
+    for (EntryList::iterator it = _entries.begin(); it != _entries.end();) {
+        if (it->owner == owner) {
+            erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void
+GenericReaderFrameCache::getStats(std::size_t* usedBytes,
+                                  std::size_t* maxBytes,
+                                  unsigned long* hits,
+                                  unsigned long* misses)
+{
+    IO::AutoMutex l(_lock);
+    *usedBytes = _usedBytes;
+    *maxBytes = _maxBytes;
+    *hits = _hits;
+    *misses = _misses;
+}
+
+// The directory listings used to check the existence of the files of a sequence, so that
+// checking a frame does not need a request to the filesystem (which is slow on network storage).
+// A listing is revalidated using the modification time of the directory, at most once per
+// kFileIndexCheckInterval seconds, and clear() forces a new scan.
+// The modification time has a nanosecond precision where the system provides it, but some
+// filesystems only store seconds: a file created in the same second as the listing does not
+// change the time, so a listing made within a second of the modification time is made again.
+#define kFileIndexCheckInterval 1
+
+class GenericReaderFileIndex
+{
+public:
+    GenericReaderFileIndex()
+    : _lock()
+    , _dirs()
+    {
+    }
+
+    // returns true if the file exists
+    bool exists(const std::string& filename);
+
+    void clear()
+    {
+        IO::AutoMutex l(_lock);
+        _dirs.clear();
+    }
+
+private:
+    struct Directory
+    {
+        bool valid; // false if the directory could not be read
+        std::time_t mtime;
+        long mtimeNsec;
+        std::time_t scanTime; // when the directory was listed
+        std::time_t checkTime;
+        std::set<std::string> files;
+    };
+
+    // the nanoseconds are 0 if the system does not provide them
+    static bool getModificationTime(const std::string& path, std::time_t* mtime, long* mtimeNsec);
+
+    static bool listDirectory(const std::string& dir, std::set<std::string>* files);
+
+#ifdef _WIN32
+    static std::string toLower(const std::string& s)
+    {
+        std::string ret(s);
+        std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
+        return ret;
+    }
+#endif
+
+private:
+    IO::Mutex _lock;
+    std::map<std::string, Directory> _dirs;
+};
+
+bool
+GenericReaderFileIndex::getModificationTime(const std::string& path,
+                                            std::time_t* mtime,
+                                            long* mtimeNsec)
+{
+#ifdef _WIN32
+    struct _stat st;
+    if (_stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    *mtime = st.st_mtime;
+#if defined(_WIN32)
+    *mtimeNsec = 0;
+#elif defined(__APPLE__)
+    *mtimeNsec = (long)st.st_mtimespec.tv_nsec;
+#else
+    *mtimeNsec = (long)st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+bool
+GenericReaderFileIndex::listDirectory(const std::string& dir,
+                                      std::set<std::string>* files)
+{
+    files->clear();
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            // the Windows filesystems are case-insensitive
+            files->insert(toLower(data.cFileName));
+        }
+    } while (FindNextFileA(h, &data));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return false;
+    }
+    while (struct dirent* e = readdir(d)) {
+        files->insert(e->d_name);
+    }
+    closedir(d);
+#endif
+    return true;
+}
+
+bool
+GenericReaderFileIndex::exists(const std::string& filename)
+{
+    if (filename.empty()) {
+        return false;
+    }
+#ifdef _WIN32
+    std::size_t sep = filename.find_last_of("/\\");
+#else
+    std::size_t sep = filename.find_last_of('/');
+#endif
+    const std::string dir = (sep == std::string::npos) ? std::string(".") : (sep == 0 ? filename.substr(0, 1) : filename.substr(0, sep));
+    const std::string name = (sep == std::string::npos) ? filename : filename.substr(sep + 1);
+
+    IO::AutoMutex l(_lock);
+    const std::time_t now = std::time(NULL);
+    std::map<std::string, Directory>::iterator it = _dirs.find(dir);
+    if (it == _dirs.end() || now - it->second.checkTime >= kFileIndexCheckInterval) {
+        std::time_t mtime = 0;
+        long mtimeNsec = 0;
+        bool valid = getModificationTime(dir, &mtime, &mtimeNsec);
+        if (it == _dirs.end() || !it->second.valid || !valid ||
+            mtime != it->second.mtime || mtimeNsec != it->second.mtimeNsec ||
+            it->second.scanTime - it->second.mtime <= 1) {
+            Directory& d = _dirs[dir];
+            d.valid = valid && listDirectory(dir, &d.files);
+            d.mtime = mtime;
+            d.mtimeNsec = mtimeNsec;
+            d.scanTime = now;
+            it = _dirs.find(dir);
+        }
+        it->second.checkTime = now;
+    }
+    if (!it->second.valid) {
+        // the directory cannot be listed (e.g. no read permission): check the file itself
+        std::ifstream f(filename.c_str());
+        return f.good();
+    }
+#ifdef _WIN32
+    return it->second.files.find(toLower(name)) != it->second.files.end();
+#else
+    return it->second.files.find(name) != it->second.files.end();
+#endif
+}
+
+// The bounds and pixel aspect ratio read from the file headers, so that the successive
+// getRegionOfDefinition() calls for the same frame do not open and parse the file each time.
+// An entry is revalidated using the modification time and size of the file, at most once per
+// kMetadataCacheCheckInterval seconds, and clear() drops all entries.
+#define kMetadataCacheCheckInterval 1
+#define kMetadataCacheMaxEntries 16384
+
+class GenericReaderMetadataCache
+{
+public:
+    struct FileStamp
+    {
+        std::time_t mtime;
+        long long size;
+    };
+
+    GenericReaderMetadataCache()
+    : _lock()
+    , _entries()
+    {
+    }
+
+    // get the stamp of the file, before reading its header. Returns false if the file cannot be stat'ed.
+    static bool getFileStamp(const std::string& filename, FileStamp* stamp);
+
+    // returns false if the file is not in the cache, or was modified since it was inserted
+    bool get(const std::string& filename, OfxRectI* bounds, double* par);
+
+    void insert(const std::string& filename, const FileStamp& stamp, const OfxRectI& bounds, double par);
+
+    void clear()
+    {
+        IO::AutoMutex l(_lock);
+        _entries.clear();
+    }
+
+private:
+    struct Entry
+    {
+        FileStamp stamp;
+        std::time_t checkTime;
+        OfxRectI bounds;
+        double par;
+    };
+
+private:
+    IO::Mutex _lock;
+    std::map<std::string, Entry> _entries;
+};
+
+bool
+GenericReaderMetadataCache::getFileStamp(const std::string& filename,
+                                         FileStamp* stamp)
+{
+#ifdef _WIN32
+    struct __stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    stamp->mtime = st.st_mtime;
+    stamp->size = (long long)st.st_size;
+    return true;
+}
+
+bool
+GenericReaderMetadataCache::get(const std::string& filename,
+                                OfxRectI* bounds,
+                                double* par)
+{
+    IO::AutoMutex l(_lock);
+    std::map<std::string, Entry>::iterator it = _entries.find(filename);
+    if (it == _entries.end()) {
+        return false;
+    }
+    const std::time_t now = std::time(NULL);
+    if (now - it->second.checkTime >= kMetadataCacheCheckInterval || now < it->second.checkTime) {
+        FileStamp stamp;
+        if (!getFileStamp(filename, &stamp) || stamp.mtime != it->second.stamp.mtime || stamp.size != it->second.stamp.size) {
+            _entries.erase(it);
+            return false;
+        }
+        it->second.checkTime = now;
+    }
+    *bounds = it->second.bounds;
+    *par = it->second.par;
+    return true;
+}
+
+void
+GenericReaderMetadataCache::insert(const std::string& filename,
+                                   const FileStamp& stamp,
+                                   const OfxRectI& bounds,
+                                   double par)
+{
+    IO::AutoMutex l(_lock);
+    if (_entries.size() >= kMetadataCacheMaxEntries) {
+        // a sequence longer than that is read in order: start over
+        _entries.clear();
+    }
+    Entry& e = _entries[filename];
+    e.stamp = stamp;
+    e.checkTime = std::time(NULL);
+    e.bounds = bounds;
+    e.par = par;
+}
+
 GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
                                          bool supportsRGBA,
                                          bool supportsRGB,
@@ -263,14 +1161,23 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
 , _startingTime(0)
 , _originalFrameRange(0)
 , _outputComponents(0)
+, _outputBitDepth(0)
 , _premult(0)
 , _timeDomainUserSet(0)
 , _customFPS(0)
 , _fps(0)
+, _prefetch(0)
+, _prefetchFrames(0)
+, _prefetchThreads(0)
+, _prefetchMemory(0)
 #ifdef OFX_IO_USING_OCIO
 , _ocio(new GenericOCIO(this))
 #endif
 , _sequenceFromFiles()
+, _fileIndex(new GenericReaderFileIndex)
+, _metadataCache(new GenericReaderMetadataCache)
+, _prefetcher(new GenericReaderPrefetcher(this))
+, _memoryPool(this)
 , _supportsRGBA(supportsRGBA)
 , _supportsRGB(supportsRGB)
 , _supportsAlpha(supportsAlpha)
@@ -295,14 +1202,22 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
     _originalFrameRange = fetchInt2DParam(kParamOriginalFrameRange);
     _timeDomainUserSet = fetchBooleanParam(kParamTimeDomainUserEdited);
     _outputComponents = fetchChoiceParam(kParamOutputComponents);
+    _outputBitDepth = fetchChoiceParam(kParamOutputBitDepth);
     _premult = fetchChoiceParam(kParamFilePremult);
     _customFPS = fetchBooleanParam(kParamCustomFps);
     _fps = fetchDoubleParam(kParamFrameRate);
-
+    // read-ahead parameters only exist for the image sequence readers that support it
+    if (paramExists(kParamPrefetch)) {
+        _prefetch = fetchBooleanParam(kParamPrefetch);
+        _prefetchFrames = fetchIntParam(kParamPrefetchFrames);
+        _prefetchThreads = fetchIntParam(kParamPrefetchThreads);
+        _prefetchMemory = fetchIntParam(kParamPrefetchMemory);
+    }
 }
 
 GenericReaderPlugin::~GenericReaderPlugin()
 {
+    gFrameCache.evict(this);
 }
 
 
@@ -475,15 +1390,6 @@ GenericReaderPlugin::timeDomainFromSequenceTimeDomain(OfxRangeI& range, bool mus
 }
 
 
-static bool
-fileExists(const std::string& filename)
-{
-    std::ifstream f(filename.c_str());
-    bool ret = f.good();
-    f.close();
-    return ret;
-}
-
 GenericReaderPlugin::GetSequenceTimeRetEnum
 GenericReaderPlugin::getSequenceTime(double t, double *sequenceTime)
 {
@@ -617,8 +1523,7 @@ GenericReaderPlugin::getFilenameAtSequenceTime(double sequenceTime,
             filenameGood = false;
         }
         else {
-            std::ifstream fs(filename->c_str());
-            filenameGood = fs.is_open() && fs.good();
+            filenameGood = _fileIndex->exists(*filename);
         }
         if (filenameGood) {
             ret = eGetFileNameReturnedFullRes;
@@ -630,8 +1535,7 @@ GenericReaderPlugin::getFilenameAtSequenceTime(double sequenceTime,
                 if (proxyFileName.empty()) {
                     proxyGood = false;
                 } else {
-                    std::ifstream fs(proxyFileName.c_str());
-                    proxyGood = fs.is_open() && fs.good();
+                    proxyGood = _fileIndex->exists(proxyFileName);
                 }
                 if (proxyGood) {
                     // proxy file exists, replace the filename with the proxy name
@@ -723,39 +1627,45 @@ GenericReaderPlugin::getStartingTime()
     return startingTime;
 }
 
-void
-GenericReaderPlugin::copyPixelData(const OfxRectI& renderWindow,
-                                   const void *srcPixelData,
-                                   const OfxRectI& srcBounds,
-                                   OFX::PixelComponentEnum srcPixelComponents,
-                                   int srcPixelComponentCount,
-                                   OFX::BitDepthEnum srcBitDepth,
-                                   int srcRowBytes,
-                                   void *dstPixelData,
-                                   const OfxRectI& dstBounds,
-                                   OFX::PixelComponentEnum dstPixelComponents,
-                                   int dstPixelComponentCount,
-                                   OFX::BitDepthEnum dstBitDepth,
-                                   int dstRowBytes)
+// compute one pixel of the halved image, taking into account the borders of src.
+template <typename PIX>
+static inline void
+halvePixel(int x,
+           const PIX* srcLineStart,
+           const OfxRectI& srcBounds,
+           int srcRowSize,
+           PIX* dstLineStart,
+           bool pickThisRow,
+           bool pickNextRow,
+           int nComponents)
 {
-    assert(srcPixelData && dstPixelData);
-    assert(srcBounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= srcBounds.y2);
-    assert(srcBounds.x1 <= renderWindow.x1 && renderWindow.x1 <= renderWindow.x2 && renderWindow.x2 <= srcBounds.x2);
-
-#ifdef GENERIC_READER_USE_MULTI_THREAD
-    copyPixels(*this, renderWindow,
-               srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
-               dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-#else
-    copyPixelsNT(*this, renderWindow,
-                 srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
-                 dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-#endif
+    int sumH = (int)pickNextRow + (int)pickThisRow;
+    assert(sumH == 1 || sumH == 2);
+    bool pickNextCol = (x * 2) < (srcBounds.x2 - 1);
+    bool pickThisCol = (x * 2) >= (srcBounds.x1);
+    int sumW = (int)pickThisCol + (int)pickNextCol;
+    assert(sumW == 1 || sumW == 2);
+    for (int k = 0; k < nComponents; ++k) {
+        ///a b
+        ///c d
+
+        PIX a = (pickThisCol && pickThisRow) ? srcLineStart[x * 2 * nComponents + k] : 0;
+        PIX b = (pickNextCol && pickThisRow) ? srcLineStart[(x * 2 + 1) * nComponents + k] : 0;
+        PIX c = (pickThisCol && pickNextRow) ? srcLineStart[(x * 2 * nComponents) + srcRowSize + k]: 0;
+        PIX d = (pickNextCol && pickNextRow) ? srcLineStart[(x * 2 + 1) * nComponents + srcRowSize + k] : 0;
+
+        assert(sumW == 2 || (sumW == 1 && ((a == 0 && c == 0) || (b == 0 && d == 0))));
+        assert(sumH == 2 || (sumH == 1 && ((a == 0 && b == 0) || (c == 0 && d == 0))));
+        dstLineStart[x * nComponents + k] = (a + b + c + d) / (sumH * sumW);
+    }
 }
 
 // update the window of dst defined by nextRenderWindow by halving the corresponding area in src.
 // proofread and fixed by F. Devernay on 3/10/2014
-template <typename PIX>
+// If nComps is not 0, it is the number of components and the inner loop is unrolled by the compiler.
+// The pixels which have all four samples inside srcBounds are processed by a branch-free loop
+// (which the compiler can vectorize), and only the border pixels go through halvePixel().
+template <typename PIX, int nComps>
 static void
 halveWindow(const OfxRectI& nextRenderWindow,
             const PIX* srcPixels,
@@ -766,14 +1676,27 @@ halveWindow(const OfxRectI& nextRenderWindow,
             int dstRowBytes,
             int nComponents)
 {
+    assert(nComps == 0 || nComps == nComponents);
+    const int nc = nComps ? nComps : nComponents;
     int srcRowSize = srcRowBytes / sizeof(PIX);
     int dstRowSize = dstRowBytes / sizeof(PIX);
     
-    const PIX* srcData =  srcPixels - (srcBounds.x1 * nComponents + srcRowSize * srcBounds.y1);
-    PIX* dstData = dstPixels - (dstBounds.x1 * nComponents + dstRowSize * dstBounds.y1);
+    const PIX* srcData =  srcPixels - (srcBounds.x1 * nc + srcRowSize * srcBounds.y1);
+    PIX* dstData = dstPixels - (dstBounds.x1 * nc + dstRowSize * dstBounds.y1);
     
     assert(nextRenderWindow.x1 * 2 >= (srcBounds.x1 - 1) && (nextRenderWindow.x2-1) * 2 < srcBounds.x2 &&
            nextRenderWindow.y1 * 2 >= (srcBounds.y1 - 1) && (nextRenderWindow.y2-1) * 2 < srcBounds.y2);
+
+    // the range of x for which both columns are inside srcBounds
+    int xi1 = nextRenderWindow.x1;
+    while (xi1 < nextRenderWindow.x2 && !((xi1 * 2) >= srcBounds.x1 && (xi1 * 2) < (srcBounds.x2 - 1))) {
+        ++xi1;
+    }
+    int xi2 = nextRenderWindow.x2;
+    while (xi2 > xi1 && !(((xi2 - 1) * 2) >= srcBounds.x1 && ((xi2 - 1) * 2) < (srcBounds.x2 - 1))) {
+        --xi2;
+    }
+
     for (int y = nextRenderWindow.y1; y < nextRenderWindow.y2;++y) {
         
         const PIX* srcLineStart = srcData + y * 2 * srcRowSize;
@@ -781,190 +1704,505 @@ halveWindow(const OfxRectI& nextRenderWindow,
 
         bool pickNextRow = (y * 2) < (srcBounds.y2 - 1);
         bool pickThisRow = (y * 2) >= (srcBounds.y1);
-        int sumH = (int)pickNextRow + (int)pickThisRow;
-        assert(sumH == 1 || sumH == 2);
-        for (int x = nextRenderWindow.x1; x < nextRenderWindow.x2;++x) {
-            
-            bool pickNextCol = (x * 2) < (srcBounds.x2 - 1);
-            bool pickThisCol = (x * 2) >= (srcBounds.x1);
-            int sumW = (int)pickThisCol + (int)pickNextCol;
-            assert(sumW == 1 || sumW == 2);
-            for (int k = 0; k < nComponents; ++k) {
-                ///a b
-                ///c d
-                
-                PIX a = (pickThisCol && pickThisRow) ? srcLineStart[x * 2 * nComponents + k] : 0;
-                PIX b = (pickNextCol && pickThisRow) ? srcLineStart[(x * 2 + 1) * nComponents + k] : 0;
-                PIX c = (pickThisCol && pickNextRow) ? srcLineStart[(x * 2 * nComponents) + srcRowSize + k]: 0;
-                PIX d = (pickNextCol && pickNextRow) ? srcLineStart[(x * 2 + 1) * nComponents + srcRowSize + k] : 0;
-
-                assert(sumW == 2 || (sumW == 1 && ((a == 0 && c == 0) || (b == 0 && d == 0))));
-                assert(sumH == 2 || (sumH == 1 && ((a == 0 && b == 0) || (c == 0 && d == 0))));
-                dstLineStart[x * nComponents + k] = (a + b + c + d) / (sumH * sumW);
+        if (!pickNextRow || !pickThisRow) {
+            for (int x = nextRenderWindow.x1; x < nextRenderWindow.x2;++x) {
+                halvePixel<PIX>(x, srcLineStart, srcBounds, srcRowSize, dstLineStart, pickThisRow, pickNextRow, nc);
+            }
+            continue;
+        }
+        for (int x = nextRenderWindow.x1; x < xi1; ++x) {
+            halvePixel<PIX>(x, srcLineStart, srcBounds, srcRowSize, dstLineStart, true, true, nc);
+        }
+        const PIX* s0 = srcLineStart + xi1 * 2 * nc;
+        const PIX* s1 = s0 + srcRowSize;
+        PIX* d = dstLineStart + xi1 * nc;
+        for (int x = xi1; x < xi2; ++x, s0 += 2 * nc, s1 += 2 * nc, d += nc) {
+            for (int k = 0; k < nc; ++k) {
+                d[k] = (s0[k] + s0[nc + k] + s1[k] + s1[nc + k]) / 4;
             }
         }
+        for (int x = xi2; x < nextRenderWindow.x2; ++x) {
+            halvePixel<PIX>(x, srcLineStart, srcBounds, srcRowSize, dstLineStart, true, true, nc);
+        }
     }
 }
 
-template <typename PIX>
+// compute the render window at each mipmap level, from level 0 (renderWindowFullRes) to 'levels'
 static void
-buildMipMapLevelGeneric(OFX::ImageEffect* instance,
-                        const OfxRectI& originalRenderWindow,
-                        const OfxRectI& renderWindowFullRes,
-                        unsigned int level,
-                        const PIX* srcPixels,
-                        const OfxRectI& srcBounds,
-                        int srcRowBytes,
-                        PIX* dstPixels,
-                        const OfxRectI& dstBounds,
-                        int dstRowBytes,
-                        int nComponents)
-{
-    assert(level > 0);
-    
-    std::auto_ptr<OFX::ImageMemory> mem;
-    size_t memSize = 0;
-    std::auto_ptr<OFX::ImageMemory> tmpMem;
-    size_t tmpMemSize = 0;
-    PIX* nextImg = NULL;
-    
+getMipMapWindows(const OfxRectI& renderWindowFullRes,
+                 unsigned int levels,
+                 std::vector<OfxRectI>* windows)
+{
+    windows->resize(levels + 1);
+    (*windows)[0] = renderWindowFullRes;
+    for (unsigned int i = 1; i <= levels; ++i) {
+        ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
+        (*windows)[i] = downscalePowerOfTwoSmallestEnclosing((*windows)[i-1], 1);
+    }
+}
+
+// update the rows of dst defined by stripWindow (at the last level of windows) by mipmapping the
+// corresponding rows of src (at level 0).
+// The intermediate levels are stored alternatively in oddImg and evenImg, which must be
+// large enough to hold the strip at levels 1 and 2 (see getMipMapStripMemory()).
+// The result is identical to halving the whole image several times.
+template <typename PIX, int nComps>
+static void
+buildMipMapStrip(const std::vector<OfxRectI>& windows,
+                 const OfxRectI& stripWindow,
+                 const PIX* srcPixels,
+                 const OfxRectI& srcBounds,
+                 int srcRowBytes,
+                 PIX* dstPixels,
+                 const OfxRectI& dstBounds,
+                 int dstRowBytes,
+                 int nComponents,
+                 PIX* oddImg,
+                 PIX* evenImg)
+{
+    const unsigned int levels = windows.size() - 1;
+    assert(levels > 0);
+
+    // loop invariant:
+    // - previousImg, previousBounds, previousRowBytes describe the data at the level before i
     const PIX* previousImg = srcPixels;
     OfxRectI previousBounds = srcBounds;
     int previousRowBytes = srcRowBytes;
-    
-    OfxRectI nextRenderWindow = renderWindowFullRes;
-    
-    ///Build all the mipmap levels until we reach the one we are interested in
-    for (unsigned int i = 1; i < level; ++i) {
-        // loop invariant:
-        // - previousImg, previousBounds, previousRowBytes describe the data ate the level before i
-        // - nextRenderWindow contains the renderWindow at the level before i
-        //
-        ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
-        nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-#     ifdef DEBUG
-        {
-            // check that doing i times 1 level is the same as doing i levels
-            OfxRectI nrw = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, i);
-            assert(nrw.x1 == nextRenderWindow.x1 && nrw.x2 == nextRenderWindow.x2 && nrw.y1 == nextRenderWindow.y1 && nrw.y2 == nextRenderWindow.y2);
-        }
-#     endif
-        ///Allocate a temporary image if necessary, or reuse the previously allocated buffer
-        int nextRowBytes =  (nextRenderWindow.x2 - nextRenderWindow.x1)  * nComponents * sizeof(PIX);
-        size_t newMemSize =  (nextRenderWindow.y2 - nextRenderWindow.y1) * nextRowBytes;
-        if (tmpMem.get()) {
-            // there should be enough memory: no need to reallocate
-            assert(tmpMemSize >= memSize);
-        } else {
-            tmpMem.reset(new OFX::ImageMemory(newMemSize, instance));
-            tmpMemSize = newMemSize;
-        }
-        nextImg = (float*)tmpMem->lock();
-        
-        halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, nextImg, nextRenderWindow, nextRowBytes, nComponents);
-        
+
+    for (unsigned int i = 1; i < levels; ++i) {
+        const int scale = 1 << (levels - i);
+        OfxRectI nextBounds = windows[i];
+        nextBounds.y1 = std::max(nextBounds.y1, stripWindow.y1 * scale);
+        nextBounds.y2 = std::min(nextBounds.y2, stripWindow.y2 * scale);
+        assert(nextBounds.y1 < nextBounds.y2);
+        int nextRowBytes = (nextBounds.x2 - nextBounds.x1) * nComponents * sizeof(PIX);
+        PIX* nextImg = (i % 2) ? oddImg : evenImg;
+
+        halveWindow<PIX, nComps>(nextBounds, previousImg, previousBounds, previousRowBytes, nextImg, nextBounds, nextRowBytes, nComponents);
+
         ///Switch for next pass
-        previousBounds = nextRenderWindow;
-        previousRowBytes = nextRowBytes;
         previousImg = nextImg;
-        mem = tmpMem;
-        memSize = tmpMemSize;
+        previousBounds = nextBounds;
+        previousRowBytes = nextRowBytes;
     }
-    // here:
-    // - previousImg, previousBounds, previousRowBytes describe the data ate the level before 'level'
-    // - nextRenderWindow contains the renderWindow at the level before 'level'
-    
+
     ///On the last iteration halve directly into the dstPixels
-    ///The nextRenderWindow should be equal to the original render window.
-    nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-    assert(originalRenderWindow.x1 == nextRenderWindow.x1 && originalRenderWindow.x2 == nextRenderWindow.x2 &&
-           originalRenderWindow.y1 == nextRenderWindow.y1 && originalRenderWindow.y2 == nextRenderWindow.y2);
-    
-    halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, dstPixels, dstBounds, dstRowBytes, nComponents);
-    // mem and tmpMem are freed at destruction
+    halveWindow<PIX, nComps>(stripWindow, previousImg, previousBounds, previousRowBytes, dstPixels, dstBounds, dstRowBytes, nComponents);
+}
+
+// the memory needed by buildMipMapStrip() for the intermediate levels of a strip of stripRows rows
+static void
+getMipMapStripMemory(const std::vector<OfxRectI>& windows,
+                     int stripRows,
+                     int pixelBytes,
+                     size_t* oddMemSize,
+                     size_t* evenMemSize)
+{
+    const unsigned int levels = windows.size() - 1;
+    *oddMemSize = 0;
+    *evenMemSize = 0;
+    if (levels > 1) {
+        *oddMemSize = (size_t)(stripRows << (levels - 1)) * (windows[1].x2 - windows[1].x1) * pixelBytes;
+    }
+    if (levels > 2) {
+        *evenMemSize = (size_t)(stripRows << (levels - 2)) * (windows[2].x2 - windows[2].x1) * pixelBytes;
+    }
+}
+
+// convert a decoded float component to the output bit depth
+template <typename PIX, OFX::BitDepthEnum depth>
+PIX convertFromFloat(float value);
+
+template <>
+inline float
+convertFromFloat<float, OFX::eBitDepthFloat>(float value)
+{
+    return value;
+}
+
+template <>
+inline unsigned short
+convertFromFloat<unsigned short, OFX::eBitDepthHalf>(float value)
+{
+    return floatToHalf(value);
+}
+
+template <>
+inline unsigned short
+convertFromFloat<unsigned short, OFX::eBitDepthUShort>(float value)
+{
+    return (unsigned short)floatToInt<65536>(value);
+}
+
+template <>
+inline unsigned char
+convertFromFloat<unsigned char, OFX::eBitDepthUByte>(float value)
+{
+    return (unsigned char)floatToInt<256>(value);
+}
+
+// The number of bytes of the full-resolution image that a thread processes at once.
+// It should fit in the L2 cache, so that all the post-decode operations are done while the data is hot.
+#define kPostDecodeStripBytes (256 * 1024)
+
+// Apply all the operations that follow the decoding of the image in a single pass:
+// unpremult -> OCIO -> downscale -> premult -> copy to the destination.
+// Each thread processes a band of rows of the destination, which is split in strips.
+// For each strip, the corresponding rows of the decoded image (the source, which is
+// modified in place) are processed by all the operations in sequence, so that the source
+// is read only once and the intermediate results never leave the cache.
+// The mipmap levels are computed using a small per-thread buffer.
+template <int nComps>
+class PostDecodeProcessor : public OFX::PixelProcessorFilterBase
+{
+public:
+    PostDecodeProcessor(OFX::ImageEffect &instance)
+    : OFX::PixelProcessorFilterBase(instance)
+    , _windows()
+    , _unpremult(false)
+    , _premult(false)
+    , _pool(NULL)
+#ifdef OFX_IO_USING_OCIO
+    , _ocioProc()
+#endif
+    , _errorLock()
+    , _error()
+    {
+    }
+
+    void setValues(const OfxRectI& renderWindowFullRes,
+                   unsigned int levels,
+                   bool unpremult,
+                   bool premult)
+    {
+        getMipMapWindows(renderWindowFullRes, levels, &_windows);
+        _unpremult = unpremult;
+        _premult = premult;
+    }
+
+    /// the per-thread buffers are taken from this pool
+    void setMemoryPool(IO::MemoryPool* pool)
+    {
+        _pool = pool;
+    }
+
+#ifdef OFX_IO_USING_OCIO
+    void setOCIOProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc)
+    {
+        _ocioProc = proc;
+    }
+#endif
+
+    const OfxRectI& getWindowAtLevel(unsigned int level) const
+    {
+        return _windows[level];
+    }
+
+    /// the first error raised by a worker thread, to be reported by the render thread after process()
+    const std::string& getError() const
+    {
+        return _error;
+    }
+
+private:
+    virtual void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        const int nc = nComps ? nComps : _dstPixelComponentCount;
+        const int pixelBytes = nc * sizeof(float);
+        const unsigned int levels = _windows.size() - 1;
+        const OfxRectI& srcWindow = _windows[0];
+        // the source is our temporary buffer, which is processed in place
+        float* srcPixels = (float*)_srcPixelData;
+
+        // the number of dst rows per strip
+        const int srcStripRowBytes = (srcWindow.x2 - srcWindow.x1) * pixelBytes;
+        int stripRows = kPostDecodeStripBytes / std::max(1, srcStripRowBytes << levels);
+        stripRows = std::max(1, std::min(stripRows, procWindow.y2 - procWindow.y1));
+
+        // per-thread memory: the intermediate mipmap levels and, if we premultiply or convert to
+        // another bit depth, the scaled strip
+        size_t oddMemSize, evenMemSize;
+        getMipMapStripMemory(_windows, stripRows, pixelBytes, &oddMemSize, &evenMemSize);
+        const bool directToDst = !_premult && _dstBitDepth == OFX::eBitDepthFloat;
+        const int scaledRowBytes = (procWindow.x2 - procWindow.x1) * pixelBytes;
+        const size_t scaledMemSize = (levels > 0 && !directToDst) ? (size_t)stripRows * scaledRowBytes : 0;
+        std::auto_ptr<IO::PooledMemory> mem;
+        float* oddImg = NULL;
+        float* evenImg = NULL;
+        float* scaledImg = NULL;
+        if (oddMemSize + evenMemSize + scaledMemSize > 0) {
+            assert(_pool);
+            mem.reset(new IO::PooledMemory(oddMemSize + evenMemSize + scaledMemSize, *_pool));
+            oddImg = (float*)mem->lock();
+            evenImg = oddImg + oddMemSize / sizeof(float);
+            scaledImg = evenImg + evenMemSize / sizeof(float);
+        }
+
+        for (int ya = procWindow.y1; ya < procWindow.y2; ya += stripRows) {
+            if (_effect.abort() || failed()) {
+                break;
+            }
+            OfxRectI stripWindow = procWindow;
+            stripWindow.y1 = ya;
+            stripWindow.y2 = std::min(ya + stripRows, procWindow.y2);
+
+            // the rows of the source that contribute to this strip
+            OfxRectI srcStrip = srcWindow;
+            srcStrip.y1 = std::max(srcWindow.y1, stripWindow.y1 * (1 << levels));
+            srcStrip.y2 = std::min(srcWindow.y2, stripWindow.y2 * (1 << levels));
+            if (srcStrip.y1 >= srcStrip.y2) {
+                continue;
+            }
+            float* srcStripPixels = (float*)((char*)srcPixels + (size_t)(srcStrip.y1 - _srcBounds.y1) * _srcRowBytes
+                                             + (size_t)(srcStrip.x1 - _srcBounds.x1) * pixelBytes);
+
+            if (_unpremult) {
+                assert(nc == 4);
+                unPremultStrip(srcStrip, srcStripPixels);
+            }
+#ifdef OFX_IO_USING_OCIO
+            if (_ocioProc) {
+                assert(nc == 3 || nc == 4);
+                try {
+                    OCIO_NAMESPACE::PackedImageDesc img(srcStripPixels, srcStrip.x2 - srcStrip.x1, srcStrip.y2 - srcStrip.y1,
+                                                        nc, sizeof(float), pixelBytes, _srcRowBytes);
+                    _ocioProc->apply(img);
+                } catch (OCIO_NAMESPACE::Exception &e) {
+                    // we are in a host thread: neither host suites nor exceptions may be used here
+                    setError(std::string("OpenColorIO error: ") + e.what());
+                    break;
+                }
+            }
+#endif
+            if (levels == 0) {
+                // copy or premult directly to dst
+                for (int y = stripWindow.y1; y < stripWindow.y2; ++y) {
+                    const float* srcPix = (const float*)getSrcPixelAddress(stripWindow.x1, y);
+                    storeRow(srcPix, getDstPixelAddress(stripWindow.x1, y), stripWindow.x2 - stripWindow.x1, nc);
+                }
+            } else if (directToDst) {
+                // we can write directly to dstPixelData
+                buildMipMapStrip<float, nComps>(_windows, stripWindow, (const float*)_srcPixelData, _srcBounds, _srcRowBytes,
+                                                (float*)_dstPixelData, _dstBounds, _dstRowBytes, nc, oddImg, evenImg);
+            } else {
+                // scale to the temporary strip (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
+                buildMipMapStrip<float, nComps>(_windows, stripWindow, (const float*)_srcPixelData, _srcBounds, _srcRowBytes,
+                                                scaledImg, stripWindow, scaledRowBytes, nc, oddImg, evenImg);
+                for (int y = stripWindow.y1; y < stripWindow.y2; ++y) {
+                    const float* srcPix = (const float*)((const char*)scaledImg + (size_t)(y - stripWindow.y1) * scaledRowBytes);
+                    storeRow(srcPix, getDstPixelAddress(stripWindow.x1, y), stripWindow.x2 - stripWindow.x1, nc);
+                }
+            }
+        }
+        // mem is freed at destruction
+    }
+
+    bool failed()
+    {
+        IO::AutoMutex l(_errorLock);
+
+        return !_error.empty();
+    }
+
+    void setError(const std::string& error)
+    {
+        IO::AutoMutex l(_errorLock);
+
+        if (_error.empty()) {
+            _error = error;
+        }
+    }
+
+    // unpremultiply the strip in place (RGBA only)
+    void unPremultStrip(const OfxRectI& strip, float* pixels)
+    {
+        const int width = strip.x2 - strip.x1;
+        for (int y = strip.y1; y < strip.y2; ++y) {
+            float* pix = (float*)((char*)pixels + (size_t)(y - strip.y1) * _srcRowBytes);
+            for (int x = 0; x < width; ++x, pix += 4) {
+                const float a = pix[3];
+                if (a > 0.) {
+                    pix[0] /= a;
+                    pix[1] /= a;
+                    pix[2] /= a;
+                }
+            }
+        }
+    }
+
+    // copy a row to dst, premultiplying if necessary (RGBA only), and converting to the dst bit depth
+    void storeRow(const float* srcPix, void* dstPix, int width, int nc)
+    {
+        switch (_dstBitDepth) {
+            case OFX::eBitDepthUByte:
+                storeRowDepth<unsigned char, OFX::eBitDepthUByte>(srcPix, (unsigned char*)dstPix, width, nc);
+                break;
+            case OFX::eBitDepthUShort:
+                storeRowDepth<unsigned short, OFX::eBitDepthUShort>(srcPix, (unsigned short*)dstPix, width, nc);
+                break;
+            case OFX::eBitDepthHalf:
+                storeRowDepth<unsigned short, OFX::eBitDepthHalf>(srcPix, (unsigned short*)dstPix, width, nc);
+                break;
+            default:
+                assert(_dstBitDepth == OFX::eBitDepthFloat);
+                if (!_premult) {
+                    std::copy(srcPix, srcPix + width * nc, (float*)dstPix);
+                } else {
+                    storeRowDepth<float, OFX::eBitDepthFloat>(srcPix, (float*)dstPix, width, nc);
+                }
+                break;
+        }
+    }
+
+    template <typename PIX, OFX::BitDepthEnum depth>
+    void storeRowDepth(const float* srcPix, PIX* dstPix, int width, int nc)
+    {
+        if (!_premult) {
+            for (int i = 0; i < width * nc; ++i) {
+                dstPix[i] = convertFromFloat<PIX, depth>(srcPix[i]);
+            }
+            return;
+        }
+        assert(nc == 4);
+        for (int x = 0; x < width; ++x, srcPix += 4, dstPix += 4) {
+            const float a = srcPix[3];
+            dstPix[0] = convertFromFloat<PIX, depth>(srcPix[0] * a);
+            dstPix[1] = convertFromFloat<PIX, depth>(srcPix[1] * a);
+            dstPix[2] = convertFromFloat<PIX, depth>(srcPix[2] * a);
+            dstPix[3] = convertFromFloat<PIX, depth>(a);
+        }
+    }
 
-}
+    std::vector<OfxRectI> _windows; //< the render window at each mipmap level
+    bool _unpremult;
+    bool _premult;
+    IO::MemoryPool* _pool;
+#ifdef OFX_IO_USING_OCIO
+    OCIO_NAMESPACE::ConstProcessorRcPtr _ocioProc;
+#endif
+    IO::Mutex _errorLock;
+    std::string _error; //< protected by _errorLock
+};
 
-// update the window of dst defined by originalRenderWindow by mipmapping the windows of src defined by renderWindowFullRes
-// proofread and fixed by F. Devernay on 3/10/2014
-template <typename PIX,int nComponents>
+template <int nComps>
 static void
-buildMipMapLevel(OFX::ImageEffect* instance,
-                 const OfxRectI& originalRenderWindow,
-                 const OfxRectI& renderWindowFullRes,
-                 unsigned int level,
-                 const PIX* srcPixels,
-                 const OfxRectI& srcBounds,
-                 int srcRowBytes,
-                 PIX* dstPixels,
-                 const OfxRectI& dstBounds,
-                 int dstRowBytes)
+setupAndPostDecode(OFX::ImageEffect* instance,
+                   IO::MemoryPool* pool,
+#ifdef OFX_IO_USING_OCIO
+                   const OCIO_NAMESPACE::ConstProcessorRcPtr& ocioProc,
+#endif
+                   const OfxRectI& renderWindow,
+                   const OfxRectI& renderWindowFullRes,
+                   unsigned int levels,
+                   bool unpremult,
+                   bool premult,
+                   float* srcPixelData,
+                   const OfxRectI& srcBounds,
+                   int srcRowBytes,
+                   void* dstPixelData,
+                   const OfxRectI& dstBounds,
+                   OFX::PixelComponentEnum pixelComponents,
+                   int pixelComponentCount,
+                   OFX::BitDepthEnum dstBitDepth,
+                   int dstRowBytes)
 {
-    buildMipMapLevelGeneric<PIX>(instance, originalRenderWindow, renderWindowFullRes, level, srcPixels, srcBounds, srcRowBytes
-                                 , dstPixels, dstBounds, dstRowBytes, nComponents);
-}
+    PostDecodeProcessor<nComps> processor(*instance);
+    processor.setValues(renderWindowFullRes, levels, unpremult, premult);
+    processor.setMemoryPool(pool);
+#ifdef OFX_IO_USING_OCIO
+    processor.setOCIOProcessor(ocioProc);
+#endif
+    ///The render window at the last level should be equal to the original render window.
+    assert(levels == 0 ||
+           (renderWindow.x1 == processor.getWindowAtLevel(levels).x1 && renderWindow.x2 == processor.getWindowAtLevel(levels).x2 &&
+            renderWindow.y1 == processor.getWindowAtLevel(levels).y1 && renderWindow.y2 == processor.getWindowAtLevel(levels).y2));
 
+    processor.setDstImg(dstPixelData, dstBounds, pixelComponents, pixelComponentCount, dstBitDepth, dstRowBytes);
+    processor.setSrcImg(srcPixelData, srcBounds, pixelComponents, pixelComponentCount, OFX::eBitDepthFloat, srcRowBytes, 0);
+    processor.setRenderWindow(renderWindow);
+    processor.process();
 
+    if (!processor.getError().empty()) {
+        instance->setPersistentMessage(OFX::Message::eMessageError, "", processor.getError());
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+}
 
 void
-GenericReaderPlugin::scalePixelData(const OfxRectI& originalRenderWindow,
-                                    const OfxRectI& renderWindow,
-                                    unsigned int levels,
-                                    const void* srcPixelData,
-                                    OFX::PixelComponentEnum srcPixelComponents,
-                                    int srcPixelComponentCount,
-                                    OFX::BitDepthEnum srcPixelDepth,
-                                    const OfxRectI& srcBounds,
-                                    int srcRowBytes,
-                                    void* dstPixelData,
-                                    OFX::PixelComponentEnum dstPixelComponents,
-                                    int dstPixelComponentCount,
-                                    OFX::BitDepthEnum dstPixelDepth,
-                                    const OfxRectI& dstBounds,
-                                    int dstRowBytes)
+GenericReaderPlugin::postDecodePixelData(double time,
+                                         const OfxRectI& renderWindow,
+                                         const OfxRectI& renderWindowFullRes,
+                                         unsigned int levels,
+                                         bool unpremult,
+                                         bool applyOCIO,
+                                         bool premult,
+                                         float* srcPixelData,
+                                         const OfxRectI& srcBounds,
+                                         int srcRowBytes,
+                                         void* dstPixelData,
+                                         const OfxRectI& dstBounds,
+                                         OFX::PixelComponentEnum pixelComponents,
+                                         int pixelComponentCount,
+                                         OFX::BitDepthEnum dstBitDepth,
+                                         int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    
+    assert(srcBounds.x1 <= renderWindowFullRes.x1 && renderWindowFullRes.x2 <= srcBounds.x2 &&
+           srcBounds.y1 <= renderWindowFullRes.y1 && renderWindowFullRes.y2 <= srcBounds.y2);
+
     // do the rendering
-    if (dstPixelDepth != OFX::eBitDepthFloat ||
-        (dstPixelComponents != OFX::ePixelComponentRGBA &&
-         dstPixelComponents != OFX::ePixelComponentRGB &&
-         dstPixelComponents != OFX::ePixelComponentAlpha &&
-         dstPixelComponents != OFX::ePixelComponentCustom) ||
-        dstPixelDepth != srcPixelDepth ||
-        dstPixelComponents != srcPixelComponents ||
-        dstPixelComponentCount != srcPixelComponentCount) {
+    if ((dstBitDepth != OFX::eBitDepthFloat &&
+         dstBitDepth != OFX::eBitDepthHalf &&
+         dstBitDepth != OFX::eBitDepthUShort &&
+         dstBitDepth != OFX::eBitDepthUByte) ||
+        (pixelComponents != OFX::ePixelComponentRGBA &&
+         pixelComponents != OFX::ePixelComponentRGB &&
+         pixelComponents != OFX::ePixelComponentAlpha &&
+         pixelComponents != OFX::ePixelComponentXY &&
+         pixelComponents != OFX::ePixelComponentCustom) ||
+        ((unpremult || premult) && pixelComponents != OFX::ePixelComponentRGBA) ||
+        (applyOCIO && pixelComponents != OFX::ePixelComponentRGBA && pixelComponents != OFX::ePixelComponentRGB)) {
         OFX::throwSuiteStatusException(kOfxStatErrFormat);
         return;
     }
-    
-    if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            OFX::throwSuiteStatusException(kOfxStatErrFormat);
-            return;
-        }
-        buildMipMapLevel<float, 4>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else if (dstPixelComponents == OFX::ePixelComponentRGB) {
-        if (!_supportsRGB) {
-            OFX::throwSuiteStatusException(kOfxStatErrFormat);
-            return;
-        }
-        buildMipMapLevel<float, 3>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    }  else if (dstPixelComponents == OFX::ePixelComponentAlpha) {
-        if (!_supportsAlpha) {
-            OFX::throwSuiteStatusException(kOfxStatErrFormat);
-            return;
-        }
-        buildMipMapLevel<float, 1>(this, originalRenderWindow, renderWindow,levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else {
-        assert(dstPixelComponents == OFX::ePixelComponentCustom);
-        
-        buildMipMapLevelGeneric<float>(this, originalRenderWindow, renderWindow,levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, dstPixelComponentCount);
+    if ((pixelComponents == OFX::ePixelComponentRGBA && !_supportsRGBA) ||
+        (pixelComponents == OFX::ePixelComponentRGB && !_supportsRGB) ||
+        (pixelComponents == OFX::ePixelComponentAlpha && !_supportsAlpha)) {
+        OFX::throwSuiteStatusException(kOfxStatErrFormat);
+        return;
+    }
+
+#ifdef OFX_IO_USING_OCIO
+    OCIO_NAMESPACE::ConstProcessorRcPtr ocioProc;
+    if (applyOCIO) {
+        ocioProc = _ocio->getProcessor(time);
+    }
+#   define OCIOPROC_ARG ocioProc,
+#else
+    (void)time;
+    (void)applyOCIO;
+#   define OCIOPROC_ARG
+#endif
+
+    switch (pixelComponents) {
+        case OFX::ePixelComponentRGBA:
+            setupAndPostDecode<4>(this, &_memoryPool, OCIOPROC_ARG renderWindow, renderWindowFullRes, levels, unpremult, premult,
+                                  srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstBounds, pixelComponents, pixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        case OFX::ePixelComponentRGB:
+            setupAndPostDecode<3>(this, &_memoryPool, OCIOPROC_ARG renderWindow, renderWindowFullRes, levels, unpremult, premult,
+                                  srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstBounds, pixelComponents, pixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        case OFX::ePixelComponentAlpha:
+            setupAndPostDecode<1>(this, &_memoryPool, OCIOPROC_ARG renderWindow, renderWindowFullRes, levels, unpremult, premult,
+                                  srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstBounds, pixelComponents, pixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        default:
+            setupAndPostDecode<0>(this, &_memoryPool, OCIOPROC_ARG renderWindow, renderWindowFullRes, levels, unpremult, premult,
+                                  srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstBounds, pixelComponents, pixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
     }
+#undef OCIOPROC_ARG
 }
 
 /* set up and run a copy processor */
@@ -998,124 +2236,228 @@ GenericReaderPlugin::fillWithBlack(const OfxRectI &renderWindow,
                                    OFX::BitDepthEnum dstBitDepth,
                                    int dstRowBytes)
 {
-    OFX::BlackFiller<float> fred(*this, dstPixelComponentCount);
-    setupAndFillWithBlack(fred, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte: {
+            OFX::BlackFiller<unsigned char> fred(*this, dstPixelComponentCount);
+            setupAndFillWithBlack(fred, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        }
+        case OFX::eBitDepthUShort:
+        case OFX::eBitDepthHalf: {
+            // the half zero is also all bits zero
+            OFX::BlackFiller<unsigned short> fred(*this, dstPixelComponentCount);
+            setupAndFillWithBlack(fred, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        }
+        default: {
+            OFX::BlackFiller<float> fred(*this, dstPixelComponentCount);
+            setupAndFillWithBlack(fred, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+            break;
+        }
+    }
 
 }
 
 
-static void
-setupAndProcess(OFX::PixelProcessorFilterBase & processor,
-                int premultChannel,
-                const OfxRectI &renderWindow,
-                const void *srcPixelData,
-                const OfxRectI& srcBounds,
-                OFX::PixelComponentEnum srcPixelComponents,
-                int srcPixelComponentCount,
-                OFX::BitDepthEnum srcPixelDepth,
-                int srcRowBytes,
-                void *dstPixelData,
-                const OfxRectI& dstBounds,
-                OFX::PixelComponentEnum dstPixelComponents,
-                int dstPixelComponentCount,
-                OFX::BitDepthEnum dstPixelDepth,
-                int dstRowBytes)
+std::string
+GenericReaderPlugin::getFrameCacheKey(const std::string& filename,
+                                      OfxTime sequenceTime,
+                                      OfxTime time,
+                                      int view,
+                                      unsigned int mipmapLevel,
+                                      OFX::BitDepthEnum bitDepth,
+                                      const PlaneToRender& plane)
 {
-    assert(srcPixelData && dstPixelData);
-    
-    // make sure bit depths are sane
-    if (srcPixelDepth != dstPixelDepth || srcPixelComponents != dstPixelComponents) {
-        OFX::throwSuiteStatusException(kOfxStatErrFormat);
-        return;
+    // a file modified on disk gets new keys
+    GenericReaderMetadataCache::FileStamp stamp;
+    if (!GenericReaderMetadataCache::getFileStamp(filename, &stamp)) {
+        return std::string();
     }
-    
-    // set the images
-    processor.setDstImg(dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstPixelDepth, dstRowBytes);
-    processor.setSrcImg(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, 0);
-    
-    // set the render window
-    processor.setRenderWindow(renderWindow);
-    
-    processor.setPremultMaskMix(true, premultChannel, 1.);
-    
-    // Call the base class process member, this will call the derived templated process code
-    processor.process();
+
+    int premult_i;
+    _premult->getValue(premult_i);
+
+    // the images of another instance may differ by the parameters of the subclass
+    std::ostringstream ss;
+    ss << (const void*)this << '\n' << filename << '\n' << stamp.mtime << '\n' << stamp.size << '\n' << sequenceTime << '\n' << view << '\n' << plane.rawComps << '\n' << plane.numChans << '\n'
+       << (int)plane.comps << '\n' << mipmapLevel << '\n' << (int)bitDepth << '\n' << premult_i;
+#ifdef OFX_IO_USING_OCIO
+    ss << '\n' << _ocio->getCacheID(time);
+#else
+    (void)time;
+#endif
+    return ss.str();
+}
+
+bool
+GenericReaderPlugin::getFrameBoundsCached(const std::string& filename,
+                                          OfxTime time,
+                                          OfxRectI *bounds,
+                                          double *par,
+                                          std::string *error)
+{
+    if (_metadataCache->get(filename, bounds, par)) {
+        return true;
+    }
+    // stamp the file before reading its header, so that a concurrent modification invalidates the entry
+    GenericReaderMetadataCache::FileStamp stamp;
+    const bool stamped = GenericReaderMetadataCache::getFileStamp(filename, &stamp);
+    if (!getFrameBounds(filename, time, bounds, par, error)) {
+        return false;
+    }
+    if (stamped) {
+        _metadataCache->insert(filename, stamp, *bounds, *par);
+    }
+    return true;
+}
+
+bool
+GenericReaderPlugin::getFrameBoundsForPrefetchCached(const std::string& filename,
+                                                     OfxTime time,
+                                                     OfxRectI *bounds,
+                                                     double *par)
+{
+    if (_metadataCache->get(filename, bounds, par)) {
+        return true;
+    }
+    GenericReaderMetadataCache::FileStamp stamp;
+    const bool stamped = GenericReaderMetadataCache::getFileStamp(filename, &stamp);
+    if (!getFrameBoundsForPrefetch(filename, time, bounds, par)) {
+        return false;
+    }
+    if (stamped) {
+        _metadataCache->insert(filename, stamp, *bounds, *par);
+    }
+    return true;
 }
 
+void
+GenericReaderPlugin::clearFrameCache()
+{
+    gFrameCache.evict(this);
+}
 
 void
-GenericReaderPlugin::unPremultPixelData(const OfxRectI &renderWindow,
-                                        const void *srcPixelData,
-                                        const OfxRectI& srcBounds,
-                                        OFX::PixelComponentEnum srcPixelComponents,
-                                        int srcPixelComponentCount,
-                                        OFX::BitDepthEnum srcPixelDepth,
-                                        int srcRowBytes,
-                                        void *dstPixelData,
-                                        const OfxRectI& dstBounds,
-                                        OFX::PixelComponentEnum dstPixelComponents,
-                                        int dstPixelComponentCount,
-                                        OFX::BitDepthEnum dstBitDepth,
-                                        int dstRowBytes)
+GenericReaderPlugin::getFrameCacheStats(std::size_t* usedBytes,
+                                        std::size_t* maxBytes,
+                                        unsigned long* hits,
+                                        unsigned long* misses)
 {
-    assert(srcPixelData && dstPixelData);
-    
-    // do the rendering
-    if (dstBitDepth != OFX::eBitDepthFloat || (dstPixelComponents != OFX::ePixelComponentRGBA && dstPixelComponents != OFX::ePixelComponentRGB && dstPixelComponents != OFX::ePixelComponentAlpha)) {
-        OFX::throwSuiteStatusException(kOfxStatErrFormat);
+    gFrameCache.getStats(usedBytes, maxBytes, hits, misses);
+}
+
+void
+GenericReaderPlugin::decodeOrFetch(const std::string& filename,
+                                   OfxTime time,
+                                   int view,
+                                   bool isPlayback,
+                                   const OfxRectI& renderWindow,
+                                   float *pixelData,
+                                   const OfxRectI& bounds,
+                                   OFX::PixelComponentEnum pixelComponents,
+                                   int pixelComponentCount,
+                                   const std::string& rawComponents,
+                                   int rowBytes)
+{
+    if (_prefetcher->fetch(filename, time, view, rawComponents, pixelComponentCount, renderWindow, pixelData, bounds, rowBytes)) {
         return;
     }
-    if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            OFX::throwSuiteStatusException(kOfxStatErrFormat);
-            return;
-        }
-        OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
-        setupAndProcess(fred, 3, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    if (!_isMultiPlanar) {
+        decode(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rowBytes);
     } else {
-        ///other pixel components means you want to copy only...
-        assert(false);
+        decodePlane(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
     }
 }
 
 void
-GenericReaderPlugin::premultPixelData(const OfxRectI &renderWindow,
-                                      const void *srcPixelData,
-                                      const OfxRectI& srcBounds,
-                                      OFX::PixelComponentEnum srcPixelComponents,
-                                      int srcPixelComponentCount,
-                                      OFX::BitDepthEnum srcPixelDepth,
-                                      int srcRowBytes,
-                                      void *dstPixelData,
-                                      const OfxRectI& dstBounds,
-                                      OFX::PixelComponentEnum dstPixelComponents,
-                                      int dstPixelComponentCount,
-                                      OFX::BitDepthEnum dstBitDepth,
-                                      int dstRowBytes)
+GenericReaderPlugin::schedulePrefetch(OfxTime time,
+                                      int view,
+                                      bool useProxy,
+                                      const OfxRectI& renderWindowFullRes,
+                                      const std::list<PlaneToRender>& planes)
 {
-    assert(srcPixelData && dstPixelData);
-    
-    // do the rendering
-    if (dstBitDepth != OFX::eBitDepthFloat || (dstPixelComponents != OFX::ePixelComponentRGBA && dstPixelComponents != OFX::ePixelComponentRGB && dstPixelComponents != OFX::ePixelComponentAlpha)) {
-        OFX::throwSuiteStatusException(kOfxStatErrFormat);
+    OfxRangeD frameRange;
+    double frameStep;
+    if (!_prefetchFrames || !_prefetcher->getSequence(&frameRange, &frameStep)) {
         return;
     }
-    
-    if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            OFX::throwSuiteStatusException(kOfxStatErrFormat);
-            return;
+
+    int depth;
+    _prefetchFrames->getValue(depth);
+    int timeOffset;
+    _timeOffset->getValue(timeOffset);
+    int firstFrame, lastFrame;
+    _firstFrame->getValue(firstFrame);
+    _lastFrame->getValue(lastFrame);
+
+    std::list<GenericReaderPrefetcher::Job> jobs;
+    for (int i = 1; i <= depth; ++i) {
+        const double t = time + i * frameStep;
+        if (t < frameRange.min || t > frameRange.max) {
+            break;
+        }
+        // only read ahead within the sequence: outside of it, frames are either held, black or an error
+        const double sequenceTime = t - timeOffset;
+        if (sequenceTime < firstFrame || sequenceTime > lastFrame) {
+            break;
+        }
+        std::string filename;
+        GetFilenameRetCodeEnum ret = getFilenameAtSequenceTime(sequenceTime, useProxy, &filename);
+        if (ret != (useProxy ? eGetFileNameReturnedProxy : eGetFileNameReturnedFullRes)) {
+            // missing frame, render() will handle it
+            continue;
         }
-        OFX::PixelCopierPremult<float, 4, 1, float, 4, 1> fred(*this);
-        setupAndProcess(fred, 3, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        for (std::list<PlaneToRender>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+            GenericReaderPrefetcher::Job job;
+            job.filename = filename;
+            job.time = sequenceTime;
+            job.view = view;
+            job.window = renderWindowFullRes;
+            job.comps = it->comps;
+            job.numChans = it->numChans;
+            job.rawComps = it->rawComps;
+            jobs.push_back(job);
+        }
+    }
+    _prefetcher->schedule(jobs);
+}
 
-    } else {
-        ///other pixel components means you want to copy only...
-        assert(false);
+void
+GenericReaderPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments &args)
+{
+    if (!kSupportsRenderScale && (args.renderScale.x != 1. || args.renderScale.y != 1.)) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
+    }
+
+    if (!_prefetch) {
+        return;
+    }
+    bool prefetch;
+    _prefetch->getValue(prefetch);
+    if (!prefetch || args.frameRange.max <= args.frameRange.min) {
+        return;
+    }
+    int nThreads;
+    _prefetchThreads->getValue(nThreads);
+    int maxMegaBytes;
+    _prefetchMemory->getValue(maxMegaBytes);
+    _prefetcher->start(args.frameRange, args.frameStep, std::max(nThreads, 1), (std::size_t)std::max(maxMegaBytes, 0) * 1024 * 1024);
+}
+
+void
+GenericReaderPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments &args)
+{
+    if (!kSupportsRenderScale && (args.renderScale.x != 1. || args.renderScale.y != 1.)) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
     }
+
+    _prefetcher->stop();
 }
 
 
+
 bool
 GenericReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args,
                                            OfxRectD &rod)
@@ -1163,7 +2505,7 @@ GenericReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgument
     std::string error;
     OfxRectI bounds;
     double par = 1.;
-    bool success = getFrameBounds(filename, sequenceTime, &bounds, &par, &error);
+    bool success = getFrameBoundsCached(filename, sequenceTime, &bounds, &par, &error);
     if (!success) {
         setPersistentMessage(OFX::Message::eMessageError, "", error);
         OFX::throwSuiteStatusException(kOfxStatFailed);
@@ -1293,7 +2635,8 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
         OfxRectI bounds;
         OFX::BitDepthEnum bitDepth;
         getImageData(outputImages[i], &dstPixelData, &bounds, &plane.comps, &bitDepth, &plane.rowBytes);
-        if (bitDepth != OFX::eBitDepthFloat) {
+        if (bitDepth != OFX::eBitDepthFloat && bitDepth != OFX::eBitDepthHalf &&
+            bitDepth != OFX::eBitDepthUShort && bitDepth != OFX::eBitDepthUByte) {
             OFX::throwSuiteStatusException(kOfxStatErrFormat);
             return;
         }
@@ -1309,7 +2652,7 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
                 return;
             }
         }
-        plane.pixelData = (float*)dstPixelData;
+        plane.pixelData = dstPixelData;
         if (!plane.pixelData) {
             setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host provided an invalid image buffer");
         }
@@ -1451,7 +2794,7 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
     }
     assert(downscaleLevels >= 0);
     
-    if (filename.empty() || !fileExists(filename)) {
+    if (filename.empty() || !_fileIndex->exists(filename)) {
         for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
             fillWithBlack(args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, firstDepth, it->rowBytes);
         }
@@ -1459,13 +2802,29 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
         return;
     }
 
+    // get the images that were already rendered from the decoded frame cache
+    if (gFrameCache.isEnabled()) {
+        std::list<PlaneToRender> planesToDecode;
+        for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
+            // computed before decoding, so that a file modified meanwhile is not cached under its previous stamp
+            it->cacheKey = getFrameCacheKey(filename, sequenceTime, args.time, args.renderView, renderMipmapLevel, firstDepth, *it);
+            if (it->cacheKey.empty() || !gFrameCache.get(it->cacheKey, args.renderWindow, it->pixelData, firstBounds, it->rowBytes)) {
+                planesToDecode.push_back(*it);
+            }
+        }
+        if (planesToDecode.empty()) {
+            return;
+        }
+        planes.swap(planesToDecode);
+    }
+
     OfxRectI renderWindowFullRes;
     OfxRectI frameBounds;
     double par = 1.;
     std::string error;
 
     ///if the plug-in doesn't support tiles, just render the full rod
-    bool success = getFrameBounds(filename, sequenceTime, &frameBounds, &par, &error);
+    bool success = getFrameBoundsCached(filename, sequenceTime, &frameBounds, &par, &error);
     ///We shouldve checked above for any failure, now this is too late.
     if (!success) {
         setPersistentMessage(OFX::Message::eMessageError, "", error);
@@ -1553,113 +2912,96 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
         
         
         
-        if (!mustPremult && isOCIOIdentity && (!kSupportsRenderScale || renderMipmapLevel == 0)) {
+        // the subclass may be able to decode directly at the render scale (e.g. from the mipmap levels
+        // stored in the file), only if the render window is within the downscaled image
+        const unsigned int fileLevels = kSupportsRenderScale ? (unsigned int)downscaleLevels : 0;
+        bool tryDecodeAtLevel = false;
+        if (fileLevels > 0) {
+            OfxRectI levelBounds = downscalePowerOfTwoSmallestEnclosing(frameBounds, fileLevels);
+            tryDecodeAtLevel = (levelBounds.x1 <= args.renderWindow.x1 && args.renderWindow.x2 <= levelBounds.x2 &&
+                                levelBounds.y1 <= args.renderWindow.y1 && args.renderWindow.y2 <= levelBounds.y2);
+        }
+
+        // the subclasses decode to float: other output depths are converted by postDecodePixelData()
+        const bool dstIsFloat = (firstDepth == OFX::eBitDepthFloat);
+
+        if (dstIsFloat && !mustPremult && isOCIOIdentity && (!kSupportsRenderScale || renderMipmapLevel == 0)) {
             // no colorspace conversion, no premultiplication, no proxy, just read file
             DBG(std::printf("decode (to dst)\n"));
             
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView,args.sequentialRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes);
-            }
+            decodeOrFetch(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, (float*)it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes);
             
+        } else if (dstIsFloat && !mustPremult && isOCIOIdentity && tryDecodeAtLevel &&
+                   decodeAtMipmapLevel(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, fileLevels,
+                                       args.renderWindow, (float*)it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes)) {
+            // no colorspace conversion, no premultiplication, the file was read at the render scale
+            DBG(std::printf("decode at mipmap level (to dst)\n"));
+
         } else {
-            int pixelBytes;
-            if (it->comps == OFX::ePixelComponentCustom) {
-                pixelBytes = it->numChans * sizeof(float);
-            } else {
-                pixelBytes = it->numChans * getComponentBytes(firstDepth);
-            }
+            // the temporary image is always float
+            const int pixelBytes = it->numChans * sizeof(float);
             assert(pixelBytes > 0);
-            int tmpRowBytes = (renderWindowFullRes.x2-renderWindowFullRes.x1) * pixelBytes;
-            size_t memSize = (size_t)(renderWindowFullRes.y2-renderWindowFullRes.y1) * tmpRowBytes;
-            OFX::ImageMemory mem(memSize, this);
-            float *tmpPixelData = (float*)mem.lock();
-            
-            // read file
-            DBG(std::printf("decode (to tmp)\n"));
-            
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView,args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, tmpRowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
+
+            // tmpWindow is the part of the file that was read, either at full resolution or at the render scale
+            OfxRectI tmpWindow = renderWindowFullRes;
+            unsigned int levels = fileLevels; // the number of mipmap levels from tmpWindow to args.renderWindow
+            std::auto_ptr<IO::PooledMemory> mem;
+            float *tmpPixelData = NULL;
+            int tmpRowBytes = 0;
+
+            if (tryDecodeAtLevel && (mustPremult || !isOCIOIdentity || !dstIsFloat)) {
+                // read file at the render scale
+                tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
+                size_t memSize = (size_t)(args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
+                mem.reset(new IO::PooledMemory(memSize, _memoryPool));
+                tmpPixelData = (float*)mem->lock();
+                DBG(std::printf("decode at mipmap level (to tmp)\n"));
+                if (decodeAtMipmapLevel(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, fileLevels,
+                                        args.renderWindow, tmpPixelData, args.renderWindow, it->comps, it->numChans, it->rawComps, tmpRowBytes)) {
+                    tmpWindow = args.renderWindow;
+                    levels = 0;
+                } else {
+                    mem.reset();
+                    tmpPixelData = NULL;
+                }
+            }
+
+            if (!tmpPixelData) {
+                tmpRowBytes = (renderWindowFullRes.x2-renderWindowFullRes.x1) * pixelBytes;
+                size_t memSize = (size_t)(renderWindowFullRes.y2-renderWindowFullRes.y1) * tmpRowBytes;
+                mem.reset(new IO::PooledMemory(memSize, _memoryPool));
+                tmpPixelData = (float*)mem->lock();
+
+                // read file
+                DBG(std::printf("decode (to tmp)\n"));
+
+                decodeOrFetch(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
             }
             
             if (abort()) {
                 return;
             }
-            
-            ///do the color-space conversion
-            if (!isOCIOIdentity && it->comps != OFX::ePixelComponentAlpha) {
-                if (premult == OFX::eImagePreMultiplied) {
-                    assert(remappedComponents == OFX::ePixelComponentRGBA);
-                    DBG(std::printf("unpremult (tmp in-place)\n"));
-                    //tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = tmpPixelData[3] = 0.5;
-                    unPremultPixelData(renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, firstDepth, tmpRowBytes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes);
-                    
-                    if (abort()) {
-                        return;
-                    }
-
-                    //assert(tmpPixelData[0] == 1. && tmpPixelData[1] == 1. && tmpPixelData[2] == 1. && tmpPixelData[3] == 0.5);
-                }
-#ifdef OFX_IO_USING_OCIO
-                DBG(std::printf("OCIO (tmp in-place)\n"));
-                _ocio->apply(args.time, renderWindowFullRes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, tmpRowBytes);
-#endif
-            }
-            
-            if (kSupportsRenderScale && downscaleLevels > 0) {
-                if (!mustPremult) {
-                    // we can write directly to dstPixelData
-                    /// adjust the scale to match the given output image
-                    DBG(std::printf("scale (no premult, tmp to dst)\n"));
-                    scalePixelData(args.renderWindow,renderWindowFullRes,(unsigned int)downscaleLevels, tmpPixelData, remappedComponents,
-                                   it->numChans, firstDepth, renderWindowFullRes, tmpRowBytes, it->pixelData,
-                                   remappedComponents, it->numChans, firstDepth, firstBounds, it->rowBytes);
-                } else {
-                    // allocate a temporary image (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
-                    int mem2RowBytes = (firstBounds.x2 - firstBounds.x1) * pixelBytes;
-                    size_t mem2Size = (firstBounds.y2 - firstBounds.y1) * mem2RowBytes;
-                    OFX::ImageMemory mem2(mem2Size, this);
-                    float *scaledPixelData = (float*)mem2.lock();
-                    
-                    /// adjust the scale to match the given output image
-                    DBG(std::printf("scale (tmp to scaled)\n"));
-                    scalePixelData(args.renderWindow,renderWindowFullRes,(unsigned int)downscaleLevels, tmpPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   renderWindowFullRes, tmpRowBytes, scaledPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   firstBounds, mem2RowBytes);
-                    
-                    if (abort()) {
-                        return;
-                    }
-
-                    // apply premult
-                    DBG(std::printf("premult (scaled to dst)\n"));
-                    //scaledPixelData[0] = scaledPixelData[1] = scaledPixelData[2] = 1.; scaledPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, scaledPixelData, firstBounds, remappedComponents,  it->numChans, firstDepth, mem2RowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    //assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
-                }
-            } else {
-                
-                // copy
-                if (mustPremult) {
-                    DBG(std::printf("premult (no scale, tmp to dst)\n"));
-                    //tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = 1.; tmpPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    //assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
-                } else {
-                    DBG(std::printf("copy (no premult no scale, tmp to dst)\n"));
-                    copyPixelData(args.renderWindow, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                }
-            }
-            mem.unlock();
+
+            // unpremult, colorspace conversion, downscale, premult and copy to dst in a single pass over the data
+            const bool applyOCIO = !isOCIOIdentity && it->comps != OFX::ePixelComponentAlpha;
+            const bool mustUnPremult = applyOCIO && premult == OFX::eImagePreMultiplied;
+            assert(!mustUnPremult || remappedComponents == OFX::ePixelComponentRGBA);
+            DBG(std::printf("post-decode (tmp to dst)\n"));
+            postDecodePixelData(args.time, args.renderWindow, tmpWindow, levels,
+                                mustUnPremult, applyOCIO, mustPremult,
+                                tmpPixelData, tmpWindow, tmpRowBytes,
+                                it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
+            mem->unlock();
+        }
+
+        if (!it->cacheKey.empty() && !abort()) {
+            gFrameCache.insert(it->cacheKey, this, args.renderWindow, it->numChans * getComponentBytes(firstDepth), it->pixelData, firstBounds, it->rowBytes);
         }
 
     } // for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
-    
+
+    // decode the next frames in the background while the host renders the sequence
+    schedulePrefetch(args.time, args.renderView, useProxy && !proxyFile.empty(), renderWindowFullRes, planes);
 }
 
 void
@@ -1675,6 +3017,29 @@ GenericReaderPlugin::decodePlane(const std::string& /*filename*/, OfxTime /*time
     //does nothing
 }
 
+bool
+GenericReaderPlugin::decodeAtMipmapLevel(const std::string& /*filename*/, OfxTime /*time*/, int /*view*/, bool /*isPlayback*/, unsigned int /*mipmapLevel*/, const OfxRectI& /*renderWindow*/, float */*pixelData*/, const OfxRectI& /*bounds*/,
+                                         OFX::PixelComponentEnum /*pixelComponents*/, int /*pixelComponentCount*/,  const std::string& /*rawComponents*/, int /*rowBytes*/)
+{
+    // decode at full resolution and downscale
+    return false;
+}
+
+bool
+GenericReaderPlugin::getFrameBoundsForPrefetch(const std::string& /*filename*/, OfxTime /*time*/, OfxRectI */*bounds*/, double */*par*/)
+{
+    // read-ahead is not supported by this reader
+    return false;
+}
+
+bool
+GenericReaderPlugin::decodeForPrefetch(const std::string& /*filename*/, OfxTime /*time*/, int /*view*/, const OfxRectI& /*renderWindow*/, float */*pixelData*/, const OfxRectI& /*bounds*/,
+                                       OFX::PixelComponentEnum /*pixelComponents*/, int /*pixelComponentCount*/, const std::string& /*rawComponents*/, int /*rowBytes*/)
+{
+    // read-ahead is not supported by this reader
+    return false;
+}
+
 void
 GenericReaderPlugin::setSequenceFromFile(const std::string& filename)
 {
@@ -1801,10 +3166,19 @@ GenericReaderPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         return;
     }
 
+    if (args.reason != OFX::eChangeTime) {
+        // the images rendered with the previous parameter values are not valid anymore
+        clearFrameCache();
+        // the bounds may depend on the reader parameters (e.g. the origin of ReadOIIO)
+        _metadataCache->clear();
+    }
+
     // please check the reason for each parameter when it makes sense!
 
     if (paramName == kParamFilename) {
         if (args.reason != OFX::eChangeTime) {
+            _fileIndex->clear();
+            _prefetcher->clear();
             inputFileChanged();
         }
 
@@ -2082,16 +3456,20 @@ GenericReaderPlugin::getClipPreferences(OFX::ClipPreferencesSetter &clipPreferen
     clipPreferences.setOutputPremultiplication(premult);
 
     // get the pixel aspect ratio from the first frame
+    std::string firstFilename; // also used to get the output bit depth
+    double firstTime = 0.;
     OfxRangeI tmp;
     if (getSequenceTimeDomainInternal(tmp, false)) {
         timeDomainFromSequenceTimeDomain(tmp, false);
         std::string filename;
         GetFilenameRetCodeEnum e = getFilenameAtSequenceTime(tmp.min, false, &filename);
         if (e == eGetFileNameReturnedFullRes) {
+            firstFilename = filename;
+            firstTime = tmp.min;
             OfxRectI bounds;
             double par = 1.;
             std::string error;
-            bool success = getFrameBounds(filename, tmp.min, &bounds, &par, &error);
+            bool success = getFrameBoundsCached(filename, tmp.min, &bounds, &par, &error);
             if (success) {
                 clipPreferences.setPixelAspectRatio(*_outputClip, par);
             }
@@ -2111,12 +3489,78 @@ GenericReaderPlugin::getClipPreferences(OFX::ClipPreferencesSetter &clipPreferen
             }
         }
     }
+
+    // the host may let us choose the output bit depth (else the render must handle any supported depth)
+    if (OFX::getImageEffectHostDescription()->supportsMultipleClipDepths) {
+        clipPreferences.setClipBitDepth(*_outputClip, getOutputBitDepth(firstFilename, firstTime, outputComponents));
+    }
+}
+
+OFX::BitDepthEnum
+GenericReaderPlugin::getOutputBitDepth(const std::string& filename,
+                                       OfxTime time,
+                                       OFX::PixelComponentEnum outputComponents)
+{
+    int bitDepth_i;
+    _outputBitDepth->getValue(bitDepth_i);
+    OFX::BitDepthEnum bitDepth;
+    switch ((OutputBitDepthEnum)bitDepth_i) {
+        case eOutputBitDepthByte:
+            bitDepth = OFX::eBitDepthUByte;
+            break;
+        case eOutputBitDepthShort:
+            bitDepth = OFX::eBitDepthUShort;
+            break;
+        case eOutputBitDepthHalf:
+            bitDepth = OFX::eBitDepthHalf;
+            break;
+        case eOutputBitDepthFloat:
+            bitDepth = OFX::eBitDepthFloat;
+            break;
+        case eOutputBitDepthAuto:
+        default: {
+            bitDepth = filename.empty() ? OFX::eBitDepthFloat : getFrameBitDepth(filename, time);
+#ifdef OFX_IO_USING_OCIO
+            if (bitDepth != OFX::eBitDepthFloat && !_ocio->isIdentity(time)) {
+                // the colorspace conversion may produce values outside of [0,1] and needs more precision:
+                // 8-bit and half data are well represented by half, 16-bit data needs float
+                bitDepth = (bitDepth == OFX::eBitDepthUShort) ? OFX::eBitDepthFloat : OFX::eBitDepthHalf;
+            }
+#endif
+            if (bitDepth == OFX::eBitDepthUByte && outputComponents == OFX::ePixelComponentRGBA) {
+                int premult_i;
+                _premult->getValue(premult_i);
+                if ((OFX::PreMultiplicationEnum)premult_i == OFX::eImageUnPreMultiplied) {
+                    // premultiplied 8-bit data loses too much precision in the transparent areas
+                    bitDepth = OFX::eBitDepthUShort;
+                }
+            }
+            break;
+        }
+    }
+    if (!OFX::getImageEffectHostDescription()->supportsBitDepth(bitDepth)) {
+        bitDepth = OFX::eBitDepthFloat;
+    }
+
+    return bitDepth;
 }
 
 void
 GenericReaderPlugin::purgeCaches()
 {
+#ifdef DEBUG
+    std::size_t usedBytes, maxBytes;
+    unsigned long hits, misses;
+    getFrameCacheStats(&usedBytes, &maxBytes, &hits, &misses);
+    std::cout << "Reader frame cache: " << (usedBytes >> 20) << "/" << (maxBytes >> 20) << " MB, " << hits << " hits, " << misses << " misses" << std::endl;
+    std::cout << "Reader scratch memory peak: " << (_memoryPool.getPeakBytes() >> 20) << " MB" << std::endl;
+#endif
+    _prefetcher->clear();
+    _fileIndex->clear();
+    _metadataCache->clear();
+    clearFrameCache();
     clearAnyCache();
+    _memoryPool.trim();
 #ifdef OFX_IO_USING_OCIO
     _ocio->purgeCaches();
 #endif
@@ -2184,9 +3628,9 @@ GenericReaderPlugin::detectProxyScale(const std::string& originalFileName,
     OfxRectI originalBounds, proxyBounds;
     std::string error;
     double originalPAR = 1., proxyPAR = 1.;
-    bool success = getFrameBounds(originalFileName, time, &originalBounds, &originalPAR, &error);
+    bool success = getFrameBoundsCached(originalFileName, time, &originalBounds, &originalPAR, &error);
     proxyBounds.x1 = proxyBounds.x2 = proxyBounds.y1 = proxyBounds.y2 = 0.f;
-    success = success && getFrameBounds(proxyFileName, time, &proxyBounds, &proxyPAR, &error);
+    success = success && getFrameBoundsCached(proxyFileName, time, &proxyBounds, &proxyPAR, &error);
     OfxPointD ret;
     if (!success ||
         (originalBounds.x1 == originalBounds.x2) ||
@@ -2219,8 +3663,10 @@ GenericReaderDescribe(OFX::ImageEffectDescriptor &desc,
     desc.addSupportedContext(OFX::eContextGeneral);
     
     // add supported pixel depths
-    //desc.addSupportedBitDepth( eBitDepthUByte );
-    //desc.addSupportedBitDepth( eBitDepthUShort );
+    // the images are always decoded as float, and converted to the output depth (see kParamOutputBitDepth)
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
+    desc.addSupportedBitDepth(eBitDepthHalf);
     desc.addSupportedBitDepth(eBitDepthFloat);
     
     // set a few flags
@@ -2233,6 +3679,7 @@ GenericReaderDescribe(OFX::ImageEffectDescriptor &desc,
     desc.setTemporalClipAccess(false); // say we will not be doing random time access on clips
     desc.setRenderTwiceAlways(false);
     desc.setSupportsMultipleClipPARs(true); // plugin may setPixelAspectRatio on output clip
+    desc.setSupportsMultipleClipDepths(true); // plugin may setClipBitDepth on output clip
     desc.setRenderThreadSafety(OFX::eRenderFullySafe);
     
 #ifdef OFX_EXTENSIONS_NUKE
@@ -2252,11 +3699,12 @@ GenericReaderDescribe(OFX::ImageEffectDescriptor &desc,
 OFX::PageParamDescriptor *
 GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc,
                                     OFX::ContextEnum /*context*/,
-                                    bool /*isVideoStreamPlugin*/,
+                                    bool isVideoStreamPlugin,
                                     bool supportsRGBA,
                                     bool supportsRGB,
                                     bool supportsAlpha,
-                                    bool supportsTiles)
+                                    bool supportsTiles,
+                                    bool supportsPrefetch)
 {
     gHostIsNatron = (OFX::getImageEffectHostDescription()->isNatron);
 
@@ -2604,6 +4052,33 @@ GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+
+    //// Output bit depth
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamOutputBitDepth);
+        param->setLabel(kParamOutputBitDepthLabel);
+        param->setHint(kParamOutputBitDepthHint);
+        assert(param->getNOptions() == eOutputBitDepthAuto);
+        param->appendOption(kParamOutputBitDepthOptionAuto, kParamOutputBitDepthOptionAutoHint);
+        assert(param->getNOptions() == eOutputBitDepthByte);
+        param->appendOption(kParamOutputBitDepthOptionByte);
+        assert(param->getNOptions() == eOutputBitDepthShort);
+        param->appendOption(kParamOutputBitDepthOptionShort);
+        assert(param->getNOptions() == eOutputBitDepthHalf);
+        param->appendOption(kParamOutputBitDepthOptionHalf);
+        assert(param->getNOptions() == eOutputBitDepthFloat);
+        param->appendOption(kParamOutputBitDepthOptionFloat);
+        param->setDefault(eOutputBitDepthAuto);
+        param->setAnimates(false);
+        desc.addClipPreferencesSlaveParam(*param);
+        if (!OFX::getImageEffectHostDescription()->supportsMultipleClipDepths) {
+            // the host chooses the output depth
+            param->setIsSecret(true);
+        }
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     
     ///Frame rate
     {
@@ -2635,6 +4110,60 @@ GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc,
         }
     }
 
+    if (!isVideoStreamPlugin && supportsPrefetch) {
+        ///Read ahead
+        {
+            BooleanParamDescriptor* param  = desc.defineBooleanParam(kParamPrefetch);
+            param->setLabel(kParamPrefetchLabel);
+            param->setHint(kParamPrefetchHint);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            param->setDefault(false);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        {
+            IntParamDescriptor* param  = desc.defineIntParam(kParamPrefetchFrames);
+            param->setLabel(kParamPrefetchFramesLabel);
+            param->setHint(kParamPrefetchFramesHint);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            param->setDefault(4);
+            param->setRange(1, 64);
+            param->setDisplayRange(1, 16);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        {
+            IntParamDescriptor* param  = desc.defineIntParam(kParamPrefetchThreads);
+            param->setLabel(kParamPrefetchThreadsLabel);
+            param->setHint(kParamPrefetchThreadsHint);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            param->setDefault(2);
+            param->setRange(1, 32);
+            param->setDisplayRange(1, 8);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        {
+            IntParamDescriptor* param  = desc.defineIntParam(kParamPrefetchMemory);
+            param->setLabel(kParamPrefetchMemoryLabel);
+            param->setHint(kParamPrefetchMemoryHint);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            param->setDefault(1024);
+            param->setRange(16, INT_MAX);
+            param->setDisplayRange(64, 8192);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+    }
+
     return page;
 }
 
@@ -25,11 +25,19 @@
 #define Io_GenericReader_h
 
 #include <memory>
+#include <cstddef>
+#include <list>
+#include <string>
 #include <ofxsImageEffect.h>
 #include <ofxsMacros.h>
 
+#include "IOMemoryPool.h"
+
 class SequenceParser;
 class GenericOCIO;
+class GenericReaderPrefetcher;
+class GenericReaderFileIndex;
+class GenericReaderMetadataCache;
 namespace SequenceParsing {
     class SequenceFromFiles;
 }
@@ -42,6 +50,8 @@ namespace SequenceParsing {
  **/
 class GenericReaderPlugin : public OFX::ImageEffect {
     
+    friend class GenericReaderPrefetcher;
+
 public:
     
     GenericReaderPlugin(OfxImageEffectHandle handle, bool supportsTiles, bool supportsRGBA, bool supportsRGB, bool supportsAlpha, bool isMultiPlanar);
@@ -71,6 +81,19 @@ public:
      **/
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
     
+    /**
+     * @brief Starts the read-ahead threads if prefetching is enabled.
+     * If you override this, make sure you call the base-class version.
+     **/
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE;
+
+    /**
+     * @brief Stops the read-ahead threads. The subclass decode() functions are never
+     * called from a background thread after this returns.
+     * If you override this, make sure you call the base-class version.
+     **/
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE;
+
     
     /**
      * @brief You can override this to take actions in response to a param change. 
@@ -102,6 +125,12 @@ public:
      * This function calls clearAnyCache() if you have any cache to clear.
      **/
     virtual void purgeCaches(void) OVERRIDE;
+
+    /**
+     * @brief Statistics of the decoded frame cache shared by all reader instances.
+     * Its size (in megabytes) is set by the OFX_IO_READER_CACHE_SIZE environment variable (default: 256, 0 disables it).
+     **/
+    static void getFrameCacheStats(std::size_t* usedBytes, std::size_t* maxBytes, unsigned long* hits, unsigned long* misses);
     
     /**
      * @brief Called right away after the constructor, must restore the state of the Reader. We don't do this in the ctor. of the plug-in
@@ -120,6 +149,13 @@ protected:
 
     int getStartingTime();
     
+    /**
+     * @brief Removes the images rendered by this instance from the decoded frame cache.
+     * This is done by changedParam(): call it if you handle parameters that affect decoding
+     * without calling GenericReaderPlugin::changedParam().
+     **/
+    void clearFrameCache();
+
     OFX::PixelComponentEnum getOutputComponents() const;
     
     void setOutputComponents(OFX::PixelComponentEnum comps);
@@ -128,11 +164,12 @@ protected:
 
     struct PlaneToRender
     {
-        float* pixelData;
+        void* pixelData; //< the output image, of any of the supported bit depths
         int rowBytes;
         int numChans;
         OFX::PixelComponentEnum comps;
         std::string rawComps;
+        std::string cacheKey; //< the key of the image in the decoded frame cache, empty if it is not cached
     };
     
 private:
@@ -177,6 +214,14 @@ private:
     
     virtual bool getFrameRate(const std::string& /*filename*/, double* /*fps*/) { return false; }
 
+    /**
+     * @brief Override to indicate the bit depth of the data stored in the file (e.g. eBitDepthUByte for a 8-bit
+     * PNG or video, eBitDepthHalf for a half-float EXR), so that the output can use the smallest depth
+     * that represents it (see the Output Depth parameter).
+     * The pixels are always decoded as float, in the [0,1] range for integer data.
+     **/
+    virtual OFX::BitDepthEnum getFrameBitDepth(const std::string& /*filename*/, OfxTime /*time*/) { return OFX::eBitDepthFloat; }
+
     /**
      * @brief Override this function to actually decode the image contained in the file pointed to by filename.
      * If the file is a video-stream then you should decode the frame at the time given in parameters.
@@ -191,6 +236,32 @@ private:
    
     virtual void decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
                              OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
+
+    /**
+     * @brief Override this function if the image can be decoded cheaply at a lower resolution, e.g. from the mipmap
+     * levels stored in the file, or by using the reduced resolution decoding of the codec.
+     * renderWindow and bounds are in the pixel coordinates of the image downscaled mipmapLevel times
+     * (see downscalePowerOfTwoSmallestEnclosing()), and each pixel should be the average of the
+     * corresponding 2^mipmapLevel x 2^mipmapLevel block of the full resolution image.
+     * If the image cannot be decoded at that level, return false without writing to pixelData: it is then
+     * decoded at full resolution by decode() or decodePlane() and downscaled.
+     **/
+    virtual bool decodeAtMipmapLevel(const std::string& filename, OfxTime time, int view, bool isPlayback, unsigned int mipmapLevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                     OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
+
+    /**
+     * @brief Override these functions to support read-ahead (see the supportsPrefetch argument of
+     * GenericReaderDescribeInContextBegin()). They do the same as getFrameBounds() and decode(), but they
+     * are called by the read-ahead threads, which are not host threads: they must not call any host suite
+     * (no parameter values, persistent messages, multithread suite or host memory), and report errors by
+     * throwing a std::exception. The error is reported when render() decodes the frame again.
+     * decodeForPrefetch() decodes the plane rawComponents, as decodePlane() does for multi-planar readers.
+     * It returns false if it does not support these components. The default implementations return false.
+     **/
+    virtual bool getFrameBoundsForPrefetch(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par);
+
+    virtual bool decodeForPrefetch(const std::string& filename, OfxTime time, int view, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                   OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
     
     
     /**
@@ -244,35 +315,60 @@ private:
      **/
     void inputFileChanged();
 
-    void copyPixelData(const OfxRectI &renderWindow,
-                       const void *srcPixelData,
-                       const OfxRectI& srcBounds,
-                       OFX::PixelComponentEnum srcPixelComponents,
-                       int srcPixelComponentCount,
-                       OFX::BitDepthEnum srcPixelDepth,
-                       int srcRowBytes,
-                       void *dstPixelData,
-                       const OfxRectI& dstBounds,
-                       OFX::PixelComponentEnum dstPixelComponents,
-                       int dstPixelComponentCount,
-                       OFX::BitDepthEnum dstBitDepth,
-                       int dstRowBytes);
-    
-    void scalePixelData(const OfxRectI& originalRenderWindow,
-                        const OfxRectI& renderWindow,
-                        unsigned int levels,
-                        const void* srcPixelData,
-                        OFX::PixelComponentEnum srcPixelComponents,
-                        int srcPixelComponentCount,
-                        OFX::BitDepthEnum srcPixelDepth,
-                        const OfxRectI& srcBounds,
-                        int srcRowBytes,
-                        void* dstPixelData,
-                        OFX::PixelComponentEnum dstPixelComponents,
-                        int dstPixelComponentCount,
-                        OFX::BitDepthEnum dstPixelDepth,
-                        const OfxRectI& dstBounds,
-                        int dstRowBytes);
+    /**
+     * @brief Calls decode() or decodePlane(), or gets the decoded image from the
+     * read-ahead staging area if it was prefetched.
+     **/
+    void decodeOrFetch(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                       OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
+
+    /**
+     * @brief Calls getFrameBounds(), or gets the bounds from the headers already read if the file did not change.
+     **/
+    bool getFrameBoundsCached(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error);
+
+    /**
+     * @brief Same as getFrameBoundsCached(), but calls getFrameBoundsForPrefetch(): can be called by the read-ahead threads.
+     **/
+    bool getFrameBoundsForPrefetchCached(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par);
+
+    /**
+     * @brief The key of an output image of this instance in the decoded frame cache, or an empty
+     * string if the file cannot be stat'ed.
+     **/
+    std::string getFrameCacheKey(const std::string& filename, OfxTime sequenceTime, OfxTime time, int view, unsigned int mipmapLevel, OFX::BitDepthEnum bitDepth, const PlaneToRender& plane);
+
+    /**
+     * @brief The bit depth of the output images, from the Output Depth parameter and the file.
+     **/
+    OFX::BitDepthEnum getOutputBitDepth(const std::string& filename, OfxTime time, OFX::PixelComponentEnum outputComponents);
+
+    /**
+     * @brief Schedule the decoding of the frames following time in the read-ahead staging area.
+     **/
+    void schedulePrefetch(OfxTime time, int view, bool useProxy, const OfxRectI& renderWindowFullRes, const std::list<PlaneToRender>& planes);
+
+    /**
+     * @brief Process the decoded image in a single pass: unpremult, OCIO colorspace conversion,
+     * downscale by the given number of mipmap levels, premult, and convert to the bit depth of dstPixelData.
+     * The decoded image (srcPixelData) is always float, and is modified in place.
+     **/
+    void postDecodePixelData(double time,
+                             const OfxRectI& renderWindow,
+                             const OfxRectI& renderWindowFullRes,
+                             unsigned int levels,
+                             bool unpremult,
+                             bool applyOCIO,
+                             bool premult,
+                             float* srcPixelData,
+                             const OfxRectI& srcBounds,
+                             int srcRowBytes,
+                             void* dstPixelData,
+                             const OfxRectI& dstBounds,
+                             OFX::PixelComponentEnum pixelComponents,
+                             int pixelComponentCount,
+                             OFX::BitDepthEnum dstBitDepth,
+                             int dstRowBytes);
     
     void fillWithBlack(const OfxRectI &renderWindow,
                        void *dstPixelData,
@@ -282,34 +378,6 @@ private:
                        OFX::BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
-
-    void premultPixelData(const OfxRectI &renderWindow,
-                          const void *srcPixelData,
-                          const OfxRectI& srcBounds,
-                          OFX::PixelComponentEnum srcPixelComponents,
-                          int srcPixelComponentCount,
-                          OFX::BitDepthEnum srcPixelDepth,
-                          int srcRowBytes,
-                          void *dstPixelData,
-                          const OfxRectI& dstBounds,
-                          OFX::PixelComponentEnum dstPixelComponents,
-                          int dstPixelComponentCount,
-                          OFX::BitDepthEnum dstBitDepth,
-                          int dstRowBytes);
-    
-    void unPremultPixelData(const OfxRectI &renderWindow,
-                            const void *srcPixelData,
-                            const OfxRectI& srcBounds,
-                            OFX::PixelComponentEnum srcPixelComponents,
-                            int srcPixelComponentCount,
-                            OFX::BitDepthEnum srcPixelDepth,
-                            int srcRowBytes,
-                            void *dstPixelData,
-                            const OfxRectI& dstBounds,
-                            OFX::PixelComponentEnum dstPixelComponents,
-                            int dstPixelComponentCount,
-                            OFX::BitDepthEnum dstBitDepth,
-                            int dstRowBytes);
     
     OfxPointD detectProxyScale(const std::string& originalFileName, const std::string& proxyFileName, OfxTime time);
     
@@ -336,12 +404,18 @@ protected:
     OFX::Int2DParam* _originalFrameRange; //< the original frame range computed the first time by getSequenceTimeDomainInternal
     
     OFX::ChoiceParam* _outputComponents;
+    OFX::ChoiceParam* _outputBitDepth;
     OFX::ChoiceParam* _premult;
     
     OFX::BooleanParam* _timeDomainUserSet; //< true when the time domain has bee nuser edited
     
     OFX::BooleanParam* _customFPS;
     OFX::DoubleParam* _fps;
+
+    OFX::BooleanParam* _prefetch; //< enable read-ahead during sequential renders
+    OFX::IntParam* _prefetchFrames; //< number of frames to read ahead
+    OFX::IntParam* _prefetchThreads; //< number of read-ahead threads
+    OFX::IntParam* _prefetchMemory; //< maximum memory used by the read-ahead staging area, in MB
     
 #ifdef OFX_IO_USING_OCIO
     std::auto_ptr<GenericOCIO> _ocio;
@@ -353,6 +427,10 @@ private:
     
     
     std::map<int,std::map<int,std::string> > _sequenceFromFiles;
+    std::auto_ptr<GenericReaderFileIndex> _fileIndex; //< directory listings, to check if the files of the sequence exist
+    std::auto_ptr<GenericReaderMetadataCache> _metadataCache; //< the frame bounds read from the file headers
+    std::auto_ptr<GenericReaderPrefetcher> _prefetcher;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
     const bool _supportsRGBA;
     const bool _supportsRGB;
     const bool _supportsAlpha;
@@ -362,7 +440,8 @@ private:
 
 
 void GenericReaderDescribe(OFX::ImageEffectDescriptor &desc, bool supportsTiles, bool multiPlanar);
-OFX::PageParamDescriptor* GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, bool isVideoStreamPlugin, bool supportsRGBA, bool supportsRGB, bool supportsAlpha, bool supportsTiles);
+/// supportsPrefetch: the plugin implements getFrameBoundsForPrefetch() and decodeForPrefetch(), which adds the read-ahead parameters
+OFX::PageParamDescriptor* GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, bool isVideoStreamPlugin, bool supportsRGBA, bool supportsRGB, bool supportsAlpha, bool supportsTiles, bool supportsPrefetch);
 void GenericReaderDescribeInContextEnd(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page, const char* inputSpaceNameDefault, const char* outputSpaceNameDefault);
 
 #define mDeclareReaderPluginFactory(CLASS, LOADFUNCDEF, UNLOADFUNCDEF,ISVIDEOSTREAM) \
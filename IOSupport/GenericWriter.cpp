@@ -27,6 +27,9 @@
 #include <sstream>
 #include <cstring>
 #include <algorithm>
+#ifdef DEBUG
+#include <iostream>
+#endif
 
 #include "ofxsLog.h"
 #include "ofxsCopier.h"
@@ -123,6 +126,7 @@ GenericWriterPlugin::GenericWriterPlugin(OfxImageEffectHandle handle)
 , _premult(0)
 , _clipToProject(0)
 , _ocio(new GenericOCIO(this))
+, _memoryPool(this)
 {
     _inputClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
     _outputClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -264,7 +268,7 @@ GenericWriterPlugin::InputImagesHolder::addImage(const OFX::Image* img)
 }
 
 void
-GenericWriterPlugin::InputImagesHolder::addMemory(OFX::ImageMemory* mem)
+GenericWriterPlugin::InputImagesHolder::addMemory(IO::PooledMemory* mem)
 {
     _mems.push_back(mem);
 }
@@ -274,7 +278,7 @@ GenericWriterPlugin::InputImagesHolder::~InputImagesHolder()
     for (std::list<const OFX::Image*>::iterator it = _imgs.begin(); it != _imgs.end(); ++it) {
         delete *it;
     }
-    for (std::list<OFX::ImageMemory*>::iterator it = _mems.begin(); it!= _mems.end(); ++it) {
+    for (std::list<IO::PooledMemory*>::iterator it = _mems.begin(); it!= _mems.end(); ++it) {
         delete *it;
     }
 }
@@ -351,7 +355,7 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const std::string& plane,
                                           bool isOCIOIdentity,
                                           InputImagesHolder* srcImgsHolder,
                                           OfxRectI* bounds,
-                                          OFX::ImageMemory** tmpMem,
+                                          IO::PooledMemory** tmpMem,
                                           const OFX::Image** inputImage,
                                           float** tmpMemPtr,
                                           int* rowBytes,
@@ -443,7 +447,7 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const std::string& plane,
         int tmpRowBytes = (renderWindow.x2 - renderWindow.x1) * pixelBytes;
         *rowBytes = tmpRowBytes;
         size_t memSize = (renderWindow.y2 - renderWindow.y1) * tmpRowBytes;
-        *tmpMem = new OFX::ImageMemory(memSize,this);
+        *tmpMem = new IO::PooledMemory(memSize, _memoryPool);
         srcImgsHolder->addMemory(*tmpMem);
         *tmpMemPtr = (float*)(*tmpMem)->lock();
         if (!*tmpMemPtr) {
@@ -672,7 +676,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
         InputImagesHolder dataHolder;
         
         const OFX::Image* srcImg;
-        OFX::ImageMemory *tmpMem;
+        IO::PooledMemory *tmpMem;
         ImageData data;
         fetchPlaneConvertAndCopy(args.planes.front(), viewIndex, args.renderView, args.time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents);
         
@@ -706,7 +710,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
                 std::list<ImageData> planesData;
                 for (std::map<int,std::string>::const_iterator view = viewNames.begin(); view!=viewNames.end(); ++view) {
                     for (std::list<std::string>::const_iterator plane = args.planes.begin(); plane != args.planes.end(); ++plane) {
-                        OFX::ImageMemory *tmpMem;
+                        IO::PooledMemory *tmpMem;
                         const OFX::Image* srcImg;
                         
                         ImageData data;
@@ -725,7 +729,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
                 int pixelBytes = nChannels * getComponentBytes(OFX::eBitDepthFloat);
                 int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
                 size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
-                OFX::ImageMemory interleavedMem(memSize, this);
+                IO::PooledMemory interleavedMem(memSize, _memoryPool);
                 float* tmpMemPtr = (float*)interleavedMem.lock();
                 if (!tmpMemPtr) {
                     OFX::throwSuiteStatusException(kOfxStatErrMemory);
@@ -761,7 +765,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
                     std::list<ImageData> planesData;
                     for (std::list<std::string>::const_iterator plane = args.planes.begin(); plane != args.planes.end(); ++plane) {
                         
-                        OFX::ImageMemory *tmpMem;
+                        IO::PooledMemory *tmpMem;
                         const OFX::Image* srcImg;
                         
                         ImageData data;
@@ -780,7 +784,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
                     int pixelBytes = nChannels * getComponentBytes(OFX::eBitDepthFloat);
                     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
                     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
-                    OFX::ImageMemory interleavedMem(memSize, this);
+                    IO::PooledMemory interleavedMem(memSize, _memoryPool);
                     float* tmpMemPtr = (float*)interleavedMem.lock();
                     if (!tmpMemPtr) {
                         OFX::throwSuiteStatusException(kOfxStatErrMemory);
@@ -818,7 +822,7 @@ GenericWriterPlugin::render(const OFX::RenderArguments &args)
                     for (std::list<std::string>::const_iterator plane = args.planes.begin(); plane != args.planes.end(); ++plane) {
                         
                         InputImagesHolder dataHolder;
-                        OFX::ImageMemory *tmpMem;
+                        IO::PooledMemory *tmpMem;
                         const OFX::Image* srcImg;
                         ImageData data;
                         fetchPlaneConvertAndCopy(*plane, view->first, args.renderView, args.time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents);
@@ -1483,6 +1487,10 @@ void
 GenericWriterPlugin::purgeCaches()
 {
     clearAnyCache();
+#ifdef DEBUG
+    std::cout << "Writer scratch memory peak: " << (_memoryPool.getPeakBytes() >> 20) << " MB" << std::endl;
+#endif
+    _memoryPool.trim();
     _ocio->purgeCaches();
 }
 
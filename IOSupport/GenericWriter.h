@@ -30,6 +30,7 @@
 #include "ofxsMacros.h"
 #include "ofxsPixelProcessor.h" // for getImageData
 #include "ofxsCopier.h" // for copyPixels
+#include "IOMemoryPool.h"
 
 namespace OFX {
     class PixelProcessorFilterBase;
@@ -226,6 +227,7 @@ protected:
     OFX::ChoiceParam* _premult;
     OFX::BooleanParam* _clipToProject;
     std::auto_ptr<GenericOCIO> _ocio;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 
 private:
     
@@ -233,12 +235,12 @@ private:
     class InputImagesHolder
     {
         std::list<const OFX::Image*> _imgs;
-        std::list<OFX::ImageMemory*> _mems;
+        std::list<IO::PooledMemory*> _mems;
     public:
         
         InputImagesHolder();
         void addImage(const OFX::Image* img);
-        void addMemory(OFX::ImageMemory* mem);
+        void addMemory(IO::PooledMemory* mem);
         ~InputImagesHolder();
     };
     
@@ -271,7 +273,7 @@ private:
                               bool isOCIOIdentity,
                               InputImagesHolder* srcImgsHolder,
                               OfxRectI* bounds,
-                              OFX::ImageMemory** tmpMem,
+                              IO::PooledMemory** tmpMem,
                               const OFX::Image** inputImage,
                               float** tmpMemPtr,
                               int* rowBytes,
@@ -0,0 +1,76 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O byte swapping.
+ * Copies rows of 32-bit samples stored with the other endianness, using SSE2 when
+ * the compiler targets it.
+ */
+
+#ifndef IO_ByteSwap_h
+#define IO_ByteSwap_h
+
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IO_BYTESWAP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace IO {
+
+/// copy n samples from src (which need not be aligned), inverting their endianness
+inline void byteSwapCopyScalar(const char* src, float* dst, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i) {
+        unsigned int val;
+        std::memcpy(&val, src + i * sizeof(float), sizeof(val));
+        val = (val >> 24) | ((val >> 8) & 0xff00) | ((val << 8) & 0xff0000) | (val << 24);
+        std::memcpy(dst + i, &val, sizeof(val));
+    }
+}
+
+#ifdef IO_BYTESWAP_SSE2
+inline void byteSwapCopySSE2(const char* src, float* dst, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * sizeof(float)));
+        // swap the bytes of each 16-bit word, then the two words of each 32-bit sample
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+    byteSwapCopyScalar(src + i * sizeof(float), dst + i, n - i);
+}
+#endif
+
+inline void byteSwapCopy(const char* src, float* dst, std::size_t n)
+{
+#ifdef IO_BYTESWAP_SSE2
+    byteSwapCopySSE2(src, dst, n);
+#else
+    byteSwapCopyScalar(src, dst, n);
+#endif
+}
+
+} // namespace IO
+
+#endif
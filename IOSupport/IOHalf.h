@@ -0,0 +1,150 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O half-float conversion.
+ * Converts rows of floats to IEEE 754 halves, using the F16C instructions when the
+ * CPU has them (checked at runtime, so that the plugins do not require them).
+ */
+
+#ifndef IO_Half_h
+#define IO_Half_h
+
+#include <cstddef>
+#include <cstring>
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define IO_HALF_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/// convert a float to the bit pattern of the nearest IEEE 754 half (round to nearest even)
+inline unsigned short floatToHalf(float value)
+{
+    unsigned int x;
+    std::memcpy(&x, &value, sizeof(x));
+    const unsigned int sign = (x >> 16) & 0x8000;
+    const unsigned int absx = x & 0x7fffffff;
+
+    if (absx >= 0x7f800000) {
+        // inf or nan (keep nans quiet)
+        return (unsigned short)(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 | ((absx >> 13) & 0x3ff) : 0));
+    }
+    if (absx >= 0x477ff000) {
+        // rounds to a value larger than the largest half (65504)
+        return (unsigned short)(sign | 0x7c00);
+    }
+    if (absx < 0x38800000) {
+        // denormalized half, or zero
+        if (absx < 0x33000000) {
+            return (unsigned short)sign;
+        }
+        const unsigned int e = absx >> 23;
+        const unsigned int m = (absx & 0x7fffff) | 0x800000;
+        const unsigned int shift = 126 - e;
+        unsigned int r = m >> shift;
+        const unsigned int rem = m & ((1u << shift) - 1);
+        const unsigned int halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (r & 1))) {
+            ++r;
+        }
+        return (unsigned short)(sign | r);
+    }
+    // normalized half: rebias the exponent and round the mantissa
+    unsigned int r = (absx - 0x38000000) >> 13;
+    const unsigned int rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (r & 1))) {
+        ++r;
+    }
+    return (unsigned short)(sign | r);
+}
+
+namespace IO {
+
+#ifdef IO_HALF_X86
+/// true if the CPU and the OS support the F16C instructions
+inline bool cpuHasF16C()
+{
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+    const unsigned int osxsave = 1u << 27;
+    const unsigned int avx = 1u << 28;
+    const unsigned int f16c = 1u << 29;
+    if ((ecx & (osxsave | avx | f16c)) != (osxsave | avx | f16c)) {
+        return false;
+    }
+    // F16C instructions are VEX-encoded: the OS must save the AVX state
+#ifdef _MSC_VER
+    const unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int xcr0lo, xcr0hi;
+    __asm__ __volatile__ ("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+    const unsigned long long xcr0 = xcr0lo;
+#endif
+    return (xcr0 & 6) == 6;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx,f16c")))
+#endif
+inline void floatToHalfRowF16C(const float* src, unsigned short* dst, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(src + i);
+        // 0: round to nearest even, like floatToHalf()
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(v, 0));
+    }
+    for (; i < n; ++i) {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+#endif
+
+/// convert n floats to the bit patterns of the nearest halves (round to nearest even)
+inline void floatToHalfRow(const float* src, unsigned short* dst, std::size_t n)
+{
+#ifdef IO_HALF_X86
+    static const bool hasF16C = cpuHasF16C();
+    if (hasF16C) {
+        floatToHalfRowF16C(src, dst, n);
+        return;
+    }
+#endif
+    for (std::size_t i = 0; i < n; ++i) {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+
+} // namespace IO
+
+#endif
@@ -0,0 +1,209 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O memory-mapped files.
+ * Read-only mappings of whole files, used by the readers to decode the pixel data
+ * in place instead of copying it through stdio buffers.
+ */
+
+#ifndef IO_MappedFile_h
+#define IO_MappedFile_h
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+#endif
+
+namespace IO {
+
+/**
+ * @brief A read-only memory mapping of a whole file.
+ * The file is not locked: if it is truncated by another process, reading the pages past its new end
+ * raises SIGBUS (or an access violation on Windows). Mappings that are kept open must be revalidated
+ * against the file size and modification time before being read.
+ **/
+class MappedFile
+{
+public:
+    /// map the file. Returns NULL if the file cannot be mapped, or should not be mapped (see isMappingEnabled()).
+    static MappedFile* open(const std::string& filename)
+    {
+        if (!isMappingEnabled(filename)) {
+            return 0;
+        }
+#ifdef _WIN32
+        // the mapping may stay open while the file is not read: let the other processes rewrite, rename or delete it.
+        // The users of a mapping must check that the file did not change before reading it again.
+        HANDLE file = CreateFileW(widen(filename).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return 0;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (unsigned long long)size.QuadPart > (size_t)-1) {
+            CloseHandle(file);
+            return 0;
+        }
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping) {
+            CloseHandle(file);
+            return 0;
+        }
+        const char* data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return 0;
+        }
+        return new MappedFile(data, (std::size_t)size.QuadPart, file, mapping);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > (size_t)-1) {
+            close(fd);
+            return 0;
+        }
+        void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping stays valid after the file is closed
+        close(fd);
+        if (data == MAP_FAILED) {
+            return 0;
+        }
+        return new MappedFile((const char*)data, (std::size_t)st.st_size);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(_data);
+        CloseHandle(_mapping);
+        CloseHandle(_file);
+#else
+        munmap((void*)_data, _size);
+#endif
+    }
+
+    const char* data() const { return _data; }
+
+    std::size_t size() const { return _size; }
+
+    /// false if the file is on a network filesystem: memory mapping is then slower than
+    /// buffered reads, and a disconnection would crash instead of raising an error
+    static bool isMappingEnabled(const std::string& filename)
+    {
+#ifdef _WIN32
+        if (filename.size() >= 2 && (filename[0] == '\\' || filename[0] == '/') && filename[0] == filename[1]) {
+            // UNC path
+            return false;
+        }
+        if (filename.size() >= 3 && filename[1] == ':') {
+            const std::string root = filename.substr(0, 2) + "\\";
+            if (GetDriveTypeA(root.c_str()) == DRIVE_REMOTE) {
+                return false;
+            }
+        }
+#elif defined(__linux__)
+        struct statfs buf;
+        if (statfs(filename.c_str(), &buf) == 0) {
+            switch ((unsigned int)buf.f_type) {
+                case 0x6969:     // NFS
+                case 0x517B:     // SMB
+                case 0xFF534D42: // CIFS
+                case 0xFE534D42: // SMB2
+                case 0x65735546: // FUSE
+                    return false;
+                default:
+                    break;
+            }
+        }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+        struct statfs buf;
+        if (statfs(filename.c_str(), &buf) == 0 && !(buf.f_flags & MNT_LOCAL)) {
+            return false;
+        }
+#endif
+        (void)filename;
+        return true;
+    }
+
+private:
+#ifdef _WIN32
+    MappedFile(const char* data, std::size_t size, HANDLE file, HANDLE mapping)
+    : _data(data)
+    , _size(size)
+    , _file(file)
+    , _mapping(mapping)
+    {
+    }
+
+    static std::wstring widen(const std::string& s)
+    {
+        const int len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), (int)s.length() + 1, 0, 0);
+        if (len <= 0) {
+            return std::wstring();
+        }
+        std::wstring r(len, L'\0');
+        MultiByteToWideChar(CP_ACP, 0, s.c_str(), (int)s.length() + 1, &r[0], len);
+        r.resize(len - 1);
+        return r;
+    }
+#else
+    MappedFile(const char* data, std::size_t size)
+    : _data(data)
+    , _size(size)
+    {
+    }
+#endif
+
+    // non-copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* _data;
+    std::size_t _size;
+#ifdef _WIN32
+    HANDLE _file;
+    HANDLE _mapping;
+#endif
+};
+
+} // namespace IO
+
+#endif
@@ -0,0 +1,231 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O scratch memory pool.
+ * Reuses the temporary buffers allocated at each render, so that a sequence of renders
+ * of the same size (playback, batch rendering) does not allocate memory at each frame.
+ */
+
+#ifndef IO_MemoryPool_h
+#define IO_MemoryPool_h
+
+#include <cassert>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+
+namespace IO {
+
+/**
+ * @brief A pool of OFX::ImageMemory blocks, owned by an effect instance.
+ *
+ * Blocks are rounded up to a size class (a quarter of a power of two), and released blocks
+ * are kept (unlocked, so that the host may still reclaim them) for the next acquisitions
+ * of the same size class.
+ * The cached blocks are trimmed so that the pool never holds more than twice the maximum
+ * amount of memory that was used simultaneously (the high-water mark).
+ **/
+class MemoryPool
+{
+public:
+    explicit MemoryPool(OFX::ImageEffect* effect = 0)
+    : _effect(effect)
+    , _lock()
+    , _free()
+    , _used()
+    , _usedBytes(0)
+    , _freeBytes(0)
+    , _highWater(0)
+    , _peakBytes(0)
+    {
+    }
+
+    ~MemoryPool()
+    {
+        // all blocks should have been released
+        assert(_used.empty());
+        for (std::map<void*, Block>::iterator it = _used.begin(); it != _used.end(); ++it) {
+            delete it->second.mem;
+        }
+        for (std::list<Block>::iterator it = _free.begin(); it != _free.end(); ++it) {
+            delete it->mem;
+        }
+    }
+
+    /// get a locked buffer of at least nBytes bytes. Throws if the memory cannot be allocated.
+    void* acquire(std::size_t nBytes)
+    {
+        const std::size_t size = sizeClass(nBytes);
+        OFX::MultiThread::AutoMutex l(_lock);
+        Block block;
+        block.mem = 0;
+        for (std::list<Block>::iterator it = _free.begin(); it != _free.end(); ++it) {
+            if (it->size == size) {
+                block = *it;
+                _free.erase(it);
+                _freeBytes -= size;
+                break;
+            }
+        }
+        if (!block.mem) {
+            block.size = size;
+            block.mem = new OFX::ImageMemory(size, _effect);
+        }
+        void* ptr = 0;
+        try {
+            ptr = block.mem->lock();
+        } catch (...) {
+            delete block.mem;
+            throw;
+        }
+        _used[ptr] = block;
+        _usedBytes += size;
+        _highWater = std::max(_highWater, _usedBytes);
+        _peakBytes = std::max(_peakBytes, _usedBytes + _freeBytes);
+        trimToHighWater();
+
+        return ptr;
+    }
+
+    /// give back a buffer obtained from acquire()
+    void release(void* ptr)
+    {
+        OFX::MultiThread::AutoMutex l(_lock);
+        std::map<void*, Block>::iterator it = _used.find(ptr);
+        assert(it != _used.end());
+        if (it == _used.end()) {
+            return;
+        }
+        Block block = it->second;
+        _used.erase(it);
+        _usedBytes -= block.size;
+        block.mem->unlock();
+        _free.push_front(block);
+        _freeBytes += block.size;
+        trimToHighWater();
+    }
+
+    /// free all the cached blocks, and reset the high-water mark (e.g. from purgeCaches())
+    void trim()
+    {
+        OFX::MultiThread::AutoMutex l(_lock);
+        _highWater = _usedBytes;
+        while (!_free.empty()) {
+            _freeBytes -= _free.back().size;
+            delete _free.back().mem;
+            _free.pop_back();
+        }
+    }
+
+    /// the maximum amount of memory held by the pool
+    std::size_t getPeakBytes() const
+    {
+        OFX::MultiThread::AutoMutex l(_lock);
+        return _peakBytes;
+    }
+
+private:
+    struct Block
+    {
+        std::size_t size;
+        OFX::ImageMemory* mem;
+    };
+
+    static std::size_t sizeClass(std::size_t nBytes)
+    {
+        std::size_t p = 4096;
+        if (nBytes <= p) {
+            return p;
+        }
+        while (p <= nBytes / 2) {
+            p *= 2;
+        }
+        // p <= nBytes < 2p: round up to a multiple of p/4
+        const std::size_t step = p / 4;
+        return (nBytes + step - 1) / step * step;
+    }
+
+    // _lock must be held
+    void trimToHighWater()
+    {
+        // free the least recently released blocks. Twice the high-water mark leaves room for
+        // blocks of different sizes that are used one after the other.
+        while (!_free.empty() && _usedBytes + _freeBytes > 2 * _highWater) {
+            _freeBytes -= _free.back().size;
+            delete _free.back().mem;
+            _free.pop_back();
+        }
+    }
+
+private:
+    // non-copyable
+    MemoryPool(const MemoryPool&);
+    MemoryPool& operator=(const MemoryPool&);
+
+    OFX::ImageEffect* _effect;
+    mutable OFX::MultiThread::Mutex _lock;
+    std::list<Block> _free; // most recently released first
+    std::map<void*, Block> _used;
+    std::size_t _usedBytes;
+    std::size_t _freeBytes;
+    std::size_t _highWater; // the maximum of _usedBytes since the last trim()
+    std::size_t _peakBytes;
+};
+
+/**
+ * @brief A buffer from a MemoryPool, with the same interface as OFX::ImageMemory.
+ **/
+class PooledMemory
+{
+public:
+    PooledMemory(std::size_t nBytes, MemoryPool& pool)
+    : _pool(pool)
+    , _ptr(pool.acquire(nBytes))
+    {
+    }
+
+    ~PooledMemory()
+    {
+        _pool.release(_ptr);
+    }
+
+    void* lock()
+    {
+        return _ptr;
+    }
+
+    void unlock()
+    {
+    }
+
+private:
+    PooledMemory(const PooledMemory&);
+    PooledMemory& operator=(const PooledMemory&);
+
+    MemoryPool& _pool;
+    void* _ptr;
+};
+
+} // namespace IO
+
+#endif
@@ -0,0 +1,259 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O threading utilities.
+ * Minimal portable threads, mutexes and condition variables, for the background
+ * workers of the readers (the OFX MultiThread suite only provides blocking
+ * parallel-for and mutexes that cannot be waited upon).
+ */
+
+#ifndef IO_Thread_h
+#define IO_Thread_h
+
+#include <cassert>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace IO {
+
+class Condition;
+
+class Mutex
+{
+    friend class Condition;
+public:
+    Mutex()
+    {
+#ifdef _WIN32
+        InitializeCriticalSection(&_mutex);
+#else
+        pthread_mutex_init(&_mutex, NULL);
+#endif
+    }
+
+    ~Mutex()
+    {
+#ifdef _WIN32
+        DeleteCriticalSection(&_mutex);
+#else
+        pthread_mutex_destroy(&_mutex);
+#endif
+    }
+
+    void lock()
+    {
+#ifdef _WIN32
+        EnterCriticalSection(&_mutex);
+#else
+        pthread_mutex_lock(&_mutex);
+#endif
+    }
+
+    void unlock()
+    {
+#ifdef _WIN32
+        LeaveCriticalSection(&_mutex);
+#else
+        pthread_mutex_unlock(&_mutex);
+#endif
+    }
+
+private:
+    // non-copyable
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+#ifdef _WIN32
+    CRITICAL_SECTION _mutex;
+#else
+    pthread_mutex_t _mutex;
+#endif
+};
+
+class AutoMutex
+{
+public:
+    explicit AutoMutex(Mutex& m)
+    : _mutex(m)
+    {
+        _mutex.lock();
+    }
+
+    ~AutoMutex()
+    {
+        _mutex.unlock();
+    }
+
+private:
+    AutoMutex(const AutoMutex&);
+    AutoMutex& operator=(const AutoMutex&);
+
+    Mutex& _mutex;
+};
+
+class Condition
+{
+public:
+    Condition()
+    {
+#ifdef _WIN32
+        InitializeConditionVariable(&_cond);
+#else
+        pthread_cond_init(&_cond, NULL);
+#endif
+    }
+
+    ~Condition()
+    {
+#ifndef _WIN32
+        pthread_cond_destroy(&_cond);
+#endif
+    }
+
+    // the mutex must be locked by the calling thread
+    void wait(Mutex& m)
+    {
+#ifdef _WIN32
+        SleepConditionVariableCS(&_cond, &m._mutex, INFINITE);
+#else
+        pthread_cond_wait(&_cond, &m._mutex);
+#endif
+    }
+
+    void wakeOne()
+    {
+#ifdef _WIN32
+        WakeConditionVariable(&_cond);
+#else
+        pthread_cond_signal(&_cond);
+#endif
+    }
+
+    void wakeAll()
+    {
+#ifdef _WIN32
+        WakeAllConditionVariable(&_cond);
+#else
+        pthread_cond_broadcast(&_cond);
+#endif
+    }
+
+private:
+    Condition(const Condition&);
+    Condition& operator=(const Condition&);
+
+#ifdef _WIN32
+    CONDITION_VARIABLE _cond;
+#else
+    pthread_cond_t _cond;
+#endif
+};
+
+class Thread
+{
+public:
+    typedef void (*Function)(void* arg);
+
+    Thread()
+    : _func(0)
+    , _arg(0)
+    , _running(false)
+    {
+    }
+
+    ~Thread()
+    {
+        // the owner must join the thread before destroying it
+        assert(!_running);
+    }
+
+    // start the thread. Returns false on failure.
+    bool start(Function func, void* arg)
+    {
+        assert(!_running);
+        _func = func;
+        _arg = arg;
+#ifdef _WIN32
+        _thread = CreateThread(NULL, 0, &Thread::trampoline, this, 0, NULL);
+        _running = (_thread != NULL);
+#else
+        _running = (pthread_create(&_thread, NULL, &Thread::trampoline, this) == 0);
+#endif
+        return _running;
+    }
+
+    void join()
+    {
+        if (!_running) {
+            return;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(_thread, INFINITE);
+        CloseHandle(_thread);
+#else
+        pthread_join(_thread, NULL);
+#endif
+        _running = false;
+    }
+
+    bool isRunning() const
+    {
+        return _running;
+    }
+
+private:
+    Thread(const Thread&);
+    Thread& operator=(const Thread&);
+
+#ifdef _WIN32
+    static DWORD WINAPI trampoline(LPVOID self)
+    {
+        Thread* t = static_cast<Thread*>(self);
+        t->_func(t->_arg);
+        return 0;
+    }
+#else
+    static void* trampoline(void* self)
+    {
+        Thread* t = static_cast<Thread*>(self);
+        t->_func(t->_arg);
+        return NULL;
+    }
+#endif
+
+    Function _func;
+    void* _arg;
+    bool _running;
+#ifdef _WIN32
+    HANDLE _thread;
+#else
+    pthread_t _thread;
+#endif
+};
+
+} // namespace IO
+
+#endif
@@ -44,9 +44,12 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
 
 #include "ofxsImageEffect.h"
 
+#include "IOHalf.h"
+
 /// numvals should be 256 for byte, 65536 for 16-bits, etc.
 template<int numvals>
 float intToFloat(int value)
@@ -36,6 +36,7 @@
 #include "ofxsMacros.h"
 
 #include "GenericOCIO.h"
+#include "IOMemoryPool.h"
 
 namespace OCIO = OCIO_NAMESPACE;
 
@@ -141,6 +142,12 @@ public:
     /* override changedParam */
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /* override purgeCaches: free the scratch buffers kept for the next render */
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _memoryPool.trim();
+    }
+
     /* override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
@@ -304,6 +311,7 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 };
 
 OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
@@ -327,6 +335,7 @@ OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
 , _mix(0)
 , _maskApply(0)
 , _maskInvert(0)
+, _memoryPool(this)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     assert(_dstClip && (_dstClip->getPixelComponents() == OFX::ePixelComponentRGBA ||
@@ -671,7 +680,7 @@ OCIOCDLTransformPlugin::render(const OFX::RenderArguments &args)
     int pixelBytes = pixelComponentCount * getComponentBytes(srcBitDepth);
     int tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
-    OFX::ImageMemory mem(memSize,this);
+    IO::PooledMemory mem(memSize, _memoryPool);
     float *tmpPixelData = (float*)mem.lock();
 
     bool premult;
@@ -29,6 +29,7 @@
 #include <memory>
 
 #include <GenericOCIO.h>
+#include "IOMemoryPool.h"
 
 #include "ofxsProcessing.H"
 #include "ofxsCopier.h"
@@ -66,6 +67,12 @@ public:
     /* override changedParam */
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /* override purgeCaches: free the scratch buffers kept for the next render */
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _memoryPool.trim();
+    }
+
     /* override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
@@ -225,6 +232,7 @@ private:
     OFX::BooleanParam* _maskInvert;
 
     std::auto_ptr<GenericOCIO> _ocio;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 };
 
 OCIOColorSpacePlugin::OCIOColorSpacePlugin(OfxImageEffectHandle handle)
@@ -237,6 +245,7 @@ OCIOColorSpacePlugin::OCIOColorSpacePlugin(OfxImageEffectHandle handle)
 , _mix(0)
 , _maskInvert(0)
 , _ocio(new GenericOCIO(this))
+, _memoryPool(this)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     assert(_dstClip && (_dstClip->getPixelComponents() == OFX::ePixelComponentRGBA ||
@@ -498,7 +507,7 @@ OCIOColorSpacePlugin::render(const OFX::RenderArguments &args)
     int pixelBytes = pixelComponentCount * getComponentBytes(srcBitDepth);
     int tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
-    OFX::ImageMemory mem(memSize,this);
+    IO::PooledMemory mem(memSize, _memoryPool);
     float *tmpPixelData = (float*)mem.lock();
 
     bool premult;
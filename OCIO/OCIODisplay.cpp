@@ -34,6 +34,7 @@
 #include "ofxsMacros.h"
 #include "IOUtility.h"
 #include "GenericOCIO.h"
+#include "IOMemoryPool.h"
 
 #define kPluginName "OCIODisplayOFX"
 #define kPluginGrouping "Color/OCIO"
@@ -156,6 +157,12 @@ public:
     /* override changedParam */
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /* override purgeCaches: free the scratch buffers kept for the next render */
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _memoryPool.trim();
+    }
+
     /* override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
@@ -309,6 +316,7 @@ private:
     OFX::ChoiceParam* _channel;
 
     std::auto_ptr<GenericOCIO> _ocio;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 };
 
 OCIODisplayPlugin::OCIODisplayPlugin(OfxImageEffectHandle handle)
@@ -323,6 +331,7 @@ OCIODisplayPlugin::OCIODisplayPlugin(OfxImageEffectHandle handle)
 , _gamma(0)
 , _channel(0)
 , _ocio(new GenericOCIO(this))
+, _memoryPool(this)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     assert(_dstClip && (_dstClip->getPixelComponents() == OFX::ePixelComponentRGBA ||
@@ -763,7 +772,7 @@ OCIODisplayPlugin::render(const OFX::RenderArguments &args)
     int pixelBytes = pixelComponentCount * getComponentBytes(srcBitDepth);
     int tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
-    OFX::ImageMemory mem(memSize,this);
+    IO::PooledMemory mem(memSize, _memoryPool);
     float *tmpPixelData = (float*)mem.lock();
 
     bool premult;
@@ -42,6 +42,7 @@
 #include "ofxsMacros.h"
 #include "ofxsCoords.h"
 #include "GenericOCIO.h"
+#include "IOMemoryPool.h"
 
 namespace OCIO = OCIO_NAMESPACE;
 
@@ -114,6 +115,12 @@ public:
     /* override changedParam */
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /* override purgeCaches: free the scratch buffers kept for the next render */
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _memoryPool.trim();
+    }
+
     /* override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
@@ -267,6 +274,7 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 };
 
 OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
@@ -274,6 +282,7 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
 , _dstClip(0)
 , _srcClip(0)
 , _maskClip(0)
+, _memoryPool(this)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     assert(_dstClip && (_dstClip->getPixelComponents() == OFX::ePixelComponentRGBA ||
@@ -598,7 +607,7 @@ OCIOFileTransformPlugin::render(const OFX::RenderArguments &args)
     int pixelBytes = pixelComponentCount * getComponentBytes(srcBitDepth);
     int tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
-    OFX::ImageMemory mem(memSize,this);
+    IO::PooledMemory mem(memSize, _memoryPool);
     float *tmpPixelData = (float*)mem.lock();
 
     bool premult;
@@ -35,6 +35,7 @@
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
 #include "GenericOCIO.h"
+#include "IOMemoryPool.h"
 
 namespace OCIO = OCIO_NAMESPACE;
 
@@ -76,6 +77,12 @@ public:
     /* override changedParam */
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /* override purgeCaches: free the scratch buffers kept for the next render */
+    virtual void purgeCaches(void) OVERRIDE FINAL
+    {
+        _memoryPool.trim();
+    }
+
     /* override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
@@ -228,6 +235,7 @@ private:
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
     OCIO_NAMESPACE::ConstConfigRcPtr _config;
+    IO::MemoryPool _memoryPool; //< the render-time scratch buffers
 };
 
 OCIOLogConvertPlugin::OCIOLogConvertPlugin(OfxImageEffectHandle handle)
@@ -235,6 +243,7 @@ OCIOLogConvertPlugin::OCIOLogConvertPlugin(OfxImageEffectHandle handle)
 , _dstClip(0)
 , _srcClip(0)
 , _maskClip(0)
+, _memoryPool(this)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     assert(_dstClip && (_dstClip->getPixelComponents() == OFX::ePixelComponentRGBA ||
@@ -555,7 +564,7 @@ OCIOLogConvertPlugin::render(const OFX::RenderArguments &args)
     int pixelBytes = pixelComponentCount * getComponentBytes(srcBitDepth);
     int tmpRowBytes = (args.renderWindow.x2-args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2-args.renderWindow.y1) * tmpRowBytes;
-    OFX::ImageMemory mem(memSize,this);
+    IO::PooledMemory mem(memSize, _memoryPool);
     float *tmpPixelData = (float*)mem.lock();
 
     bool premult;
@@ -76,6 +76,8 @@ GCC_DIAG_ON(unused-parameter)
 #define kSupportsTiles false
 #endif
 #define kIsMultiPlanar true
+// decodePlane() reads the channel and layer parameters, and reports errors with persistent messages
+#define kSupportsPrefetch false
 
 
 
@@ -218,7 +220,20 @@ private:
     }
     
     virtual void decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
-                             OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes) OVERRIDE FINAL;
+                             OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes) OVERRIDE FINAL
+    {
+        decodePlaneAtMipmapLevel(filename, time, view, isPlayback, 0, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    }
+
+    virtual bool decodeAtMipmapLevel(const std::string& filename, OfxTime time, int view, bool isPlayback, unsigned int mipmapLevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                     OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes) OVERRIDE FINAL
+    {
+        return decodePlaneAtMipmapLevel(filename, time, view, isPlayback, mipmapLevel, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    }
+
+    /// Decode from the given MIP level of the file. Returns false if the file has no such level.
+    bool decodePlaneAtMipmapLevel(const std::string& filename, OfxTime time, int view, bool isPlayback, unsigned int mipmapLevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                  OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
     
     void getOIIOChannelIndexesFromLayerName(const std::string& filename, int view, const std::string& layerName, OFX::PixelComponentEnum pixelComponents, std::vector<int>& channels, int& numChannels, int& subImageIndex);
     
@@ -226,6 +241,8 @@ private:
 
     virtual bool getFrameBounds(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
 
+    virtual OFX::BitDepthEnum getFrameBitDepth(const std::string& filename, OfxTime time) OVERRIDE FINAL;
+
     virtual void onOutputComponentsParamChanged(OFX::PixelComponentEnum components) OVERRIDE FINAL;
     
     virtual void restoreState(const std::string& filename) OVERRIDE FINAL;
@@ -428,6 +445,10 @@ void ReadOIIOPlugin::updateChannelMenusVisibility(OFX::PixelComponentEnum output
 
 void ReadOIIOPlugin::changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName)
 {
+    if (paramName != kParamShowMetadata && args.reason != OFX::eChangeTime) {
+        // the channel parameters change the decoded images
+        clearFrameCache();
+    }
     if (paramName == kParamShowMetadata) {
         std::string filename;
         OfxStatus st = getFilenameAtTime(args.time, &filename);
@@ -1995,13 +2016,18 @@ ReadOIIOPlugin::getOIIOChannelIndexesFromLayerName(const std::string& filename,
 
 }
 
-void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes)
+bool
+ReadOIIOPlugin::decodePlaneAtMipmapLevel(const std::string& filename, OfxTime time, int view, bool isPlayback, unsigned int mipmapLevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes)
 {
 #ifdef OFX_READ_OIIO_USES_CACHE
     bool useCache = !isPlayback;
 #else
     bool useCache = false;
 #endif
+    if (mipmapLevel > 0) {
+        // the MIP levels are read using ImageInput
+        useCache = false;
+    }
     
     
     //assert(kSupportsTiles || (renderWindow.x1 == 0 && renderWindow.x2 == spec.full_width && renderWindow.y1 == 0 && renderWindow.y2 == spec.full_height));
@@ -2014,7 +2040,7 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
         && pixelComponents != OFX::ePixelComponentCustom) {
         setPersistentMessage(OFX::Message::eMessageError, "", "OIIO: can only read RGBA, RGB, Alpha or custom components images");
         OFX::throwSuiteStatusException(kOfxStatErrFormat);
-        return;
+        return false;
     }
     
     std::vector<int> channels;
@@ -2125,7 +2151,7 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
                 } else {
                     setPersistentMessage(OFX::Message::eMessageError, "", "Failure to find requested layer in file");
                     OFX::throwSuiteStatusException(kOfxStatFailed);
-                    return;
+                    return false;
                 }
             }
         }
@@ -2167,7 +2193,7 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
                     if (!found) {
                         setPersistentMessage(OFX::Message::eMessageError, "", "Could not find channel named " + layerChannels[i+1]);
                         OFX::throwSuiteStatusException(kOfxStatFailed);
-                        return;
+                        return false;
                     }
                 }
             }
@@ -2184,6 +2210,30 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
         }
         
     }
+
+    if (mipmapLevel > 0) {
+        // only use the MIP level if it is exactly the image downscaled by the render scale
+        // (see downscalePowerOfTwoSmallestEnclosing()), and the data window is the display window.
+        // The image size must be a multiple of the scale: for odd sizes the file level is rounded up,
+        // so its rows would not be aligned with those of the downscaled image, which is flipped
+        // against the top edge of the full-resolution image.
+        ImageSpec levelSpec;
+        const int scale = 1 << mipmapLevel;
+        if (!img.get() ||
+            spec.x != 0 || spec.y != 0 || spec.full_x != 0 || spec.full_y != 0 ||
+            spec.width != spec.full_width || spec.height != spec.full_height ||
+            spec.width % scale != 0 || spec.height % scale != 0 ||
+            !img->seek_subimage(subImageIndex, mipmapLevel, levelSpec) ||
+            levelSpec.x != 0 || levelSpec.y != 0 ||
+            levelSpec.width != spec.width / scale ||
+            levelSpec.height != spec.height / scale) {
+            if (img.get()) {
+                img->close();
+            }
+            return false;
+        }
+        spec = levelSpec;
+    }
     
     size_t pixelDataOffset = (size_t)(renderWindow.y1 - bounds.y1) * rowBytes + (size_t)(renderWindow.x1 - bounds.x1) * pixelBytes;
 
@@ -2243,7 +2293,7 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
 #                                     endif
                                         )) {
                     setPersistentMessage(OFX::Message::eMessageError, "", _cache->geterror());
-                    return;
+                    return true;
                 }
             } else // warning: '{' must follow #endif
 #         endif
@@ -2283,6 +2333,8 @@ void ReadOIIOPlugin::decodePlane(const std::string& filename, OfxTime time, int
     if (!useCache) {
         img->close();
     }
+
+    return true;
 }
 
 bool
@@ -2383,6 +2435,68 @@ ReadOIIOPlugin::getFrameBounds(const std::string& filename,
     return true;
 }
 
+// the OFX bit depth that holds a channel of the given type without loss
+static OFX::BitDepthEnum
+bitDepthFromTypeDesc(const TypeDesc& format)
+{
+    switch (format.basetype) {
+        case TypeDesc::UCHAR:
+            return OFX::eBitDepthUByte;
+        case TypeDesc::USHORT:
+            return OFX::eBitDepthUShort;
+        case TypeDesc::HALF:
+            return OFX::eBitDepthHalf;
+        default:
+            // signed, 32-bit and floating point types
+            return OFX::eBitDepthFloat;
+    }
+}
+
+OFX::BitDepthEnum
+ReadOIIOPlugin::getFrameBitDepth(const std::string& filename,
+                                 OfxTime /*time*/)
+{
+    ImageSpec spec;
+# ifdef OFX_READ_OIIO_USES_CACHE
+    if (!_cache->get_imagespec(ustring(filename), spec, 0)) {
+        return OFX::eBitDepthFloat;
+    }
+# else
+    std::auto_ptr<ImageInput> img(ImageInput::open(filename));
+    if (!img.get()) {
+        return OFX::eBitDepthFloat;
+    }
+    spec = img->spec();
+    img->close();
+# endif
+    if (spec.channelformats.empty()) {
+        return bitDepthFromTypeDesc(spec.format);
+    }
+    // the channels may have different formats: take the one that needs the largest depth
+    bool hasUShort = false;
+    bool hasHalf = false;
+    for (std::size_t i = 0; i < spec.channelformats.size(); ++i) {
+        switch (bitDepthFromTypeDesc(spec.channelformats[i])) {
+            case OFX::eBitDepthUByte:
+                break;
+            case OFX::eBitDepthUShort:
+                hasUShort = true;
+                break;
+            case OFX::eBitDepthHalf:
+                hasHalf = true;
+                break;
+            default:
+                return OFX::eBitDepthFloat;
+        }
+    }
+    if (hasUShort && hasHalf) {
+        // half cannot represent 16-bit integers exactly
+        return OFX::eBitDepthFloat;
+    }
+
+    return hasHalf ? OFX::eBitDepthHalf : (hasUShort ? OFX::eBitDepthUShort : OFX::eBitDepthUByte);
+}
+
 std::string
 ReadOIIOPlugin::metadata(const std::string& filename)
 {
@@ -2664,7 +2778,7 @@ void ReadOIIOPluginFactory<useRGBAChoices>::describeInContext(OFX::ImageEffectDe
     gHostSupportsMultiPlane = (OFX::fetchSuite(kFnOfxImageEffectPlaneSuite, 2)) != 0;
     
     // make some pages and to things in
-    PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(), kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles);
+    PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(), kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles, kSupportsPrefetch);
 
     {
         OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamShowMetadata);
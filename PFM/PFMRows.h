@@ -0,0 +1,161 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX PFM row conversions.
+ * Converts the rows of an OFX image to the samples of a PFM file, and back. PFM rows are
+ * stored from bottom to top, like the OFX images, so that row y of the file is row y of the image.
+ */
+
+#ifndef IO_PFMRows_h
+#define IO_PFMRows_h
+
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#include "IOByteSwap.h"
+
+namespace PFM {
+
+template <class PIX, int srcC, int dstC>
+void copyLine(const PIX *srcPix, int n, PIX *dstPix)
+{
+    for(int x = 0; x < n; ++x) {
+        if(srcC == 1) {
+            // alpha/grayscale image
+            for (int c = 0; c < std::min(dstC,3); ++c) {
+                dstPix[c] = srcPix[0];
+            }
+        } else {
+            // color image (if dstC == 1, only the red channel is extracted)
+            for (int c = 0; c < std::min(dstC,3); ++c) {
+                dstPix[c] = srcPix[c];
+            }
+        }
+        if (dstC == 4) {
+            // Alpha is 0 on RGBA images to allow adding alpha using a Roto node.
+            // Alpha is set to 0 and premult is set to Opaque.
+            // That way, the Roto node can be conveniently used to draw a mask. This shouldn't
+            // disturb anything else in the process, since Opaque premult means that alpha should
+            // be considered as being 1 everywhere, whatever the actual alpha value is.
+            // see GenericWriterPlugin::render, if (userPremult == OFX::eImageOpaque...
+            dstPix[3] = 0.f; // alpha
+        }
+
+        srcPix += srcC;
+        dstPix += dstC;
+    }
+}
+
+template <class PIX, int srcC>
+void copyLine(const PIX *srcPix, int n, int dstC, PIX *dstPix)
+{
+    switch (dstC) {
+        case 1:
+            copyLine<PIX,srcC,1>(srcPix, n, dstPix);
+            break;
+        case 2:
+            copyLine<PIX,srcC,2>(srcPix, n, dstPix);
+            break;
+        case 3:
+            copyLine<PIX,srcC,3>(srcPix, n, dstPix);
+            break;
+        case 4:
+            copyLine<PIX,srcC,4>(srcPix, n, dstPix);
+            break;
+        default:
+            break;
+    }
+}
+
+/// convert the rows [y1,y2) of an image of the given width, with spectrum components per pixel,
+/// to the samples of a PFM file with depth (1 or 3) components per pixel.
+/// RGBA pixels lose their alpha.
+inline void imageToSamples(const float* pixelData,
+                           int rowBytes,
+                           int width,
+                           int spectrum,
+                           int depth,
+                           int y1,
+                           int y2,
+                           float* samples)
+{
+    for (int y = y1; y < y2; ++y) {
+        const float* srcPix = (const float*)((const char*)pixelData + (std::ptrdiff_t)y * rowBytes);
+        float* dstPix = samples + (std::size_t)y * width * depth;
+        if (spectrum == depth) {
+            std::memcpy(dstPix, srcPix, (std::size_t)width * depth * sizeof(float));
+        } else {
+            assert(spectrum == 4 && depth == 3);
+            copyLine<float,4,3>(srcPix, width, dstPix);
+        }
+    }
+}
+
+/// convert the rows [y1,y2) and columns [x1,x2) of the samples of a PFM file with srcComps
+/// (1 or 3) components per pixel to the pixels of an image with nComps components per pixel.
+/// srcData points to the row srcY1 of the file, and pixelData to the pixel (boundsX1,boundsY1)
+/// of the image. The samples are byte swapped if byteSwap is true.
+/// row is a scratch buffer of (x2-x1)*srcComps floats, used when the components are expanded.
+inline void samplesToImage(const char* srcData,
+                           int srcY1,
+                           std::size_t srcRowBytes,
+                           int srcComps,
+                           bool byteSwap,
+                           int x1,
+                           int x2,
+                           int y1,
+                           int y2,
+                           float* pixelData,
+                           int boundsX1,
+                           int boundsY1,
+                           int nComps,
+                           int rowBytes,
+                           float* row)
+{
+    const int width = x2 - x1;
+    const std::size_t n = (std::size_t)width * srcComps;
+    for (int y = y1; y < y2; ++y) {
+        const char* src = srcData + (std::size_t)(y - srcY1) * srcRowBytes + (std::size_t)x1 * srcComps * sizeof(float);
+        float* dst = (float*)((char*)pixelData + (std::ptrdiff_t)(y - boundsY1) * rowBytes) + (std::ptrdiff_t)(x1 - boundsX1) * nComps;
+        if (srcComps == nComps) {
+            if (byteSwap) {
+                IO::byteSwapCopy(src, dst, n);
+            } else {
+                std::memcpy(dst, src, n * sizeof(float));
+            }
+            continue;
+        }
+        if (byteSwap) {
+            IO::byteSwapCopy(src, row, n);
+        } else {
+            std::memcpy(row, src, n * sizeof(float));
+        }
+        if (srcComps == 1) {
+            copyLine<float,1>(row, width, nComps, dst);
+        } else {
+            copyLine<float,3>(row, width, nComps, dst);
+        }
+    }
+}
+
+} // namespace PFM
+
+#endif
@@ -24,16 +24,28 @@
 #include "ReadPFM.h"
 
 #include <cstdio> // fopen, fread...
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #ifdef OFX_IO_USING_OCIO
 #include <OpenColorIO/OpenColorIO.h>
 #endif
 
+#include "ofxsMultiThread.h"
+
 #include "GenericReader.h"
 #include "GenericOCIO.h"
+#include "IOMappedFile.h"
+#include "IOUtility.h"
 #include "ofxsMacros.h"
 
+#include "PFMRows.h"
+
 #define kPluginName "ReadPFMOFX"
 #define kPluginGrouping "Image/Readers"
 #define kPluginDescription "Read PFM (Portable Float Map) files."
@@ -44,7 +56,12 @@
 #define kSupportsRGBA true
 #define kSupportsRGB true
 #define kSupportsAlpha true
-#define kSupportsTiles false
+#define kSupportsTiles true
+#define kSupportsPrefetch true
+
+// set to 1 to memory-map the PFM files instead of reading them with stdio (local files only).
+// A mapped file truncated by another process while it is read crashes the host.
+#define kMmapEnvVar "OFX_IO_PFM_MMAP"
 
 class ReadPFMPlugin : public GenericReaderPlugin
 {
@@ -62,6 +79,10 @@ private:
 
     virtual bool getFrameBounds(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
 
+    virtual bool getFrameBoundsForPrefetch(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par) OVERRIDE FINAL;
+
+    virtual bool decodeForPrefetch(const std::string& filename, OfxTime time, int view, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes) OVERRIDE FINAL;
+
     virtual void onInputFileChanged(const std::string& newFile, bool setColorSpace, OFX::PreMultiplicationEnum *premult, OFX::PixelComponentEnum *components, int *componentCount) OVERRIDE FINAL;
 
 };
@@ -76,35 +97,136 @@ static inline bool endianness()
     return ((unsigned char *)&x)[0] ? false : true;
 }
 
-//! Invert endianness of a memory buffer.
-template<typename T>
-static void invert_endianness(T *const buffer, const unsigned int size)
+struct PFMHeader
+{
+    char type;
+    int width;
+    int height;
+    int nComps;
+    double scale;
+    bool hasScale;
+    std::size_t dataOffset; ///< offset of the first (bottom) row of samples in the file
+};
+
+enum PFMHeaderStatusEnum
+{
+    ePFMHeaderOK = 0,
+    ePFMHeaderIncomplete, // more data is needed to parse the header
+    ePFMHeaderNoType,
+    ePFMHeaderNoSize,
+    ePFMHeaderInvalidSize
+};
+
+// get the next header line that is neither empty nor a comment, without its leading whitespace.
+// *pos is left on the '\n' ending the line.
+static bool
+nextHeaderLine(const char* data, std::size_t size, std::size_t* pos, std::string* line)
 {
-    if (size) {
-        switch (sizeof(T)) {
-            case 1:
-                break;
-            case 2:
-                for (unsigned short *ptr = (unsigned short *)buffer + size; ptr > (unsigned short *)buffer;) {
-                    const unsigned short val = *(--ptr);
-                    *ptr = (unsigned short)((val >> 8) | ((val << 8)));
-                }
-                break;
-            case 4:
-                for (unsigned int *ptr = (unsigned int *)buffer + size; ptr > (unsigned int *)buffer;) {
-                    const unsigned int val = *(--ptr);
-                    *ptr = (val >> 24) | ((val >> 8) & 0xff00) | ((val << 8) & 0xff0000) | (val << 24);
-                }
-                break;
-            default:
-                for (T *ptr = buffer + size; ptr > buffer;) {
-                    unsigned char *pb = (unsigned char *)(--ptr), *pe = pb + sizeof(T);
-                    for (int i = 0; i < (int)sizeof(T) / 2; ++i) {
-                        std::swap(*(pb++), *(--pe));
-                    }
-                }
+    std::size_t p = *pos;
+    for (;;) {
+        while (p < size && (data[p] == ' ' || data[p] == '\t' || data[p] == '\r' || data[p] == '\n')) {
+            ++p;
         }
+        if (p < size && data[p] == '#') {
+            while (p < size && data[p] != '\n') {
+                ++p;
+            }
+        } else {
+            break;
+        }
+    }
+    const std::size_t start = p;
+    while (p < size && data[p] != '\n') {
+        ++p;
+    }
+    if (p >= size) {
+        return false;
     }
+    line->assign(data + start, p - start);
+    *pos = p;
+    return true;
+}
+
+// parse the header from the first size bytes of a file (or from the whole file if complete is true)
+static PFMHeaderStatusEnum
+parseHeader(const char* data, std::size_t size, bool complete, PFMHeader* header)
+{
+    std::size_t pos = 0;
+    std::string line;
+    if (!nextHeaderLine(data, size, &pos, &line)) {
+        return complete ? ePFMHeaderNoType : ePFMHeaderIncomplete;
+    }
+    if (std::sscanf(line.c_str(), " P%c", &header->type) != 1) {
+        return ePFMHeaderNoType;
+    }
+    if (!nextHeaderLine(data, size, &pos, &line)) {
+        return complete ? ePFMHeaderNoSize : ePFMHeaderIncomplete;
+    }
+    if (std::sscanf(line.c_str(), " %d %d", &header->width, &header->height) != 2) {
+        return ePFMHeaderNoSize;
+    }
+    if (header->width <= 0 || header->height <= 0 || 0xffff < header->width || 0xffff < header->height) {
+        return ePFMHeaderInvalidSize;
+    }
+    header->nComps = (header->type == 'F') ? 3 : 1;
+    if (!nextHeaderLine(data, size, &pos, &line)) {
+        if (!complete) {
+            return ePFMHeaderIncomplete;
+        }
+        // no samples either: decoding will fail
+        header->scale = 0.;
+        header->hasScale = false;
+        header->dataOffset = size;
+        return ePFMHeaderOK;
+    }
+    header->hasScale = (std::sscanf(line.c_str(), "%lf", &header->scale) == 1);
+    if (!header->hasScale) {
+        header->scale = 0.;
+    }
+    // the samples start right after the end of the scale line
+    header->dataOffset = pos + 1;
+    return ePFMHeaderOK;
+}
+
+// read the header at the beginning of a file
+static PFMHeaderStatusEnum
+readHeader(std::FILE* nfile, PFMHeader* header)
+{
+    const std::size_t chunk = 4096;
+    std::vector<char> buf;
+    std::size_t size = 0;
+    for (;;) {
+        buf.resize(size + chunk);
+        const std::size_t numread = std::fread(&buf[size], 1, chunk, nfile);
+        size += numread;
+        PFMHeaderStatusEnum status = parseHeader(&buf[0], size, numread < chunk, header);
+        if (status != ePFMHeaderIncomplete) {
+            return status;
+        }
+    }
+}
+
+static std::string
+headerError(PFMHeaderStatusEnum status, const std::string& filename)
+{
+    switch (status) {
+        case ePFMHeaderNoSize:
+            return std::string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+        case ePFMHeaderInvalidSize:
+            return std::string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".";
+        default:
+            return std::string("PFM header not found in file \"") + filename + "\".";
+    }
+}
+
+static int
+seekFile(std::FILE* nfile, unsigned long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(nfile, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(nfile, (off_t)offset, SEEK_SET);
+#endif
 }
 
 ReadPFMPlugin::ReadPFMPlugin(OfxImageEffectHandle handle)
@@ -116,39 +238,175 @@ ReadPFMPlugin::~ReadPFMPlugin()
 {
 }
 
-template <class PIX, int srcC, int dstC>
-static void copyLine(PIX *image, int x1, int x2, int C, PIX *dstPix)
+// Converts the rows of samples of a window of the image to the destination pixels, in parallel.
+// The source rows are the rows of the file, from the bottom row of the window upwards, like the
+// OFX images.
+class PFMRowsConverter : public OFX::MultiThread::Processor
 {
-    assert(srcC == C);
+public:
+    PFMRowsConverter(const char* srcData,
+                     std::size_t srcRowBytes,
+                     int srcComps,
+                     bool byteSwap,
+                     const OfxRectI& window,
+                     float* pixelData,
+                     const OfxRectI& bounds,
+                     int pixelComponentCount,
+                     int rowBytes)
+    : _srcData(srcData)
+    , _srcRowBytes(srcRowBytes)
+    , _srcComps(srcComps)
+    , _byteSwap(byteSwap)
+    , _window(window)
+    , _pixelData(pixelData)
+    , _bounds(bounds)
+    , _nComps(pixelComponentCount)
+    , _rowBytes(rowBytes)
+    {
+    }
 
-    const PIX *srcPix = image + x1 * C;
-    dstPix += x1 * dstC;
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _window.y2 - _window.y1;
+        const int y1 = _window.y1 + (int)((long long)h * threadID / nThreads);
+        const int y2 = _window.y1 + (int)((long long)h * (threadID + 1) / nThreads);
+        // the samples are converted to this aligned buffer when the components are expanded
+        std::vector<float> row(_srcComps == _nComps ? 0 : (std::size_t)(_window.x2 - _window.x1) * _srcComps);
+        PFM::samplesToImage(_srcData, _window.y1, _srcRowBytes, _srcComps, _byteSwap,
+                            _window.x1, _window.x2, y1, y2,
+                            _pixelData, _bounds.x1, _bounds.y1, _nComps, _rowBytes, row.empty() ? 0 : &row[0]);
+    }
 
-    for(int x = x1; x < x2; ++x) {
-        if(srcC == 1) {
-            // alpha/grayscale image
-            for (int c = 0; c < std::min(dstC,3); ++c) {
-                dstPix[c] = srcPix[0];
-            }
-        } else {
-            // color image (if dstC == 1, only the red channel is extracted)
-            for (int c = 0; c < std::min(dstC,3); ++c) {
-                dstPix[c] = srcPix[c];
-            }
+private:
+    const char* _srcData;
+    std::size_t _srcRowBytes;
+    int _srcComps;
+    bool _byteSwap;
+    OfxRectI _window;
+    float* _pixelData;
+    OfxRectI _bounds;
+    int _nComps;
+    int _rowBytes;
+};
+
+// decode the render window of a file. The rows are converted in parallel using the host threads if useHostThreads
+// is true, else on the calling thread. *hasScale is set to false if the SCALE field of the header is undefined.
+// Does not call any other OFX suite, so that it can run on the read-ahead threads. Throws std::exception on error.
+static void
+decodeFile(const std::string& filename,
+           const OfxRectI& renderWindow,
+           float *pixelData,
+           const OfxRectI& bounds,
+           int pixelComponentCount,
+           int rowBytes,
+           bool useHostThreads,
+           bool* hasScale)
+{
+    // map the file if enabled, or read it with stdio (always on a network filesystem)
+    std::auto_ptr<IO::MappedFile> mapped;
+    {
+        const char* env = std::getenv(kMmapEnvVar);
+        if (env && std::atoi(env) != 0) {
+            mapped.reset(IO::MappedFile::open(filename));
+        }
+    }
+    std::FILE* nfile = 0;
+    if (!mapped.get()) {
+        nfile = std::fopen(filename.c_str(), "rb");
+        if (!nfile) {
+            throw std::runtime_error(std::string("Cannot open file \"") + filename + "\".");
+        }
+    }
+
+    // read PFM header
+    PFMHeader header;
+    PFMHeaderStatusEnum status = mapped.get() ? parseHeader(mapped->data(), mapped->size(), true, &header) : readHeader(nfile, &header);
+    if (status != ePFMHeaderOK) {
+        if (nfile) {
+            std::fclose(nfile);
+        }
+        throw std::runtime_error(headerError(status, filename));
+    }
+    *hasScale = header.hasScale;
+
+    const bool is_inverted = (header.scale > 0) != endianness();
+    const std::size_t srcRowBytes = (std::size_t)header.width * header.nComps * sizeof(float);
+
+    // only the rows and columns of the render window are converted
+    assert(0 <= renderWindow.x1 && renderWindow.x2 <= header.width &&
+           0 <= renderWindow.y1 && renderWindow.y2 <= header.height);
+    const OfxRectI imageBounds = { 0, 0, header.width, header.height };
+    OfxRectI window;
+    if (!intersect(renderWindow, imageBounds, &window) || isRectNull(window)) {
+        if (nfile) {
+            std::fclose(nfile);
+        }
+        return;
+    }
+
+    // PFM rows are stored from bottom to top, so that row y of the file is row y of the image
+    const unsigned long long windowOffset = header.dataOffset + (unsigned long long)window.y1 * srcRowBytes;
+    const std::size_t windowBytes = (std::size_t)(window.y2 - window.y1) * srcRowBytes;
+    std::vector<char> buffer;
+    const char* srcData = 0;
+    if (mapped.get()) {
+        if (windowOffset + windowBytes > mapped->size()) {
+            throw std::runtime_error("could not read all the image samples needed");
+        }
+        srcData = mapped->data() + windowOffset;
+    } else {
+        buffer.resize(windowBytes);
+        const bool ok = (seekFile(nfile, windowOffset) == 0 &&
+                         std::fread(&buffer[0], 1, windowBytes, nfile) == windowBytes);
+        std::fclose(nfile);
+        if (!ok) {
+            throw std::runtime_error("could not read all the image samples needed");
         }
-        if (dstC == 4) {
-            // Alpha is 0 on RGBA images to allow adding alpha using a Roto node.
-            // Alpha is set to 0 and premult is set to Opaque.
-            // That way, the Roto node can be conveniently used to draw a mask. This shouldn't
-            // disturb anything else in the process, since Opaque premult means that alpha should
-            // be considered as being 1 everywhere, whatever the actual alpha value is.
-            // see GenericWriterPlugin::render, if (userPremult == OFX::eImageOpaque...
-            dstPix[3] = 0.f; // alpha
+        srcData = &buffer[0];
+    }
+
+    PFMRowsConverter converter(srcData, srcRowBytes, header.nComps, is_inverted, window, pixelData, bounds, pixelComponentCount, rowBytes);
+    if (useHostThreads) {
+        converter.multiThread();
+    } else {
+        converter.multiThreadFunction(0, 1);
+    }
+}
+
+// read the bounds of a file from its header. Does not call any OFX suite.
+static bool
+readFrameBounds(const std::string& filename,
+                OfxRectI *bounds,
+                double *par,
+                bool *hasScale,
+                std::string *error)
+{
+    // read PFM header
+    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
+    if (!nfile) {
+        if (error) {
+            *error = std::string("Cannot open file \"") + filename + "\".";
         }
+        return false;
+    }
 
-        srcPix += srcC;
-        dstPix += dstC;
+    PFMHeader header;
+    PFMHeaderStatusEnum status = readHeader(nfile, &header);
+    std::fclose(nfile);
+    if (status != ePFMHeaderOK) {
+        if (error) {
+            *error = headerError(status, filename);
+        }
+        return false;
     }
+    *hasScale = header.hasScale;
+
+    bounds->x1 = 0;
+    bounds->x2 = header.width;
+    bounds->y1 = 0;
+    bounds->y2 = header.height;
+    *par = 1.;
+    return true;
 }
 
 void
@@ -169,123 +427,41 @@ ReadPFMPlugin::decode(const std::string& filename,
         return;
     }
 
-    // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int C = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        setPersistentMessage(OFX::Message::eMessageError, "", std::string("PFM header not found in file \"") + filename + "\".");
-        OFX::throwSuiteStatusException(kOfxStatFailed);
-        return;
-    }
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
-        std::fclose(nfile);
-        setPersistentMessage(OFX::Message::eMessageError, "", std::string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".");
+    bool hasScale = true;
+    try {
+        decodeFile(filename, renderWindow, pixelData, bounds, pixelComponentCount, rowBytes, true, &hasScale);
+    } catch (const std::exception& e) {
+        setPersistentMessage(OFX::Message::eMessageError, "", e.what());
         OFX::throwSuiteStatusException(kOfxStatFailed);
         return;
     }
-    if (W <= 0 || H <= 0 || 0xffff < W || 0xffff < H) {
-        std::fclose(nfile);
-        setPersistentMessage(OFX::Message::eMessageError, "", std::string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".");
-        OFX::throwSuiteStatusException(kOfxStatFailed);
-        return;
-    }
-
     clearPersistentMessage();
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, "%lf", &scale) != 1) {
+    if (!hasScale) {
         setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("SCALE field is undefined in file \"") + filename + "\".");
     }
+}
 
-    {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-
-    const bool is_inverted = (scale > 0) != endianness();
-    if (pfm_type == 'F') {
-        C = 3;
-    } else {
-        C = 1;
+bool
+ReadPFMPlugin::decodeForPrefetch(const std::string& filename,
+                                 OfxTime /*time*/,
+                                 int /*view*/,
+                                 const OfxRectI& renderWindow,
+                                 float *pixelData,
+                                 const OfxRectI& bounds,
+                                 OFX::PixelComponentEnum pixelComponents,
+                                 int pixelComponentCount,
+                                 const std::string& /*rawComponents*/,
+                                 int rowBytes)
+{
+    if (pixelComponents != OFX::ePixelComponentRGBA && pixelComponents != OFX::ePixelComponentRGB && pixelComponents != OFX::ePixelComponentAlpha) {
+        // render() reports the error
+        return false;
     }
+    // the read-ahead threads may not use the host threads: the rows are converted on this thread
+    bool hasScale;
+    decodeFile(filename, renderWindow, pixelData, bounds, pixelComponentCount, rowBytes, false, &hasScale);
 
-    std::size_t numpixels = W * C;
-    std::vector<float> image(numpixels);
-
-    assert(0 <= renderWindow.x1 && renderWindow.x2 <= W &&
-           0 <= renderWindow.y1 && renderWindow.y2 <= H);
-    const int x1 = renderWindow.x1;
-    const int x2 = renderWindow.x2;
-
-    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        std::size_t numread = std::fread(image.data(), 4, numpixels, nfile);
-        if (numread < numpixels) {
-            std::fclose(nfile);
-            setPersistentMessage(OFX::Message::eMessageError, "", "could not read all the image samples needed");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-            return;
-        }
-
-        if (is_inverted) {
-            invert_endianness(image.data(), numpixels);
-        }
-
-        // now copy to the dstImg
-        float* dstPix = (float*)((char*)pixelData + (y - bounds.y1)*rowBytes);
-        if (C == 1) {
-            switch (pixelComponentCount) {
-                case 1:
-                    copyLine<float,1,1>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 2:
-                    copyLine<float,1,2>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 3:
-                    copyLine<float,1,3>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 4:
-                    copyLine<float,1,4>(image.data(), x1, x2, C, dstPix);
-                    break;
-                default:
-                    break;
-            }
-        } else if (C == 3) {
-            switch (pixelComponentCount) {
-                case 1:
-                    copyLine<float,3,1>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 2:
-                    copyLine<float,3,2>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 3:
-                    copyLine<float,3,3>(image.data(), x1, x2, C, dstPix);
-                    break;
-                case 4:
-                    copyLine<float,3,4>(image.data(), x1, x2, C, dstPix);
-                    break;
-                default:
-                    break;
-            }
-        }
-    }
-    std::fclose(nfile);
+    return true;
 }
 
 bool
@@ -296,56 +472,29 @@ ReadPFMPlugin::getFrameBounds(const std::string& filename,
                               std::string *error)
 {
     assert(bounds && par);
-    // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        if (error) {
-            *error = std::string("PFM header not found in file \"") + filename + "\".";
-        }
-        return false;
-    }
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if ((err = std::sscanf(item, " %d %d", &W, &H)) < 2) {
-        std::fclose(nfile);
-        if (error) {
-            *error =  std::string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
-        }
+    bool hasScale;
+    if (!readFrameBounds(filename, bounds, par, &hasScale, error)) {
         return false;
     }
-    if (err == 2) {
-        clearPersistentMessage();
-        while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-            int c = std::fgetc(nfile);
-            (void)c;
-        }
-        if (std::sscanf(item, "%lf", &scale) != 1) {
-            setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("SCALE field is undefined in file \"") + filename + "\".");
-        }
+    clearPersistentMessage();
+    if (!hasScale) {
+        setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("SCALE field is undefined in file \"") + filename + "\".");
     }
-    std::fclose(nfile);
-
-    bounds->x1 = 0;
-    bounds->x2 = W;
-    bounds->y1 = 0;
-    bounds->y2 = H;
-    *par = 1.;
     return true;
 }
 
+bool
+ReadPFMPlugin::getFrameBoundsForPrefetch(const std::string& filename,
+                                         OfxTime /*time*/,
+                                         OfxRectI *bounds,
+                                         double *par)
+{
+    assert(bounds && par);
+    // the SCALE warning is reported when the frame is rendered
+    bool hasScale;
+    return readFrameBounds(filename, bounds, par, &hasScale, NULL);
+}
+
 void
 ReadPFMPlugin::onInputFileChanged(const std::string& /*newFile*/,
                                   bool setColorSpace,
@@ -370,20 +519,18 @@ ReadPFMPlugin::onInputFileChanged(const std::string& /*newFile*/,
     
     // read PFM header
     std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-    
-    char pfm_type = 0;
-    char item[1024] = { 0 };
-    int err = 0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("PFM header not found in file \"") + filename + "\".");
+    if (!nfile) {
+        setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("Cannot open file \"") + filename + "\".");
         return;
     }
+    PFMHeader header;
+    PFMHeaderStatusEnum status = readHeader(nfile, &header);
     std::fclose(nfile);
+    if (status == ePFMHeaderNoType) {
+        setPersistentMessage(OFX::Message::eMessageWarning, "", headerError(status, filename));
+        return;
+    }
+    const char pfm_type = header.type;
 
     // set the components of _outputClip
     *components = OFX::ePixelComponentNone;
@@ -434,7 +581,7 @@ ReadPFMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 {
     // make some pages and to things in
     PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(),
-                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles);
+                                                                    kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles, kSupportsPrefetch);
 
     GenericReaderDescribeInContextEnd(desc, context, page, "reference", "reference");
 }
@@ -24,14 +24,30 @@
 #include "WritePFM.h"
 
 #include <cstdio> // fopen, fwrite...
+#include <cstring>
+#include <sstream>
 #include <vector>
 #include <algorithm>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "ofxsMultiThread.h"
+
 #include "GenericOCIO.h"
 
 #include "GenericWriter.h"
 #include "ofxsMacros.h"
 
+#include "PFMRows.h"
+
 #define kPluginName "WritePFMOFX"
 #define kPluginGrouping "Image/Writers"
 #define kPluginDescription "Write PFM (Portable Float Map) files."
@@ -81,36 +97,56 @@ WritePFMPlugin::~WritePFMPlugin()
 {
 }
 
-template <class PIX, int srcC, int dstC>
-static void copyLine(const PIX* pixelData, int rowbytes, int W, int /*H*/, int C, int y, PIX *image)
+// Converts the rows of an image to the contiguous samples of a PFM file, in parallel.
+// PFM rows are stored from bottom to top, like the OFX images, and in the native byte order
+// (the sign of the scale tells the reader which one it is).
+class PFMRowsConverter : public OFX::MultiThread::Processor
 {
-    assert(srcC == C);
-
-    const PIX *srcPix = (const PIX*)((char*)pixelData + y*rowbytes);
-    PIX *dstPix = image;
-
-    for(int x = 0; x < W; ++x) {
-        if(srcC == 1) {
-            // alpha/grayscale image
-            for (int c = 0; c < std::min(dstC,3); ++c) {
-                dstPix[c] = srcPix[0];
-            }
-        } else {
-            // color image (if dstC == 1, only the red channel is extracted)
-            for (int c = 0; c < std::min(dstC,3); ++c) {
-                dstPix[c] = srcPix[c];
-            }
-        }
-        if (dstC == 4) {
-            dstPix[3] = 1.f; // alpha
-        }
-
-        srcPix += srcC;
-        dstPix += dstC;
+public:
+    PFMRowsConverter(const float* pixelData,
+                     int rowBytes,
+                     int width,
+                     int height,
+                     int spectrum,
+                     int depth,
+                     float* samples)
+    : _pixelData(pixelData)
+    , _rowBytes(rowBytes)
+    , _width(width)
+    , _height(height)
+    , _spectrum(spectrum)
+    , _depth(depth)
+    , _samples(samples)
+    {
     }
-    
-}
 
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int y1 = (int)((long long)_height * threadID / nThreads);
+        const int y2 = (int)((long long)_height * (threadID + 1) / nThreads);
+        PFM::imageToSamples(_pixelData, _rowBytes, _width, _spectrum, _depth, y1, y2, _samples);
+    }
+
+private:
+    const float* _pixelData;
+    int _rowBytes;
+    int _width;
+    int _height;
+    int _spectrum;
+    int _depth;
+    float* _samples;
+};
+
+// replace the destination file by the source file, atomically where the filesystem allows it
+static bool
+replaceFile(const std::string& src, const std::string& dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(src.c_str(), dst.c_str()) == 0;
+#endif
+}
 
 void WritePFMPlugin::encode(const std::string& filename, OfxTime /*time*/, const std::string& /*viewName*/, const float *pixelData, const OfxRectI& bounds, float /*pixelAspectRatio*/, OFX::PixelComponentEnum pixelComponents, int rowBytes)
 {
@@ -137,40 +173,45 @@ void WritePFMPlugin::encode(const std::string& filename, OfxTime /*time*/, const
             return;
     }
 
-    std::FILE *const nfile = std::fopen(filename.c_str(), "wb");
-    if (!nfile) {
-        setPersistentMessage(OFX::Message::eMessageError, "", "Cannot open file \"" + filename + "\"");
-        OFX::throwSuiteStatusException(kOfxStatFailed);
-        return;
-    }
     int width = (bounds.x2 - bounds.x1);
     int height = (bounds.y2 - bounds.y1);
 
     const int depth = (spectrum == 1 ? 1 : 3);
-    const unsigned int buf_size = width * depth;
-    std::vector<float> buffer(buf_size);
-    std::fill(buffer.begin(), buffer.end(), 0.);
-
-    std::fprintf(nfile, "P%c\n%u %u\n%d.0\n", (spectrum == 1 ? 'f' : 'F'), width, height, endianness() ? 1 : -1);
-
-    for (int y = height-1; y >= 0; --y) {
-
-        // now copy to the dstImg
-        if (depth == 1) {
-            assert(pixelComponents == OFX::ePixelComponentAlpha);
-            copyLine<float,1,1>(pixelData, rowBytes, width, height, spectrum, y, buffer.data());
-        } else if (depth == 3) {
-            assert(pixelComponents == OFX::ePixelComponentRGB || pixelComponents == OFX::ePixelComponentRGBA);
-            if (pixelComponents == OFX::ePixelComponentRGB) {
-                copyLine<float,3,3>(pixelData, rowBytes, width, height, spectrum, y, buffer.data());
-            } else if (pixelComponents == OFX::ePixelComponentRGBA) {
-                copyLine<float,4,3>(pixelData, rowBytes, width, height, spectrum, y, buffer.data());
-            }
-        }
-
-        std::fwrite(buffer.data(), sizeof(float), buf_size, nfile);
+
+    // convert the whole frame first, so that the file is written at once
+    const std::size_t numSamples = (std::size_t)width * height * depth;
+    IO::PooledMemory samplesMem(numSamples * sizeof(float), _memoryPool);
+    float* samples = (float*)samplesMem.lock();
+    PFMRowsConverter converter(pixelData, rowBytes, width, height, spectrum, depth, samples);
+    converter.multiThread();
+
+    // write to a temporary file in the same directory, which replaces the file once complete,
+    // so that readers never see a partially written file. The address of a local variable tells
+    // apart the concurrent calls of the process (e.g. two renders writing the same file).
+    std::stringstream tmpss;
+#ifdef _WIN32
+    tmpss << filename << ".tmp" << _getpid() << '.' << (const void*)&tmpss;
+#else
+    tmpss << filename << ".tmp" << getpid() << '.' << (const void*)&tmpss;
+#endif
+    const std::string tmpFilename = tmpss.str();
+
+    std::FILE *const nfile = std::fopen(tmpFilename.c_str(), "wb");
+    if (!nfile) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "Cannot open file \"" + tmpFilename + "\"");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
+    }
+    // the samples are large enough to bypass the stdio buffer
+    bool ok = (std::fprintf(nfile, "P%c\n%u %u\n%d.0\n", (spectrum == 1 ? 'f' : 'F'), width, height, endianness() ? 1 : -1) > 0 &&
+               std::fwrite(samples, sizeof(float), numSamples, nfile) == numSamples);
+    ok = (std::fclose(nfile) == 0) && ok;
+    if (!ok || !replaceFile(tmpFilename, filename)) {
+        std::remove(tmpFilename.c_str());
+        setPersistentMessage(OFX::Message::eMessageError, "", "Cannot write file \"" + filename + "\"");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
     }
-    std::fclose(nfile);
 }
 
 bool WritePFMPlugin::isImageFile(const std::string& /*fileExtension*/) const {
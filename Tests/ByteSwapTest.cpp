@@ -0,0 +1,87 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Checks that the SSE2 byte swap gives the same samples as the scalar one.
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "IOByteSwap.h"
+
+#ifdef IO_BYTESWAP_SSE2
+
+int
+main()
+{
+    int nErrors = 0;
+    const std::size_t maxN = 67;
+    const std::size_t maxOffset = 16;
+    // random bytes, which include nans and denormals once swapped
+    std::vector<char> src((maxN + 1) * sizeof(float) + maxOffset);
+    std::srand(1);
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        src[i] = (char)(std::rand() & 0xff);
+    }
+
+    for (std::size_t offset = 0; offset < maxOffset; ++offset) {
+        for (std::size_t n = 0; n <= maxN; ++n) {
+            // one sentinel after the row, to check that nothing is written past the end
+            std::vector<float> ref(n + 1, 42.f);
+            std::vector<float> dst(n + 1, 42.f);
+            IO::byteSwapCopyScalar(&src[offset], &ref[0], n);
+            IO::byteSwapCopySSE2(&src[offset], &dst[0], n);
+            if (std::memcmp(&ref[0], &dst[0], (n + 1) * sizeof(float)) != 0) {
+                std::printf("byte swap of %u samples at offset %u: SSE2 and scalar differ\n", (unsigned)n, (unsigned)offset);
+                ++nErrors;
+            }
+            // the scalar version itself: byte i of each sample goes to byte 3-i
+            for (std::size_t i = 0; i < n; ++i) {
+                const char* s = &src[offset + i * sizeof(float)];
+                const char* d = (const char*)&ref[i];
+                if (d[0] != s[3] || d[1] != s[2] || d[2] != s[1] || d[3] != s[0]) {
+                    std::printf("byte swap of sample %u at offset %u: wrong byte order\n", (unsigned)i, (unsigned)offset);
+                    ++nErrors;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (nErrors) {
+        std::printf("ByteSwapTest: %d errors\n", nErrors);
+        return 1;
+    }
+    std::printf("ByteSwapTest: OK\n");
+    return 0;
+}
+
+#else // !IO_BYTESWAP_SSE2
+
+int
+main()
+{
+    std::printf("ByteSwapTest: no SSE2 code on this architecture, skipped\n");
+    return 0;
+}
+
+#endif
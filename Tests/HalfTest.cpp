@@ -0,0 +1,143 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Checks that the F16C half conversion gives the same halves as floatToHalf().
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "IOHalf.h"
+
+#ifdef IO_HALF_X86
+
+static int nErrors = 0;
+
+static float
+bitsToFloat(unsigned int x)
+{
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// convert the floats in one call, and compare with the scalar conversion
+static void
+checkRow(const std::vector<float>& src)
+{
+    const std::size_t n = src.size();
+    // one sentinel after the row, to check that nothing is written past the end
+    std::vector<unsigned short> dst(n + 1, 0xdead);
+    IO::floatToHalfRowF16C(n ? &src[0] : 0, &dst[0], n);
+    for (std::size_t i = 0; i < n; ++i) {
+        const unsigned short ref = floatToHalf(src[i]);
+        if (dst[i] != ref && nErrors < 20) {
+            unsigned int x;
+            std::memcpy(&x, &src[i], sizeof(x));
+            std::printf("float 0x%08x: F16C gives 0x%04x, floatToHalf gives 0x%04x\n", x, dst[i], ref);
+        }
+        if (dst[i] != ref) {
+            ++nErrors;
+        }
+    }
+    if (dst[n] != 0xdead) {
+        std::printf("row of %u floats: the destination was written past the end\n", (unsigned)n);
+        ++nErrors;
+    }
+}
+
+// convert all the float bit patterns x = first + k*stride in [first,last), in rows of 1024
+static void
+checkRange(unsigned int first, unsigned int last, unsigned int stride)
+{
+    std::vector<float> src;
+    src.reserve(1024);
+    for (unsigned long long x = first; x < last; x += stride) {
+        src.push_back(bitsToFloat((unsigned int)x));
+        src.push_back(bitsToFloat((unsigned int)x | 0x80000000));
+        if (src.size() >= 1024) {
+            checkRow(src);
+            src.clear();
+        }
+    }
+    checkRow(src);
+}
+
+int
+main()
+{
+    if (!IO::cpuHasF16C()) {
+        std::printf("HalfTest: this CPU has no F16C instructions, skipped\n");
+        return 0;
+    }
+
+    // the floats that round to zero
+    checkRange(0, 0x33000000, 97);
+    // all the floats that round to a denormalized half, or to the smallest half
+    checkRange(0x33000000, 0x38800000, 1);
+    // a sweep of all the other floats, including overflow, inf and nan
+    checkRange(0x38800000, 0x80000000u, 97);
+
+    // the values around each rounding tie of the normalized halves
+    std::vector<float> ties;
+    for (unsigned int h = 0x38800000 >> 13; h < (0x7f800000 >> 13); ++h) {
+        const unsigned int tie = (h << 13) | 0x1000;
+        ties.push_back(bitsToFloat(tie - 1));
+        ties.push_back(bitsToFloat(tie));
+        ties.push_back(bitsToFloat(tie + 1));
+        ties.push_back(bitsToFloat((tie - 1) | 0x80000000));
+        ties.push_back(bitsToFloat(tie | 0x80000000));
+        ties.push_back(bitsToFloat((tie + 1) | 0x80000000));
+        if (ties.size() >= 1020) {
+            checkRow(ties);
+            ties.clear();
+        }
+    }
+    checkRow(ties);
+
+    // rows whose length is not a multiple of the vector size
+    const float values[] = {
+        0.f, -0.f, 1.f, -1.f, 0.5f, 65504.f, 65519.f, 65520.f, 1e-8f, 6.1e-5f, 3.14159f, -2.71828f,
+        bitsToFloat(0x7f800000), bitsToFloat(0xff800000), bitsToFloat(0x7fc00000), bitsToFloat(0x7f800001),
+        bitsToFloat(0x33000000), bitsToFloat(0x33000001), bitsToFloat(0x387fe000), bitsToFloat(0x387ff000),
+    };
+    const std::size_t nValues = sizeof(values) / sizeof(values[0]);
+    for (std::size_t n = 0; n <= nValues; ++n) {
+        checkRow(std::vector<float>(values, values + n));
+    }
+
+    if (nErrors) {
+        std::printf("HalfTest: %d errors\n", nErrors);
+        return 1;
+    }
+    std::printf("HalfTest: OK\n");
+    return 0;
+}
+
+#else // !IO_HALF_X86
+
+int
+main()
+{
+    std::printf("HalfTest: no F16C code on this architecture, skipped\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Checks that the PFM writer stores the rows from bottom to top, and that a write/read
+ * round trip gives back the image.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "PFMRows.h"
+
+static int nErrors = 0;
+
+static void
+check(bool ok, const char* what, int x, int y, int c)
+{
+    if (!ok) {
+        if (nErrors < 20) {
+            std::printf("%s: wrong sample at x=%d y=%d c=%d\n", what, x, y, c);
+        }
+        ++nErrors;
+    }
+}
+
+// a different value for each sample of the image
+static float
+pixelValue(int x, int y, int c)
+{
+    return y * 100.f + x + c * 0.25f;
+}
+
+// write an image of the given number of components, then read back a window of it
+static void
+testRoundTrip(int spectrum)
+{
+    const int width = 7;
+    const int height = 5;
+    const int depth = (spectrum == 1 ? 1 : 3);
+    // OFX rows are from bottom to top, and may be padded
+    const int rowBytes = (width * spectrum + 3) * sizeof(float);
+    std::vector<float> image(rowBytes / sizeof(float) * height);
+    for (int y = 0; y < height; ++y) {
+        float* pix = &image[y * rowBytes / sizeof(float)];
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < spectrum; ++c) {
+                pix[x * spectrum + c] = pixelValue(x, y, c);
+            }
+        }
+    }
+
+    // convert in two bands, like two threads would
+    std::vector<float> samples((std::size_t)width * height * depth);
+    PFM::imageToSamples(&image[0], rowBytes, width, spectrum, depth, 0, 2, &samples[0]);
+    PFM::imageToSamples(&image[0], rowBytes, width, spectrum, depth, 2, height, &samples[0]);
+
+    // the first row of the file is the bottom row of the image, and the alpha is dropped
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < depth; ++c) {
+                check(samples[((std::size_t)y * width + x) * depth + c] == pixelValue(x, y, c), "write", x, y, c);
+            }
+        }
+    }
+
+    // a copy of the file samples with the other endianness
+    std::vector<float> swapped(samples.size());
+    IO::byteSwapCopyScalar((const char*)&samples[0], &swapped[0], samples.size());
+
+    // read back the window [2,6)x[1,4), as the reader does from a file region that starts at its first row
+    const int x1 = 2, x2 = 6, y1 = 1, y2 = 4;
+    const std::size_t srcRowBytes = (std::size_t)width * depth * sizeof(float);
+    for (int byteSwap = 0; byteSwap < 2; ++byteSwap) {
+        const char* file = (const char*)(byteSwap ? &swapped[0] : &samples[0]);
+        const char* srcData = file + (std::size_t)y1 * srcRowBytes;
+        for (int nComps = 1; nComps <= 4; nComps += (nComps == 1 ? 2 : 1)) {
+            // the destination image covers the window plus a margin
+            const int boundsX1 = x1 - 1, boundsY1 = y1 - 1;
+            const int dstWidth = (x2 - x1) + 2;
+            const int dstRowBytes = dstWidth * nComps * sizeof(float);
+            std::vector<float> dst((std::size_t)dstWidth * nComps * ((y2 - y1) + 2), -1.f);
+            std::vector<float> row((std::size_t)(x2 - x1) * depth);
+            PFM::samplesToImage(srcData, y1, srcRowBytes, depth, byteSwap != 0, x1, x2, y1, y2,
+                                &dst[0], boundsX1, boundsY1, nComps, dstRowBytes, &row[0]);
+            for (int y = boundsY1; y < boundsY1 + (y2 - y1) + 2; ++y) {
+                for (int x = boundsX1; x < boundsX1 + dstWidth; ++x) {
+                    const bool inside = (x1 <= x && x < x2 && y1 <= y && y < y2);
+                    for (int c = 0; c < nComps; ++c) {
+                        const float v = dst[((std::size_t)(y - boundsY1) * dstWidth + (x - boundsX1)) * nComps + c];
+                        float expected;
+                        if (!inside) {
+                            expected = -1.f; // outside the window: untouched
+                        } else if (c == 3) {
+                            expected = 0.f; // alpha of RGBA images, see copyLine()
+                        } else {
+                            expected = pixelValue(x, y, (depth == 1 ? 0 : c));
+                        }
+                        check(v == expected, byteSwap ? "read (byte swapped)" : "read", x, y, c);
+                    }
+                }
+            }
+        }
+    }
+}
+
+int
+main()
+{
+    testRoundTrip(1);
+    testRoundTrip(3);
+    testRoundTrip(4);
+
+    if (nErrors) {
+        std::printf("PFMRowsTest: %d errors\n", nErrors);
+        return 1;
+    }
+    std::printf("PFMRowsTest: OK\n");
+    return 0;
+}
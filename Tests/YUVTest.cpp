@@ -0,0 +1,139 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Checks that the SSE2 YUV to RGB conversion and interleaving give the same pixels as the
+ * scalar ones.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "FFmpegYUV.h"
+
+#ifdef FFMPEG_SSE2
+
+static int nErrors = 0;
+
+// random samples in [lo,hi)
+static void
+fillRandom(std::vector<float>& v, float lo, float hi)
+{
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        v[i] = lo + (hi - lo) * (float)std::rand() / ((float)RAND_MAX + 1.f);
+    }
+}
+
+static void
+testYUVToRGB(int n, bool rec709)
+{
+    // the matrix of YUVToRGBConverter
+    const double kr = rec709 ? 0.2126 : 0.299;
+    const double kb = rec709 ? 0.0722 : 0.114;
+    const double kg = 1. - kr - kb;
+    const float crR = (float)( 2. * (1. - kr) );
+    const float cbG = (float)( -2. * kb * (1. - kb) / kg );
+    const float crG = (float)( -2. * kr * (1. - kr) / kg );
+    const float cbB = (float)( 2. * (1. - kb) );
+
+    // normalized samples, a little out of range to exercise the clamping
+    std::vector<float> y(n), cb(n), cr(n);
+    fillRandom(y, -0.1f, 1.1f);
+    fillRandom(cb, -0.6f, 0.6f);
+    fillRandom(cr, -0.6f, 0.6f);
+    std::vector<float> y2(y), cb2(cb), cr2(cr);
+
+    FFmpeg::yuvToRGBRowScalar(n ? &y[0] : 0, n ? &cb[0] : 0, n ? &cr[0] : 0, n, crR, cbG, crG, cbB);
+    FFmpeg::yuvToRGBRowSSE2(n ? &y2[0] : 0, n ? &cb2[0] : 0, n ? &cr2[0] : 0, n, crR, cbG, crG, cbB);
+    for (int i = 0; i < n; ++i) {
+        const float* ref[3] = { &y[i], &cb[i], &cr[i] };
+        const float* simd[3] = { &y2[i], &cb2[i], &cr2[i] };
+        for (int c = 0; c < 3; ++c) {
+            if ( !(0.f <= *ref[c] && *ref[c] <= 1.f) || std::fabs(*simd[c] - *ref[c]) > 1e-6f ) {
+                if (nErrors < 20) {
+                    std::printf("yuvToRGBRow, n=%d: pixel %d component %d is %g, expected %g\n", n, i, c, *simd[c], *ref[c]);
+                }
+                ++nErrors;
+            }
+        }
+    }
+}
+
+template <int nDstComp>
+static void
+testInterleave(int n)
+{
+    std::vector<float> r(n), g(n), b(n);
+    fillRandom(r, 0.f, 1.f);
+    fillRandom(g, 0.f, 1.f);
+    fillRandom(b, 0.f, 1.f);
+    // one sentinel pixel after the row, to check that nothing is written past the end
+    std::vector<float> ref(nDstComp * (n + 1), 42.f);
+    std::vector<float> dst(nDstComp * (n + 1), 42.f);
+    FFmpeg::interleaveRowScalar<nDstComp>(n ? &r[0] : 0, n ? &g[0] : 0, n ? &b[0] : 0, n, &ref[0]);
+    FFmpeg::interleaveRowSSE2<nDstComp>(n ? &r[0] : 0, n ? &g[0] : 0, n ? &b[0] : 0, n, &dst[0]);
+    if (std::memcmp(&ref[0], &dst[0], ref.size() * sizeof(float)) != 0) {
+        std::printf("interleaveRow<%d>, n=%d: SSE2 and scalar differ\n", nDstComp, n);
+        ++nErrors;
+    }
+    // the scalar version itself
+    for (int i = 0; i < n; ++i) {
+        if (ref[nDstComp * i] != r[i] || ref[nDstComp * i + 1] != g[i] || ref[nDstComp * i + 2] != b[i] ||
+            (nDstComp == 4 && ref[nDstComp * i + 3] != 0.f)) {
+            std::printf("interleaveRow<%d>, n=%d: wrong pixel %d\n", nDstComp, n, i);
+            ++nErrors;
+            break;
+        }
+    }
+}
+
+int
+main()
+{
+    std::srand(1);
+    // row lengths that are not multiples of the vector size
+    for (int n = 0; n <= 37; ++n) {
+        testYUVToRGB(n, false);
+        testYUVToRGB(n, true);
+        testInterleave<3>(n);
+        testInterleave<4>(n);
+    }
+    testYUVToRGB(1920, true);
+    testInterleave<4>(1920);
+
+    if (nErrors) {
+        std::printf("YUVTest: %d errors\n", nErrors);
+        return 1;
+    }
+    std::printf("YUVTest: OK\n");
+    return 0;
+}
+
+#else // !FFMPEG_SSE2
+
+int
+main()
+{
+    std::printf("YUVTest: no SSE2 code on this architecture, skipped\n");
+    return 0;
+}
+
+#endif